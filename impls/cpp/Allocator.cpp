@@ -0,0 +1,84 @@
+#include "Allocator.h"
+
+#if MAL_TRACING_GC
+#include <cstdlib>
+#include <cstring>
+#endif
+
+//  Both are zero before any constructor runs, so objects can be allocated
+//  during static initialisation.
+malAllocator::Block* malAllocator::s_free[CLASS_COUNT];
+malAllocator::Stats  malAllocator::s_stats;
+
+//  Carve a new slab into blocks of the size class, and return the first of
+//  them, linked to the rest.
+malAllocator::Block* malAllocator::refill(int sizeClass)
+{
+    s_stats.systemAllocations++;
+    size_t size = (sizeClass + 1) * GRANULE;
+#if MAL_TRACING_GC
+    void* memory;
+    if (posix_memalign(&memory, SLAB_SIZE, SLAB_SIZE) != 0) {
+        throw std::bad_alloc();
+    }
+    memset(memory, 0, sizeof(Slab));
+    slabs().insert(static_cast<Slab*>(memory));
+    char* slab = static_cast<char*>(memory) + SLAB_HEADER;
+    int count = (SLAB_SIZE - SLAB_HEADER) / size;
+#else
+    char* slab = static_cast<char*>(::operator new(SLAB_SIZE));
+    int count = SLAB_SIZE / size;
+#endif
+
+    Block* first = reinterpret_cast<Block*>(slab);
+    Block* block = first;
+    for (int i = 1; i < count; i++) {
+        Block* next = reinterpret_cast<Block*>(slab + i * size);
+        block->next = next;
+        block = next;
+    }
+    block->next = NULL;
+    return first;
+}
+
+#if MAL_TRACING_GC
+//  Neither is ever freed, as objects may still be freed as the program
+//  exits.
+std::set<malAllocator::Slab*>& malAllocator::slabs()
+{
+    static auto slabs = new std::set<Slab*>;
+    return *slabs;
+}
+
+std::unordered_set<void*>& malAllocator::largeBlocks()
+{
+    static auto blocks = new std::unordered_set<void*>;
+    return *blocks;
+}
+
+void* malAllocator::allocateLarge(size_t size)
+{
+    void* block = ::operator new(size);
+    largeBlocks().insert(block);
+    return block;
+}
+
+void malAllocator::freeLarge(void* block)
+{
+    largeBlocks().erase(block);
+    ::operator delete(block);
+}
+
+bool malAllocator::isBlock(const void* address)
+{
+    if (reinterpret_cast<uintptr_t>(address) % GRANULE != 0) {
+        return false;
+    }
+    Slab* slab = slabOf(address);
+    if (slabs().count(slab)) {
+        size_t granule = granuleOf(address);
+        return (slab->allocated[granule / 64] >> (granule % 64)) & 1;
+    }
+    return largeBlocks().count(const_cast<void*>(address)) != 0;
+}
+#endif
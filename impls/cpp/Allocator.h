@@ -0,0 +1,190 @@
+#ifndef INCLUDE_ALLOCATOR_H
+#define INCLUDE_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+//  Whether values and environments are freed by the tracing collector
+//  rather than when their count drops to zero. Set by the Makefile, see
+//  MEMORY there.
+#ifndef MAL_TRACING_GC
+#define MAL_TRACING_GC 0
+#endif
+
+#if MAL_TRACING_GC
+#include <set>
+#include <unordered_set>
+#include <vector>
+#endif
+
+//  The allocator for every refcounted object. Blocks of up to MAX_SIZE
+//  bytes are taken from a free list for their size class, which is refilled
+//  a slab at a time, and go back on it when they're freed. Slabs are never
+//  given back to the system. Larger blocks are left to operator new. The
+//  interpreter is single-threaded, so nothing here is locked.
+//
+//  When values are traced, each slab also records which of its blocks are
+//  allocated, so the collector can walk every object in the heap.
+class malAllocator {
+public:
+    enum {
+        GRANULE   = 16,
+        MAX_SIZE  = 512,
+        SLAB_SIZE = 64 * 1024,
+    };
+
+    //  Counts since the program started, of the blocks allocated and freed
+    //  here, and of the calls made to the system allocator for them, and
+    //  the total size of the blocks currently allocated.
+    struct Stats {
+        size_t allocations;
+        size_t frees;
+        size_t systemAllocations;
+        size_t bytesInUse;
+    };
+
+    static void* allocate(size_t size);
+    static void free(void* block, size_t size);
+
+    static const Stats& stats() { return s_stats; }
+
+#if MAL_TRACING_GC
+    //  Calls visit with every allocated block. Blocks may be freed by visit
+    //  itself, but none may be allocated until it returns.
+    template <class Visit>
+    static void forEachBlock(Visit visit);
+
+    //  Whether address is the start of an allocated block.
+    static bool isBlock(const void* address);
+#endif
+
+private:
+    struct Block {
+        Block* next;
+    };
+
+    enum { CLASS_COUNT = MAX_SIZE / GRANULE };
+
+    static int classOf(size_t size) { return (size - 1) / GRANULE; }
+    static Block* refill(int sizeClass);
+
+#if MAL_TRACING_GC
+    //  Starts each slab, which is aligned to SLAB_SIZE so that a block's
+    //  slab can be found from its address. Each bit marks the granule that
+    //  an allocated block starts at.
+    struct Slab {
+        uint64_t allocated[SLAB_SIZE / GRANULE / 64];
+    };
+
+    enum { SLAB_HEADER = (sizeof(Slab) + GRANULE - 1) / GRANULE * GRANULE };
+
+    static Slab* slabOf(const void* block) {
+        return reinterpret_cast<Slab*>(
+            reinterpret_cast<uintptr_t>(block) & ~uintptr_t(SLAB_SIZE - 1));
+    }
+
+    static size_t granuleOf(const void* block) {
+        return (reinterpret_cast<uintptr_t>(block) & (SLAB_SIZE - 1))
+                / GRANULE;
+    }
+
+    static void setAllocated(const void* block, bool allocated);
+    static void* allocateLarge(size_t size);
+    static void freeLarge(void* block);
+
+    static std::set<Slab*>& slabs();
+    static std::unordered_set<void*>& largeBlocks();
+#endif
+
+    static Block* s_free[CLASS_COUNT];
+    static Stats  s_stats;
+};
+
+inline void* malAllocator::allocate(size_t size)
+{
+    s_stats.allocations++;
+    s_stats.bytesInUse += size;
+    if (size > MAX_SIZE) {
+        s_stats.systemAllocations++;
+#if MAL_TRACING_GC
+        return allocateLarge(size);
+#else
+        return ::operator new(size);
+#endif
+    }
+
+    int sizeClass = classOf(size);
+    Block* block = s_free[sizeClass];
+    if (!block) {
+        block = refill(sizeClass);
+    }
+    s_free[sizeClass] = block->next;
+#if MAL_TRACING_GC
+    setAllocated(block, true);
+#endif
+    return block;
+}
+
+inline void malAllocator::free(void* block, size_t size)
+{
+    s_stats.frees++;
+    s_stats.bytesInUse -= size;
+    if (size > MAX_SIZE) {
+#if MAL_TRACING_GC
+        freeLarge(block);
+#else
+        ::operator delete(block);
+#endif
+        return;
+    }
+
+#if MAL_TRACING_GC
+    setAllocated(block, false);
+#endif
+    int sizeClass = classOf(size);
+    Block* freed = static_cast<Block*>(block);
+    freed->next = s_free[sizeClass];
+    s_free[sizeClass] = freed;
+}
+
+#if MAL_TRACING_GC
+inline void malAllocator::setAllocated(const void* block, bool allocated)
+{
+    size_t granule = granuleOf(block);
+    uint64_t bit = uint64_t(1) << (granule % 64);
+    uint64_t& word = slabOf(block)->allocated[granule / 64];
+    word = allocated ? (word | bit) : (word & ~bit);
+}
+
+template <class Visit>
+void malAllocator::forEachBlock(Visit visit)
+{
+    std::set<Slab*>& all = slabs();
+    for (auto it = all.begin(), end = all.end(); it != end; ++it) {
+        Slab* slab = *it;
+        char* base = reinterpret_cast<char*>(slab);
+        for (int w = 0; w < SLAB_SIZE / GRANULE / 64; w++) {
+            uint64_t pending = slab->allocated[w];
+            while (pending) {
+                int bit = __builtin_ctzll(pending);
+                pending &= pending - 1;
+                // Visiting an earlier block may have freed this one.
+                if (slab->allocated[w] & (uint64_t(1) << bit)) {
+                    visit(base + (w * 64 + bit) * GRANULE);
+                }
+            }
+        }
+    }
+
+    // Copied first, as visit may free some of them.
+    std::vector<void*> large(largeBlocks().begin(), largeBlocks().end());
+    for (auto it = large.begin(), end = large.end(); it != end; ++it) {
+        if (largeBlocks().count(*it)) {
+            visit(*it);
+        }
+    }
+}
+#endif
+
+#endif // INCLUDE_ALLOCATOR_H
@@ -0,0 +1,857 @@
+#include "Compiler.h"
+#include "Environment.h"
+#include "Types.h"
+
+static const malSymbol* internSymbol(const char* name)
+{
+    return STATIC_CAST(malSymbol, mal::symbol(name));
+}
+
+static const malSymbol* const s_catch = internSymbol("catch*");
+static const malSymbol* const s_def = internSymbol("def!");
+static const malSymbol* const s_defmacro = internSymbol("defmacro!");
+static const malSymbol* const s_do = internSymbol("do");
+static const malSymbol* const s_fn = internSymbol("fn*");
+static const malSymbol* const s_if = internSymbol("if");
+static const malSymbol* const s_let = internSymbol("let*");
+static const malSymbol* const s_macroexpand = internSymbol("macroexpand");
+static const malSymbol* const s_quasiquote = internSymbol("quasiquote");
+static const malSymbol* const s_quasiquoteexpand =
+    internSymbol("quasiquoteexpand");
+static const malSymbol* const s_quote = internSymbol("quote");
+static const malSymbol* const s_try = internSymbol("try*");
+
+//  Each instruction is an opcode followed by its operands, all ints. The
+//  stack effect of each is shown as ( before -- after ).
+enum Opcode {
+    OP_CONST,           // index                    ( -- value )
+    OP_LOCAL,           // depth slot symbol        ( -- value )
+    OP_GLOBAL,          // index                    ( -- value )
+    OP_POP,             //                          ( value -- )
+    OP_JUMP,            // target                   ( -- )
+    OP_JUMP_IF_FALSE,   // target                   ( test -- )
+    OP_MACRO,           // site resume              ( op -- op | value )
+    OP_TAIL_MACRO,      // site                     ( op -- op )
+    OP_CALL,            // argc                     ( op args -- value )
+    OP_TAIL_CALL,       // argc                     ( op args -- )
+    OP_RETURN,          //                          ( value -- )
+    OP_CLOSURE,         // index                    ( -- lambda )
+    OP_DEF,             // symbol                   ( value -- value )
+    OP_DEFMACRO,        // symbol                   ( lambda -- macro )
+    OP_ENTER,           // layout                   ( -- )
+    OP_SET_SLOT,        // slot                     ( value -- )
+    OP_LEAVE,           //                          ( -- )
+    OP_TRY,             // handler resume layout    ( -- )
+    OP_END_TRY,         //                          ( -- )
+    OP_MACROEXPAND,     // form                     ( -- value )
+    OP_VECTOR,          // count                    ( items -- vector )
+    OP_HASH,            // count                    ( keys values -- hash )
+    OP_QUASIQUOTE,      // template                 ( holes -- form )
+    OP_FAIL,            // message                  ( -- )
+};
+
+class Chunk;
+typedef RefCountedPtr<const Chunk> ChunkPtr;
+
+//  The compiled body of a fn*, from which OP_CLOSURE makes a lambda.
+struct FnProto {
+    malFrameLayoutPtr params;
+    malValuePtr       body;
+    ChunkPtr          chunk;
+};
+
+//  A call whose operator is a symbol, and so may turn out to name a macro.
+//  It keeps the compiled expansion for as long as it names the same one.
+struct CallSite {
+    malValuePtr  form;
+    malScopePtr  scope;
+
+    mutable malValuePtr macro;
+    mutable ChunkPtr    expansion;
+};
+
+//  The bytecode for one form or function body, and the tables its
+//  instructions index.
+class Chunk : public malCode {
+public:
+    virtual malValuePtr run(const malEnvPtr& env) const;
+
+    const int* code() const { return &m_code[0]; }
+
+    malValuePtr constant(int index) const { return m_consts[index]; }
+    const malSymbol* symbol(int index) const {
+        return STATIC_CAST(malSymbol, m_consts[index]);
+    }
+    const malGlobalRef* global(int index) const {
+        return m_globals[index].ptr();
+    }
+    const malFrameLayoutPtr& layout(int index) const {
+        return m_layouts[index];
+    }
+    const FnProto& fn(int index) const { return m_fns[index]; }
+    const malTemplate* quasi(int index) const {
+        return m_templates[index].ptr();
+    }
+    const String& message(int index) const { return m_messages[index]; }
+
+    //  Return the compiled expansion of the call at site by macro.
+    ChunkPtr expand(int site, const malLambda* macro) const;
+
+private:
+    friend class BytecodeCompiler;
+
+    std::vector<int>                          m_code;
+    malValueVec                               m_consts;
+    std::vector<RefCountedPtr<malGlobalRef> > m_globals;
+    std::vector<malFrameLayoutPtr>            m_layouts;
+    std::vector<FnProto>                      m_fns;
+    std::vector<CallSite>                     m_sites;
+    std::vector<malTemplatePtr>               m_templates;
+    StringVec                                 m_messages;
+};
+
+class BytecodeCompiler {
+public:
+    //  Compile form, to be run in scope, into a chunk of its own.
+    static ChunkPtr compile(const malValuePtr& form, const malScopePtr& scope);
+
+private:
+    BytecodeCompiler(Chunk* chunk, const malScopePtr& scope)
+        : m_chunk(chunk), m_scope(scope) { }
+
+    //  Emit the code for form. In tail position, that code returns from
+    //  the chunk, otherwise it leaves the value on the stack.
+    void compile(const malValuePtr& form, bool tail);
+
+    void compileList(const malValuePtr& form, bool tail);
+    bool compileSpecial(const malSymbol* special, const malList* list,
+                        bool tail);
+    void compileSymbol(const malSymbol* symbol);
+    void compileCall(const malValuePtr& form, bool tail);
+
+    void compileDo(const malList* list, bool tail);
+    void compileFn(const malList* list);
+    void compileIf(const malList* list, bool tail);
+    void compileLet(const malList* list, bool tail);
+    void compileTry(const malList* list, bool tail);
+    void compileQuasiquote(const malValuePtr& form, bool tail);
+
+    void emit(int op) { m_chunk->m_code.push_back(op); }
+    void emit(int op, int a) { emit(op); emit(a); }
+    void emit(int op, int a, int b) { emit(op, a); emit(b); }
+    void emit(int op, int a, int b, int c) { emit(op, a, b); emit(c); }
+
+    //  Emit a forward jump, and return where to patch in its target.
+    int emitJump(int op) { emit(op, 0); return here() - 1; }
+    void patch(int at) { m_chunk->m_code[at] = here(); }
+    int here() const { return m_chunk->m_code.size(); }
+
+    void emitConst(malValuePtr value, bool tail) {
+        emit(OP_CONST, addConst(value));
+        emitReturn(tail);
+    }
+    void emitReturn(bool tail) {
+        if (tail) {
+            emit(OP_RETURN);
+        }
+    }
+
+    int addConst(malValuePtr value) {
+        m_chunk->m_consts.push_back(value);
+        return m_chunk->m_consts.size() - 1;
+    }
+    int addLayout(const malFrameLayoutPtr& layout) {
+        m_chunk->m_layouts.push_back(layout);
+        return m_chunk->m_layouts.size() - 1;
+    }
+
+    Chunk*      m_chunk;
+    malScopePtr m_scope;
+};
+
+ChunkPtr BytecodeCompiler::compile(const malValuePtr& form,
+                                   const malScopePtr& scope)
+{
+    Chunk* chunk = new Chunk;
+    ChunkPtr ret(chunk);
+    BytecodeCompiler(chunk, scope).compile(form, true);
+    return ret;
+}
+
+void BytecodeCompiler::compile(const malValuePtr& form, bool tail)
+{
+    if (form.isInteger()) {
+        emitConst(form, tail);
+        return;
+    }
+    switch (form.type()) {
+        case TYPE_SYMBOL:
+            compileSymbol(STATIC_CAST(malSymbol, form));
+            emitReturn(tail);
+            return;
+
+        case TYPE_LIST:
+            compileList(form, tail);
+            return;
+
+        case TYPE_VECTOR: {
+            const malVector* vector = STATIC_CAST(malVector, form);
+            for (int i = 0; i < vector->count(); i++) {
+                compile(vector->item(i), false);
+            }
+            emit(OP_VECTOR, vector->count());
+            emitReturn(tail);
+            return;
+        }
+
+        case TYPE_HASH: {
+            const malHash* hash = STATIC_CAST(malHash, form);
+            if (hash->isEvaluated()) {
+                emitConst(form, tail);
+                return;
+            }
+            malValueVec items;
+            hash->entries(items);
+            for (auto it = items.begin(); it != items.end(); it += 2) {
+                emit(OP_CONST, addConst(it[0]));
+                compile(it[1], false);
+            }
+            emit(OP_HASH, hash->count());
+            emitReturn(tail);
+            return;
+        }
+
+        default:
+            emitConst(form, tail);
+            return;
+    }
+}
+
+void BytecodeCompiler::compileList(const malValuePtr& form, bool tail)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    if (list->isEmpty()) {
+        emitConst(form, tail);
+        return;
+    }
+
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        // A malformed special form raises its error when it's run, as it
+        // would in EVAL, so drop whatever was emitted for it.
+        int start = here();
+        try {
+            if (compileSpecial(symbol->identity(), list, tail)) {
+                return;
+            }
+        }
+        catch (String& s) {
+            m_chunk->m_code.resize(start);
+            m_chunk->m_messages.push_back(s);
+            emit(OP_FAIL, m_chunk->m_messages.size() - 1);
+            return;
+        }
+    }
+    compileCall(form, tail);
+}
+
+//  Emit the code for a special form, or return false if it isn't one.
+bool BytecodeCompiler::compileSpecial(const malSymbol* special,
+                                      const malList* list, bool tail)
+{
+    int argCount = list->count() - 1;
+
+    if ((special == s_def) || (special == s_defmacro)) {
+        bool isMacro = (special == s_defmacro);
+        checkArgsIs(isMacro ? "defmacro!" : "def!", 2, argCount);
+        const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+        compile(list->item(2), false);
+        emit(isMacro ? OP_DEFMACRO : OP_DEF,
+             addConst(const_cast<malSymbol*>(id->identity())));
+        emitReturn(tail);
+        return true;
+    }
+
+    if (special == s_do) {
+        compileDo(list, tail);
+        return true;
+    }
+
+    if (special == s_fn) {
+        compileFn(list);
+        emitReturn(tail);
+        return true;
+    }
+
+    if (special == s_if) {
+        compileIf(list, tail);
+        return true;
+    }
+
+    if (special == s_let) {
+        compileLet(list, tail);
+        return true;
+    }
+
+    if (special == s_macroexpand) {
+        checkArgsIs("macroexpand", 1, argCount);
+        emit(OP_MACROEXPAND, addConst(list->item(1)));
+        emitReturn(tail);
+        return true;
+    }
+
+    if (special == s_quasiquoteexpand) {
+        checkArgsIs("quasiquote", 1, argCount);
+        emitConst(quasiquote(list->item(1)), tail);
+        return true;
+    }
+
+    if (special == s_quasiquote) {
+        checkArgsIs("quasiquote", 1, argCount);
+        compileQuasiquote(list->item(1), tail);
+        return true;
+    }
+
+    if (special == s_quote) {
+        checkArgsIs("quote", 1, argCount);
+        emitConst(list->item(1), tail);
+        return true;
+    }
+
+    if (special == s_try) {
+        compileTry(list, tail);
+        return true;
+    }
+
+    return false;
+}
+
+void BytecodeCompiler::compileSymbol(const malSymbol* symbol)
+{
+    int depth, slot;
+    if (malScope::resolve(m_scope.ptr(), symbol, depth, slot)) {
+        emit(OP_LOCAL, depth, slot,
+             addConst(const_cast<malSymbol*>(symbol->identity())));
+        return;
+    }
+    m_chunk->m_globals.push_back(
+        new malGlobalRef(*symbol, malScope::layoutOf(m_scope.ptr())));
+    emit(OP_GLOBAL, m_chunk->m_globals.size() - 1);
+}
+
+void BytecodeCompiler::compileCall(const malValuePtr& form, bool tail)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    compile(list->item(0), false);
+
+    int resume = -1;
+    if (list->item(0).type() == TYPE_SYMBOL) {
+        CallSite site = { form, m_scope };
+        m_chunk->m_sites.push_back(site);
+        int index = m_chunk->m_sites.size() - 1;
+        if (tail) {
+            emit(OP_TAIL_MACRO, index);
+        }
+        else {
+            emit(OP_MACRO, index, 0);
+            resume = here() - 1;
+        }
+    }
+
+    for (int i = 1; i < list->count(); i++) {
+        compile(list->item(i), false);
+    }
+    emit(tail ? OP_TAIL_CALL : OP_CALL, list->count() - 1);
+    if (resume >= 0) {
+        patch(resume);
+    }
+}
+
+void BytecodeCompiler::compileDo(const malList* list, bool tail)
+{
+    int argCount = checkArgsAtLeast("do", 1, list->count() - 1);
+    for (int i = 1; i < argCount; i++) {
+        compile(list->item(i), false);
+        emit(OP_POP);
+    }
+    compile(list->item(argCount), tail);
+}
+
+void BytecodeCompiler::compileFn(const malList* list)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    malSymbolVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        params.push_back(VALUE_CAST(malSymbol, bindings->item(i)));
+    }
+    malFrameLayoutPtr layout(new malFrameLayout(params));
+    malScopePtr scope(new malScope(layout, m_scope.ptr()));
+    FnProto fn = { layout, list->item(2), compile(list->item(2), scope) };
+    m_chunk->m_fns.push_back(fn);
+    emit(OP_CLOSURE, m_chunk->m_fns.size() - 1);
+}
+
+void BytecodeCompiler::compileIf(const malList* list, bool tail)
+{
+    int argCount = checkArgsBetween("if", 2, 3, list->count() - 1);
+    compile(list->item(1), false);
+    int otherwise = emitJump(OP_JUMP_IF_FALSE);
+    compile(list->item(2), tail);
+    int end = tail ? -1 : emitJump(OP_JUMP);
+    patch(otherwise);
+    if (argCount == 3) {
+        compile(list->item(3), tail);
+    }
+    else {
+        emitConst(mal::nilValue(), tail);
+    }
+    if (end >= 0) {
+        patch(end);
+    }
+}
+
+void BytecodeCompiler::compileLet(const malList* list, bool tail)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+    malFrameLayoutPtr layout(new malFrameLayout);
+    std::vector<int> slots;
+    for (int i = 0; i < count; i += 2) {
+        slots.push_back(layout->add(VALUE_CAST(malSymbol, bindings->item(i))));
+    }
+
+    // As in EVAL, every binding is in scope throughout, and an initialiser
+    // which sees one before it's set falls back to searching by name.
+    malScopePtr outer = m_scope;
+    m_scope = new malScope(layout, outer.ptr());
+    emit(OP_ENTER, addLayout(layout));
+    for (int i = 0; i < count; i += 2) {
+        compile(bindings->item(i + 1), false);
+        emit(OP_SET_SLOT, slots[i / 2]);
+    }
+    compile(list->item(2), tail);
+    if (!tail) {
+        emit(OP_LEAVE);
+    }
+    m_scope = outer;
+}
+
+void BytecodeCompiler::compileTry(const malList* list, bool tail)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        compile(list->item(1), tail);
+        return;
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol,
+        catchBlock->item(0))->identity() == s_catch,
+        "catch block must begin with catch*");
+
+    malFrameLayoutPtr layout(new malFrameLayout);
+    layout->add(VALUE_CAST(malSymbol, catchBlock->item(1)));
+
+    // The body can't make a tail call, as it must return through here for
+    // the handler to stay in place.
+    emit(OP_TRY, 0, 0, addLayout(layout));
+    int handler = here() - 3;
+    compile(list->item(1), false);
+    emit(OP_END_TRY);
+    patch(handler + 1);
+    int end = -1;
+    if (tail) {
+        emit(OP_RETURN);
+    }
+    else {
+        end = emitJump(OP_JUMP);
+    }
+
+    patch(handler);
+    malScopePtr outer = m_scope;
+    m_scope = new malScope(layout, outer.ptr());
+    compile(catchBlock->item(2), tail);
+    if (!tail) {
+        emit(OP_LEAVE);
+        patch(end);
+    }
+    m_scope = outer;
+}
+
+void BytecodeCompiler::compileQuasiquote(const malValuePtr& form, bool tail)
+{
+    malTemplatePtr quasi(new malTemplate(form));
+    if (malValuePtr unquoted = quasi->unquoted()) {
+        compile(unquoted, tail);
+        return;
+    }
+    for (int i = 0; i < quasi->holeCount(); i++) {
+        compile(quasi->hole(i), false);
+    }
+    m_chunk->m_templates.push_back(quasi);
+    emit(OP_QUASIQUOTE, m_chunk->m_templates.size() - 1);
+    emitReturn(tail);
+}
+
+ChunkPtr Chunk::expand(int index, const malLambda* macro) const
+{
+    const CallSite& site = m_sites[index];
+    if (site.macro.ptr() != macro) {
+        const malList* list = STATIC_CAST(malList, site.form);
+        malValuePtr expansion = macro->apply(list->begin() + 1, list->end());
+        site.expansion = BytecodeCompiler::compile(expansion, site.scope);
+        site.macro = const_cast<malLambda*>(macro);
+    }
+    return site.expansion;
+}
+
+//  Runs a chunk, and any bytecode lambdas it calls, in a loop of its own.
+//  Calls to builtins, and anything they call back, run in a new VM.
+class VM {
+public:
+    VM() : m_stack(valueStack()), m_base(m_stack.top()) { }
+    ~VM() { m_stack.truncate(m_base); }
+
+    malValuePtr run(const Chunk* chunk, const malEnvPtr& env);
+
+private:
+    struct Frame {
+        Frame(const Chunk* chunk, const malEnvPtr& env, int base)
+            : chunk(chunk), pc(0), env(env), base(base) { }
+
+        ChunkPtr  chunk;
+        int       pc;
+        malEnvPtr env;
+        int       base;     // the stack top when the frame was entered
+    };
+
+    struct Handler {
+        int               frame;
+        int               top;
+        int               handler;
+        int               resume;
+        malFrameLayoutPtr layout;
+        malEnvPtr         env;
+    };
+
+    malValuePtr dispatch();
+
+    //  Look up a local which the compiler resolved to depth and slot.
+    static malValuePtr local(const malEnvPtr& env, int depth, int slot,
+                             const malSymbol* symbol);
+
+    malValueStack&       m_stack;
+    const int            m_base;
+    std::vector<Frame>   m_frames;
+    std::vector<Handler> m_handlers;
+};
+
+malValuePtr Chunk::run(const malEnvPtr& env) const
+{
+    VM vm;
+    return vm.run(this, env);
+}
+
+malValuePtr VM::run(const Chunk* chunk, const malEnvPtr& env)
+{
+    m_frames.push_back(Frame(chunk, env, m_base));
+    while (1) {
+        malValuePtr excVal;
+        try {
+            return dispatch();
+        }
+        catch(String& s) {
+            if (m_handlers.empty()) {
+                throw;
+            }
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            if (m_handlers.empty()) {
+                throw;
+            }
+        }
+        catch(malValuePtr& o) {
+            if (m_handlers.empty()) {
+                throw;
+            }
+            excVal = o;
+        };
+
+        Handler handler = m_handlers.back();
+        m_handlers.pop_back();
+        m_frames.erase(m_frames.begin() + handler.frame + 1, m_frames.end());
+        m_stack.truncate(handler.top);
+        Frame& frame = m_frames.back();
+        if (excVal) {
+            frame.env = new malEnv(handler.env, handler.layout);
+            frame.env->setSlot(0, excVal);
+            frame.pc = handler.handler;
+        }
+        else {
+            // Not an error, continue as if we got nil
+            frame.env = handler.env;
+            m_stack.push(mal::nilValue());
+            frame.pc = handler.resume;
+        }
+    }
+}
+
+malValuePtr VM::dispatch()
+{
+    Frame* frame = &m_frames.back();
+    const int* code = frame->chunk->code();
+    int pc = frame->pc;
+
+    while (1) {
+        switch (code[pc++]) {
+            case OP_CONST:
+                m_stack.push(frame->chunk->constant(code[pc++]));
+                break;
+
+            case OP_LOCAL: {
+                int depth = code[pc++];
+                int slot = code[pc++];
+                const malSymbol* symbol = frame->chunk->symbol(code[pc++]);
+                m_stack.push(local(frame->env, depth, slot, symbol));
+                break;
+            }
+
+            case OP_GLOBAL: {
+                const malGlobalRef* ref = frame->chunk->global(code[pc++]);
+                malValuePtr value = ref->lookup(frame->env);
+                MAL_CHECK(value, "'%s' not found", ref->value().c_str());
+                m_stack.push(value);
+                break;
+            }
+
+            case OP_POP:
+                m_stack.pop();
+                break;
+
+            case OP_JUMP:
+                pc = code[pc];
+                break;
+
+            case OP_JUMP_IF_FALSE: {
+                int target = code[pc++];
+                if (!m_stack.pop().isTrue()) {
+                    pc = target;
+                }
+                break;
+            }
+
+            case OP_MACRO:
+            case OP_TAIL_MACRO: {
+                bool tail = (code[pc - 1] == OP_TAIL_MACRO);
+                int site = code[pc++];
+                int resume = tail ? 0 : code[pc++];
+                const malLambda* macro =
+                    DYNAMIC_CAST(malLambda, m_stack.peek());
+                if (!macro || !macro->isMacro()) {
+                    break;
+                }
+
+                // The expansion runs in the same frame as the call would.
+                ChunkPtr expansion = frame->chunk->expand(site, macro);
+                m_stack.pop();
+                if (tail) {
+                    m_stack.truncate(frame->base);
+                    frame->chunk = expansion;
+                }
+                else {
+                    frame->pc = resume;
+                    malEnvPtr env = frame->env;
+                    m_frames.push_back(Frame(expansion.ptr(), env,
+                                             m_stack.top()));
+                    frame = &m_frames.back();
+                }
+                code = frame->chunk->code();
+                pc = 0;
+                break;
+            }
+
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                bool tail = (code[pc - 1] == OP_TAIL_CALL);
+                int argc = code[pc++];
+                int opIndex = m_stack.top() - argc - 1;
+                malValuePtr op = m_stack[opIndex];
+                malValueIter argsBegin = m_stack.at(opIndex + 1);
+                malValueIter argsEnd = argsBegin + argc;
+
+                // Every lambda with code was compiled by this engine, as
+                // the engine is chosen before anything is evaluated.
+                const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+                if (lambda && lambda->code()) {
+                    malEnvPtr env = lambda->makeEnv(argsBegin, argsEnd);
+                    const Chunk* chunk =
+                        static_cast<const Chunk*>(lambda->code());
+                    if (tail) {
+                        m_stack.truncate(frame->base);
+                        frame->chunk = chunk;
+                        frame->env = env;
+                    }
+                    else {
+                        m_stack.truncate(opIndex);
+                        frame->pc = pc;
+                        m_frames.push_back(Frame(chunk, env, opIndex));
+                        frame = &m_frames.back();
+                    }
+                    code = frame->chunk->code();
+                    pc = 0;
+                    break;
+                }
+
+                // Integer arithmetic and comparison don't call the builtin.
+                malValuePtr value;
+                if (argc == 2) {
+                    value = applyInline(op, argsBegin[0], argsBegin[1]);
+                }
+                if (!value) {
+                    value = APPLY(op, argsBegin, argsEnd);
+                }
+                m_stack.truncate(opIndex);
+                m_stack.push(value);
+                if (!tail) {
+                    break;
+                }
+            }
+            // fall through: a tail call to a builtin returns its value.
+
+            case OP_RETURN: {
+                malValuePtr value = m_stack.pop();
+                m_stack.truncate(frame->base);
+                m_frames.pop_back();
+                if (m_frames.empty()) {
+                    return value;
+                }
+                frame = &m_frames.back();
+                code = frame->chunk->code();
+                pc = frame->pc;
+                m_stack.push(value);
+                break;
+            }
+
+            case OP_CLOSURE: {
+                const FnProto& fn = frame->chunk->fn(code[pc++]);
+                m_stack.push(mal::lambda(fn.params, fn.body, frame->env,
+                                         fn.chunk.ptr()));
+                break;
+            }
+
+            case OP_DEF: {
+                const malSymbol* symbol = frame->chunk->symbol(code[pc++]);
+                m_stack.push(frame->env->set(symbol, m_stack.pop()));
+                break;
+            }
+
+            case OP_DEFMACRO: {
+                const malSymbol* symbol = frame->chunk->symbol(code[pc++]);
+                malValuePtr body = m_stack.pop();
+                const malLambda* lambda = VALUE_CAST(malLambda, body);
+                m_stack.push(frame->env->set(symbol, mal::macro(*lambda)));
+                break;
+            }
+
+            case OP_ENTER: {
+                const malFrameLayoutPtr& layout =
+                    frame->chunk->layout(code[pc++]);
+                frame->env = new malEnv(frame->env, layout);
+                break;
+            }
+
+            case OP_SET_SLOT:
+                frame->env->setSlot(code[pc++], m_stack.pop());
+                break;
+
+            case OP_LEAVE:
+                frame->env = frame->env->outer();
+                break;
+
+            case OP_TRY: {
+                Handler handler;
+                handler.frame = m_frames.size() - 1;
+                handler.top = m_stack.top();
+                handler.handler = code[pc++];
+                handler.resume = code[pc++];
+                handler.layout = frame->chunk->layout(code[pc++]);
+                handler.env = frame->env;
+                m_handlers.push_back(handler);
+                break;
+            }
+
+            case OP_END_TRY:
+                m_handlers.pop_back();
+                break;
+
+            case OP_MACROEXPAND: {
+                malValuePtr form = frame->chunk->constant(code[pc++]);
+                m_stack.push(macroExpand(form, frame->env));
+                break;
+            }
+
+            case OP_VECTOR: {
+                int count = code[pc++];
+                int first = m_stack.top() - count;
+                malValuePtr vector =
+                    mal::vector(m_stack.at(first), m_stack.at(first + count));
+                m_stack.truncate(first);
+                m_stack.push(vector);
+                break;
+            }
+
+            case OP_HASH: {
+                int count = 2 * code[pc++];
+                int first = m_stack.top() - count;
+                malValuePtr hash = mal::hash(m_stack.at(first),
+                                             m_stack.at(first + count), true);
+                m_stack.truncate(first);
+                m_stack.push(hash);
+                break;
+            }
+
+            case OP_QUASIQUOTE: {
+                const malTemplate* quasi = frame->chunk->quasi(code[pc++]);
+                int first = m_stack.top() - quasi->holeCount();
+                malValuePtr form = quasi->build(m_stack.at(first));
+                m_stack.truncate(first);
+                m_stack.push(form);
+                break;
+            }
+
+            case OP_FAIL:
+                throw frame->chunk->message(code[pc++]);
+
+            default:
+                ASSERT(false, "Bad opcode %d\n", code[pc - 1]);
+        }
+    }
+}
+
+malValuePtr VM::local(const malEnvPtr& env, int depth, int slot,
+                      const malSymbol* symbol)
+{
+    // As for a malLocalRef, a name added by def! in a frame on the way out
+    // may shadow the slot, and an empty slot is a let* binding in progress.
+    malEnv* frame = env.ptr();
+    for (int i = 0; i < depth; i++) {
+        if (frame->hasUnslotted()) {
+            return env->get(symbol);
+        }
+        frame = frame->outer();
+    }
+    const malValuePtr& value = frame->slot(slot);
+    return value ? value : env->get(symbol);
+}
+
+malValuePtr runBytecode(malValuePtr ast, malEnvPtr env)
+{
+    ChunkPtr chunk = BytecodeCompiler::compile(ast, malScope::of(env));
+    return chunk->run(env);
+}
@@ -0,0 +1,427 @@
+#include "Collector.h"
+
+#if MAL_TRACING_GC
+#include "Types.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_set>
+
+size_t              malCollector::s_due = malCollector::MIN_INTERVAL;
+malCollector::Stats malCollector::s_stats;
+
+size_t RefCounted::s_pendingCount = 0;
+bool   RefCounted::s_isFreeing    = false;
+
+//  The objects waiting to be freed, most recently queued last, so that a
+//  nested structure is freed depth first. This is never freed, as objects
+//  may still be queued as the program exits.
+static std::vector<const RefCounted*>& pendingObjects()
+{
+    static auto pending = new std::vector<const RefCounted*>;
+    return *pending;
+}
+
+void RefCounted::addPending(const RefCounted* object)
+{
+    pendingObjects().push_back(object);
+    s_pendingCount++;
+}
+
+void RefCounted::dispose() const
+{
+    if (s_isFreeing) {
+        addPending(this);
+        return;
+    }
+    s_isFreeing = true;
+    destroy();
+    s_isFreeing = false;
+    if (s_pendingCount != 0) {
+        freePending(FREE_NOW);
+    }
+}
+
+void RefCounted::freePending(size_t limit)
+{
+    std::vector<const RefCounted*>& pending = pendingObjects();
+    bool wasFreeing = s_isFreeing;
+    s_isFreeing = true;
+    for (size_t i = 0; (i < limit) && !pending.empty(); i++) {
+        const RefCounted* object = pending.back();
+        pending.pop_back();
+        object->destroy();
+    }
+    s_pendingCount = pending.size();
+    s_isFreeing = wasFreeing;
+}
+
+#if MAL_TRACING_GC
+malRootArray::Header* malRootArray::s_first = NULL;
+
+void* malRootArray::allocate(size_t size)
+{
+    Header* header = static_cast<Header*>(
+        ::operator new(sizeof(Header) + size));
+    header->prev = NULL;
+    header->next = s_first;
+    header->size = size;
+    if (s_first) {
+        s_first->prev = header;
+    }
+    s_first = header;
+
+    // The collector may look at the whole array before it's filled.
+    void* array = header + 1;
+    memset(array, 0, size);
+    return array;
+}
+
+void malRootArray::free(void* array)
+{
+    Header* header = static_cast<Header*>(array) - 1;
+    if (header->prev) {
+        header->prev->next = header->next;
+    }
+    else {
+        s_first = header->next;
+    }
+    if (header->next) {
+        header->next->prev = header->prev;
+    }
+    ::operator delete(header);
+}
+
+//  The mark bit, which is clear outside of a collection.
+enum Color { UNMARKED, MARKED };
+
+//  Mark every traced object referred to from outside the heap: those still
+//  counted, which C++ holds handles to, and those on the value stack or in
+//  a malValueVec. The spare slots of an array may hold anything, so only
+//  the words which are the start of an allocated block are taken.
+void malCollector::markRoots(ObjectVec& pending)
+{
+    auto markObject = [&pending](const RefCounted* object) {
+        if (object->isTraced() && object->m_color == UNMARKED) {
+            object->m_color = MARKED;
+            pending.push_back(object);
+        }
+    };
+
+    malAllocator::forEachBlock([&markObject](void* block) {
+        const RefCounted* object = static_cast<const RefCounted*>(block);
+        if (object->m_refCount > 0) {
+            markObject(object);
+        }
+    });
+
+    malValueStack& stack = valueStack();
+    for (int i = 0, top = stack.top(); i < top; i++) {
+        if (const malValue* value = stack[i].counted()) {
+            markObject(value);
+        }
+    }
+
+    for (malRootArray::Header* header = malRootArray::s_first; header;
+                                                header = header->next) {
+        const void* const* words = reinterpret_cast<const void* const*>(
+            header + 1);
+        for (size_t i = 0, count = header->size / sizeof(void*);
+                                                    i < count; i++) {
+            if (words[i] && malAllocator::isBlock(words[i])) {
+                markObject(static_cast<const RefCounted*>(words[i]));
+            }
+        }
+    }
+}
+
+//  Mark everything reachable from the objects already marked. This works
+//  through a list rather than recursing, as the heap can be as deep as the
+//  longest chain of environments.
+void malCollector::mark(ObjectVec& pending)
+{
+    class Mark : public RefCounted::Visitor {
+    public:
+        Mark(ObjectVec& pending) : m_pending(pending) { }
+    protected:
+        virtual void visit(const RefCounted* object) {
+            if (object->m_color == UNMARKED) {
+                object->m_color = MARKED;
+                m_pending.push_back(object);
+            }
+        }
+    private:
+        ObjectVec& m_pending;
+    };
+
+    Mark visitor(pending);
+    while (!pending.empty()) {
+        const RefCounted* object = pending.back();
+        pending.pop_back();
+        object->visitChildren(visitor);
+    }
+}
+
+//  Free every traced object left unmarked, and clear the marks of the rest.
+//  Freeing the garbage can only free untraced objects along with it, as any
+//  traced object those still count was marked as a root.
+void malCollector::sweep()
+{
+    malAllocator::forEachBlock([](void* block) {
+        RefCounted* object = static_cast<RefCounted*>(block);
+        if (!object->isTraced()) {
+            return;
+        }
+        if (object->m_color == MARKED) {
+            object->m_color = UNMARKED;
+        }
+        else {
+            object->destroy();
+        }
+    });
+}
+
+#else
+
+malCycleRoot* malCycleRoot::s_first = NULL;
+
+//  The roots added with addRoot. This is never freed, as objects may still
+//  be removing themselves from it as the program exits.
+static std::unordered_set<const RefCounted*>& extraRoots()
+{
+    static auto roots = new std::unordered_set<const RefCounted*>;
+    return *roots;
+}
+
+void malCollector::addRoot(const RefCounted* object)
+{
+    extraRoots().insert(object);
+}
+
+void malCollector::removeRoot(const RefCounted* object)
+{
+    extraRoots().erase(object);
+}
+
+//  Every object is BLACK outside of a collection. Each phase below works
+//  through a list of objects still to visit, rather than recursing, as the
+//  heap can be as deep as the longest chain of environments.
+enum Color { BLACK, GRAY, WHITE };
+
+//  Take the references each object reachable from root holds off the counts
+//  of the objects they refer to.
+void malCollector::markGray(const RefCounted* root, ObjectVec& pending)
+{
+    class MarkGray : public RefCounted::Visitor {
+    public:
+        MarkGray(ObjectVec& pending) : m_pending(pending) { }
+    protected:
+        virtual void visit(const RefCounted* object) {
+            object->m_refCount--;
+            if (object->m_color != GRAY) {
+                object->m_color = GRAY;
+                m_pending.push_back(object);
+            }
+        }
+    private:
+        ObjectVec& m_pending;
+    };
+
+    if (root->m_color == GRAY) {
+        return;
+    }
+    root->m_color = GRAY;
+    pending.push_back(root);
+
+    MarkGray visitor(pending);
+    while (!pending.empty()) {
+        const RefCounted* object = pending.back();
+        pending.pop_back();
+        object->visitChildren(visitor);
+    }
+}
+
+//  Put back the references held by object and everything reachable from
+//  it, none of which can be garbage, as something outside refers to it.
+void malCollector::scanBlack(const RefCounted* object, ObjectVec& pending)
+{
+    class ScanBlack : public RefCounted::Visitor {
+    public:
+        ScanBlack(ObjectVec& pending) : m_pending(pending) { }
+    protected:
+        virtual void visit(const RefCounted* object) {
+            object->m_refCount++;
+            if (object->m_color != BLACK) {
+                object->m_color = BLACK;
+                m_pending.push_back(object);
+            }
+        }
+    private:
+        ObjectVec& m_pending;
+    };
+
+    object->m_color = BLACK;
+    pending.push_back(object);
+
+    ScanBlack visitor(pending);
+    while (!pending.empty()) {
+        const RefCounted* next = pending.back();
+        pending.pop_back();
+        next->visitChildren(visitor);
+    }
+}
+
+//  Sort what markGray reached from root into objects which are still
+//  referred to from outside, and so BLACK, and WHITE ones which are not.
+void malCollector::scan(const RefCounted* root, ObjectVec& pending)
+{
+    class Scan : public RefCounted::Visitor {
+    public:
+        Scan(ObjectVec& pending) : m_pending(pending) { }
+    protected:
+        virtual void visit(const RefCounted* object) {
+            m_pending.push_back(object);
+        }
+    private:
+        ObjectVec& m_pending;
+    };
+
+    ObjectVec blackPending;
+    Scan visitor(pending);
+    pending.push_back(root);
+    while (!pending.empty()) {
+        const RefCounted* object = pending.back();
+        pending.pop_back();
+        if (object->m_color != GRAY) {
+            continue;
+        }
+        if (object->m_refCount > 0) {
+            scanBlack(object, blackPending);
+        }
+        else {
+            object->m_color = WHITE;
+            object->visitChildren(visitor);
+        }
+    }
+}
+
+//  Add the WHITE objects reachable from root to garbage, turning them BLACK
+//  again so they're only added once.
+void malCollector::collectWhite(const RefCounted* root, ObjectVec& garbage,
+                                ObjectVec& pending)
+{
+    class CollectWhite : public RefCounted::Visitor {
+    public:
+        CollectWhite(ObjectVec& pending) : m_pending(pending) { }
+    protected:
+        virtual void visit(const RefCounted* object) {
+            m_pending.push_back(object);
+        }
+    private:
+        ObjectVec& m_pending;
+    };
+
+    CollectWhite visitor(pending);
+    pending.push_back(root);
+    while (!pending.empty()) {
+        const RefCounted* object = pending.back();
+        pending.pop_back();
+        if (object->m_color == WHITE) {
+            object->m_color = BLACK;
+            garbage.push_back(object);
+            object->visitChildren(visitor);
+        }
+    }
+}
+
+void malCollector::freeCycles()
+{
+    class Restore : public RefCounted::Visitor {
+    protected:
+        virtual void visit(const RefCounted* object) {
+            object->m_refCount++;
+        }
+    };
+
+    ObjectVec roots;
+    for (malCycleRoot* link = malCycleRoot::s_first; link;
+                                                link = link->m_next) {
+        roots.push_back(link->m_object);
+    }
+    roots.insert(roots.end(), extraRoots().begin(), extraRoots().end());
+
+    ObjectVec pending;
+    for (auto it = roots.begin(), end = roots.end(); it != end; ++it) {
+        markGray(*it, pending);
+    }
+    for (auto it = roots.begin(), end = roots.end(); it != end; ++it) {
+        scan(*it, pending);
+    }
+    ObjectVec garbage;
+    for (auto it = roots.begin(), end = roots.end(); it != end; ++it) {
+        collectWhite(*it, garbage, pending);
+    }
+
+    // The garbage still holds its references, so give them back their
+    // counts and free it the usual way. Each object is held while the
+    // roots among it drop theirs, which breaks every cycle, so none is
+    // freed before it's been cleared.
+    Restore restore;
+    for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+        (*it)->visitChildren(restore);
+        (*it)->acquire();
+    }
+    for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+        const_cast<RefCounted*>(*it)->clearChildren();
+    }
+    for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+        if ((*it)->release() == 0) {
+            (*it)->dispose();
+        }
+    }
+}
+#endif
+
+malCollector::Stats malCollector::collect()
+{
+    // Objects still waiting to be freed hold references which would
+    // otherwise keep what they refer to, and they mustn't be found as
+    // garbage themselves.
+    RefCounted::freeAllPending();
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    const malAllocator::Stats before = malAllocator::stats();
+
+#if MAL_TRACING_GC
+    ObjectVec pending;
+    markRoots(pending);
+    mark(pending);
+    sweep();
+#else
+    freeCycles();
+    RefCounted::freeAllPending();
+#endif
+
+    const malAllocator::Stats& after = malAllocator::stats();
+    Stats freed;
+    freed.collections    = 1;
+    freed.objects        = after.frees - before.frees;
+    freed.bytes          = before.bytesInUse - after.bytesInUse;
+    freed.pauseMicros    = std::chrono::duration_cast<
+        std::chrono::microseconds>(Clock::now() - start).count();
+    freed.maxPauseMicros = freed.pauseMicros;
+
+    s_stats.collections++;
+    s_stats.objects     += freed.objects;
+    s_stats.bytes       += freed.bytes;
+    s_stats.pauseMicros += freed.pauseMicros;
+    s_stats.maxPauseMicros = std::max(s_stats.maxPauseMicros,
+                                      freed.pauseMicros);
+
+    size_t inUse = after.allocations - after.frees;
+    s_due = after.allocations + std::max<size_t>(MIN_INTERVAL, 2 * inUse);
+    return freed;
+}
@@ -0,0 +1,181 @@
+#ifndef INCLUDE_COLLECTOR_H
+#define INCLUDE_COLLECTOR_H
+
+#include "Allocator.h"
+#include "RefCountedPtr.h"
+
+#include <vector>
+
+//  Links an object which can be changed after it's made into the list the
+//  collector starts from. Everything else only ever refers to objects older
+//  than itself, so every cycle passes through one of these. Tracing finds
+//  cycles without them, so there they do nothing.
+class malCycleRoot {
+public:
+    malCycleRoot(const RefCounted* object);
+    ~malCycleRoot();
+
+#if !MAL_TRACING_GC
+private:
+    malCycleRoot(const malCycleRoot&); // no copy ctor
+    malCycleRoot& operator = (const malCycleRoot&); // no assignments
+
+    friend class malCollector;
+
+    static malCycleRoot* s_first;
+
+    const RefCounted* m_object;
+    malCycleRoot*     m_prev;
+    malCycleRoot*     m_next;
+#endif
+};
+
+#if MAL_TRACING_GC
+inline malCycleRoot::malCycleRoot(const RefCounted*)
+{
+
+}
+
+inline malCycleRoot::~malCycleRoot()
+{
+
+}
+#else
+inline malCycleRoot::malCycleRoot(const RefCounted* object)
+: m_object(object)
+, m_prev(NULL)
+, m_next(s_first)
+{
+    if (s_first) {
+        s_first->m_prev = this;
+    }
+    s_first = this;
+}
+
+inline malCycleRoot::~malCycleRoot()
+{
+    if (m_prev) {
+        m_prev->m_next = m_next;
+    }
+    else {
+        s_first = m_next;
+    }
+    if (m_next) {
+        m_next->m_prev = m_prev;
+    }
+}
+#endif
+
+#if MAL_TRACING_GC
+//  Allocates the arrays behind each malValueVec. The references in them
+//  aren't counted, and they're held from C++ rather than from the heap, so
+//  the collector treats every value in every array as a root.
+class malRootArray {
+public:
+    static void* allocate(size_t size);
+    static void free(void* array);
+
+private:
+    friend class malCollector;
+
+    struct Header {
+        Header* prev;
+        Header* next;
+        size_t  size;
+        size_t  padding; // keeps the array GRANULE aligned
+    };
+
+    static Header* s_first;
+};
+
+template <class T>
+class malRootAllocator {
+public:
+    typedef T value_type;
+
+    malRootAllocator() { }
+    template <class U>
+    malRootAllocator(const malRootAllocator<U>&) { }
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(malRootArray::allocate(count * sizeof(T)));
+    }
+    void deallocate(T* array, size_t) { malRootArray::free(array); }
+
+    template <class U>
+    bool operator == (const malRootAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator != (const malRootAllocator<U>&) const { return false; }
+};
+#endif
+
+//  Frees the cycles which reference counting can't, by trial deletion: the
+//  references each object reachable from a root gets from the others are
+//  taken off its count, and whatever is left at zero is only referred to
+//  by itself. That is freed, and everything else has its count put back.
+//  Collections run when (gc) is called, and otherwise once enough objects
+//  have been allocated since the last, checked each time a function is
+//  called.
+//
+//  When built with MEMORY=tracing, the references objects hold to each
+//  other aren't counted at all, and this frees everything instead, by mark
+//  and sweep: every object still counted from C++, and every value on the
+//  value stack or in a malValueVec, is marked along with everything it
+//  reaches, and every object left unmarked is freed.
+class malCollector {
+public:
+    //  What a collection, or every collection so far, freed, and how long
+    //  it took.
+    struct Stats {
+        size_t collections;
+        size_t objects;
+        size_t bytes;
+        size_t pauseMicros;
+        size_t maxPauseMicros;
+    };
+
+    static Stats collect();
+
+    static void collectIfDue() {
+        if (malAllocator::stats().allocations >= s_due) {
+            collect();
+        }
+    }
+
+    static const Stats& stats() { return s_stats; }
+
+    //  Roots for objects which are seldom changed, and so have no link of
+    //  their own. The object must be removed before it's freed.
+#if MAL_TRACING_GC
+    static void addRoot(const RefCounted*) { }
+    static void removeRoot(const RefCounted*) { }
+#else
+    static void addRoot(const RefCounted* object);
+    static void removeRoot(const RefCounted* object);
+#endif
+
+private:
+    //  Collect once this many objects have been allocated since the last
+    //  time, or twice as many as are in use, whichever is more.
+    enum { MIN_INTERVAL = 1 << 20 };
+
+    typedef std::vector<const RefCounted*> ObjectVec;
+
+#if MAL_TRACING_GC
+    static void markRoots(ObjectVec& pending);
+    static void mark(ObjectVec& pending);
+    static void sweep();
+#else
+    static void markGray(const RefCounted* root, ObjectVec& pending);
+    static void scan(const RefCounted* root, ObjectVec& pending);
+    static void scanBlack(const RefCounted* object, ObjectVec& pending);
+    static void collectWhite(const RefCounted* root, ObjectVec& garbage,
+                             ObjectVec& pending);
+    static void freeCycles();
+#endif
+
+    static size_t s_due;
+    static Stats  s_stats;
+};
+
+#endif // INCLUDE_COLLECTOR_H
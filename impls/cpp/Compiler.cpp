@@ -0,0 +1,888 @@
+#include "Compiler.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <algorithm>
+
+static const malSymbol* internSymbol(const char* name)
+{
+    return STATIC_CAST(malSymbol, mal::symbol(name));
+}
+
+static const malSymbol* const s_catch = internSymbol("catch*");
+static const malSymbol* const s_def = internSymbol("def!");
+static const malSymbol* const s_defmacro = internSymbol("defmacro!");
+static const malSymbol* const s_do = internSymbol("do");
+static const malSymbol* const s_fn = internSymbol("fn*");
+static const malSymbol* const s_if = internSymbol("if");
+static const malSymbol* const s_let = internSymbol("let*");
+static const malSymbol* const s_macroexpand = internSymbol("macroexpand");
+static const malSymbol* const s_quasiquote = internSymbol("quasiquote");
+static const malSymbol* const s_quasiquoteexpand =
+    internSymbol("quasiquoteexpand");
+static const malSymbol* const s_quote = internSymbol("quote");
+static const malSymbol* const s_spliceUnquote = internSymbol("splice-unquote");
+static const malSymbol* const s_try = internSymbol("try*");
+static const malSymbol* const s_unquote = internSymbol("unquote");
+
+class Node;
+typedef RefCountedPtr<const Node> NodePtr;
+typedef std::vector<NodePtr> NodeVec;
+
+//  A compiled form. Nodes which always produce their value directly
+//  implement eval. Nodes which may end in a tail call implement exec
+//  instead, which can, rather than return the value, hand on to another
+//  node to run in its place by setting next, and env if that runs in a new
+//  frame, and returning NULL. execute() runs such a chain of nodes in a
+//  loop, so tail calls don't grow the stack.
+class Node : public malCode {
+public:
+    virtual malValuePtr eval(const malEnvPtr& env) const;
+    virtual malValuePtr exec(malEnvPtr& env, NodePtr& next) const {
+        return eval(env);
+    }
+
+    virtual malValuePtr run(const malEnvPtr& env) const {
+        return eval(env);
+    }
+};
+
+static malValuePtr execute(const Node* node, malEnvPtr env)
+{
+    NodePtr current; // keeps the node alive while it runs
+    while (1) {
+        NodePtr next;
+        malValuePtr value = node->exec(env, next);
+        if (!next) {
+            return value;
+        }
+        current = next;
+        node = current.ptr();
+    }
+}
+
+malValuePtr Node::eval(const malEnvPtr& env) const
+{
+    return execute(this, env);
+}
+
+class Compiler {
+public:
+    Compiler(const malScopePtr& scope) : m_scope(scope) { }
+
+    NodePtr compile(const malValuePtr& form);
+
+private:
+    NodePtr compileList(const malValuePtr& form);
+    NodePtr compileSpecial(const malSymbol* special, const malList* list);
+    NodePtr compileSymbol(const malSymbol* symbol);
+    NodePtr compileVector(const malVector* vector);
+    NodePtr compileHash(const malHash* hash);
+
+    NodePtr compileDo(const malList* list);
+    NodePtr compileFn(const malList* list);
+    NodePtr compileIf(const malList* list);
+    NodePtr compileLet(const malList* list);
+    NodePtr compileTry(const malList* list);
+    NodePtr compileQuasiquote(const malValuePtr& form);
+
+    //  Compile form in a new innermost scope.
+    NodePtr compileIn(const malFrameLayoutPtr& layout,
+                      const malValuePtr& form);
+
+    malScopePtr m_scope;
+};
+
+//  A value known when the form was compiled: a literal or a quoted form.
+class Const : public Node {
+public:
+    Const(malValuePtr value) : m_value(value) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return m_value;
+    }
+
+private:
+    const malValuePtr m_value;
+};
+
+//  A form which was found to be malformed when it was compiled. The error
+//  is raised when it's run, just as EVAL would raise it.
+class Fail : public Node {
+public:
+    Fail(const String& message) : m_message(message) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        throw m_message;
+    }
+
+private:
+    const String m_message;
+};
+
+//  A reference to a slot in the frame depth levels out. Only a name bound
+//  with def! in a frame between here and there can shadow it, or the slot
+//  be empty while a let* is evaluating its bindings, and in both of those
+//  cases the name is searched for as usual.
+class Local : public Node {
+public:
+    Local(const malSymbol* symbol, int depth, int slot)
+        : m_symbol(symbol), m_depth(depth), m_slot(slot) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malEnv* frame = env.ptr();
+        for (int i = 0; i < m_depth; i++) {
+            if (frame->hasUnslotted()) {
+                return env->get(m_symbol);
+            }
+            frame = frame->outer();
+        }
+        const malValuePtr& value = frame->slot(m_slot);
+        return value ? value : env->get(m_symbol);
+    }
+
+private:
+    const malSymbol* m_symbol;
+    const int        m_depth;
+    const int        m_slot;
+};
+
+class Global : public Node {
+public:
+    Global(const malSymbol* symbol, const malFrameLayoutPtr& scope)
+        : m_ref(new malGlobalRef(*symbol, scope)) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValuePtr value = m_ref->lookup(env);
+        MAL_CHECK(value, "'%s' not found", m_ref->value().c_str());
+        return value;
+    }
+
+private:
+    const RefCountedPtr<malGlobalRef> m_ref;
+};
+
+class Def : public Node {
+public:
+    Def(const malSymbol* symbol, const NodePtr& value)
+        : m_symbol(symbol), m_value(value) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return env->set(m_symbol, m_value->eval(env));
+    }
+
+private:
+    const malSymbol* m_symbol;
+    const NodePtr    m_value;
+};
+
+class DefMacro : public Node {
+public:
+    DefMacro(const malSymbol* symbol, const NodePtr& value)
+        : m_symbol(symbol), m_value(value) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValuePtr body = m_value->eval(env);
+        const malLambda* lambda = VALUE_CAST(malLambda, body);
+        return env->set(m_symbol, mal::macro(*lambda));
+    }
+
+private:
+    const malSymbol* m_symbol;
+    const NodePtr    m_value;
+};
+
+class Do : public Node {
+public:
+    Do(const NodeVec& body) : m_body(body) { }
+
+    virtual malValuePtr exec(malEnvPtr& env, NodePtr& next) const {
+        int last = m_body.size() - 1;
+        for (int i = 0; i < last; i++) {
+            m_body[i]->eval(env);
+        }
+        next = m_body[last];
+        return NULL;
+    }
+
+private:
+    const NodeVec m_body;
+};
+
+class Fn : public Node {
+public:
+    Fn(const malFrameLayoutPtr& params, malValuePtr body, const NodePtr& code)
+        : m_params(params), m_body(body), m_code(code) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return mal::lambda(m_params, m_body, env, m_code.ptr());
+    }
+
+private:
+    const malFrameLayoutPtr m_params;
+    const malValuePtr       m_body;
+    const NodePtr           m_code;
+};
+
+class If : public Node {
+public:
+    If(const NodePtr& test, const NodePtr& then, const NodePtr& otherwise)
+        : m_test(test), m_then(then), m_else(otherwise) { }
+
+    virtual malValuePtr exec(malEnvPtr& env, NodePtr& next) const {
+        if (m_test->eval(env).isTrue()) {
+            next = m_then;
+        }
+        else if (m_else) {
+            next = m_else;
+        }
+        else {
+            return mal::nilValue();
+        }
+        return NULL;
+    }
+
+private:
+    const NodePtr m_test;
+    const NodePtr m_then;
+    const NodePtr m_else;
+};
+
+class Let : public Node {
+public:
+    Let(const malFrameLayoutPtr& layout, const std::vector<int>& slots,
+        const NodeVec& inits, const NodePtr& body)
+        : m_layout(layout), m_slots(slots), m_inits(inits), m_body(body) { }
+
+    virtual malValuePtr exec(malEnvPtr& env, NodePtr& next) const {
+        malEnvPtr inner(new malEnv(env, m_layout));
+        for (int i = 0, count = m_inits.size(); i < count; i++) {
+            inner->setSlot(m_slots[i], m_inits[i]->eval(inner));
+        }
+        env = inner;
+        next = m_body;
+        return NULL;
+    }
+
+private:
+    const malFrameLayoutPtr m_layout;
+    const std::vector<int>  m_slots;
+    const NodeVec           m_inits;
+    const NodePtr           m_body;
+};
+
+class MacroExpand : public Node {
+public:
+    MacroExpand(malValuePtr form) : m_form(form) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return macroExpand(m_form, env);
+    }
+
+private:
+    const malValuePtr m_form;
+};
+
+class Try : public Node {
+public:
+    Try(const NodePtr& body, const malFrameLayoutPtr& layout,
+        const NodePtr& handler)
+        : m_body(body), m_layout(layout), m_handler(handler) { }
+
+    virtual malValuePtr exec(malEnvPtr& env, NodePtr& next) const {
+        malValuePtr excVal;
+        try {
+            return m_body->eval(env);
+        }
+        catch(String& s) {
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            return mal::nilValue();
+        }
+        catch(malValuePtr& o) {
+            excVal = o;
+        };
+
+        env = new malEnv(env, m_layout);
+        env->setSlot(0, excVal);
+        next = m_handler;
+        return NULL;
+    }
+
+private:
+    const NodePtr           m_body;
+    const malFrameLayoutPtr m_layout;
+    const NodePtr           m_handler;
+};
+
+class Vector : public Node {
+public:
+    Vector(const NodeVec& items) : m_items(items) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValueVec* items = new malValueVec;
+        items->reserve(m_items.size());
+        for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+            items->push_back((*it)->eval(env));
+        }
+        return mal::vector(items);
+    }
+
+private:
+    const NodeVec m_items;
+};
+
+class Quasiquote : public Node {
+public:
+    Quasiquote(const malTemplatePtr& form, const NodeVec& holes)
+        : m_form(form), m_holes(holes) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValueVec values;
+        values.reserve(m_holes.size());
+        for (auto it = m_holes.begin(), end = m_holes.end(); it != end; ++it) {
+            values.push_back((*it)->eval(env));
+        }
+        return m_form->build(values.data());
+    }
+
+private:
+    const malTemplatePtr m_form;
+    const NodeVec        m_holes;
+};
+
+class Hash : public Node {
+public:
+    Hash(const malValueVec& keys, const NodeVec& values)
+        : m_keys(keys), m_values(values) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValueVec items;
+        items.reserve(2 * m_keys.size());
+        for (int i = 0, count = m_keys.size(); i < count; i++) {
+            items.push_back(m_keys[i]);
+            items.push_back(m_values[i]->eval(env));
+        }
+        return mal::hash(items.data(), items.data() + items.size(), true);
+    }
+
+private:
+    const malValueVec m_keys;
+    const NodeVec     m_values;
+};
+
+//  A call, or what may turn out to be a macro application if the operator
+//  is a symbol. A call to a compiled lambda is a tail call, so it runs in
+//  the same loop as its caller.
+class Call : public Node {
+public:
+    Call(malValuePtr form, const malScopePtr& scope,
+         const NodePtr& op, const NodeVec& args);
+
+    virtual malValuePtr eval(const malEnvPtr& env) const;
+    virtual malValuePtr exec(malEnvPtr& env, NodePtr& next) const;
+
+private:
+    //  Return op if it's a macro this form applies, else NULL.
+    const malLambda* asMacro(const malValuePtr& op) const;
+
+    //  Return the compiled expansion of the form by macro.
+    NodePtr expand(const malLambda* macro) const;
+
+    void evalArgs(const malEnvPtr& env, malStackFrame& args) const;
+
+    //  The value of the call, if applyInline can work it out, else NULL.
+    malValuePtr evalInline(const malValuePtr& op, malStackFrame& args) const;
+
+    const malValuePtr m_form;
+    const malScopePtr    m_scope;
+    const NodePtr     m_op;
+    const NodeVec     m_args;
+    const bool        m_isSymbolOp;
+
+    //  The last macro the operator named, and its compiled expansion.
+    mutable malValuePtr m_macro;
+    mutable NodePtr     m_expansion;
+};
+
+Call::Call(malValuePtr form, const malScopePtr& scope,
+           const NodePtr& op, const NodeVec& args)
+: m_form(form)
+, m_scope(scope)
+, m_op(op)
+, m_args(args)
+, m_isSymbolOp(STATIC_CAST(malList, form)->item(0).type() == TYPE_SYMBOL)
+{
+
+}
+
+malValuePtr Call::eval(const malEnvPtr& env) const
+{
+    malValuePtr op = m_op->eval(env);
+    if (const malLambda* macro = asMacro(op)) {
+        NodePtr expansion = expand(macro);
+        return expansion->eval(env);
+    }
+
+    malStackFrame args;
+    evalArgs(env, args);
+    if (malValuePtr value = evalInline(op, args)) {
+        return value;
+    }
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    if (lambda && lambda->code()) {
+        const Node* body = static_cast<const Node*>(lambda->code());
+        return body->eval(lambda->makeEnv(args.begin(), args.end()));
+    }
+    return APPLY(op, args.begin(), args.end());
+}
+
+malValuePtr Call::exec(malEnvPtr& env, NodePtr& next) const
+{
+    malValuePtr op = m_op->eval(env);
+    if (const malLambda* macro = asMacro(op)) {
+        next = expand(macro);
+        return NULL;
+    }
+
+    malStackFrame args;
+    evalArgs(env, args);
+    if (malValuePtr value = evalInline(op, args)) {
+        return value;
+    }
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    if (lambda && lambda->code()) {
+        env = lambda->makeEnv(args.begin(), args.end());
+        next = static_cast<const Node*>(lambda->code());
+        return NULL;
+    }
+    return APPLY(op, args.begin(), args.end());
+}
+
+const malLambda* Call::asMacro(const malValuePtr& op) const
+{
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    return (lambda && lambda->isMacro() && m_isSymbolOp) ? lambda : NULL;
+}
+
+NodePtr Call::expand(const malLambda* macro) const
+{
+    if (m_macro.ptr() != macro) {
+        const malList* list = STATIC_CAST(malList, m_form);
+        malValuePtr expansion = macro->apply(list->begin() + 1, list->end());
+        m_expansion = Compiler(m_scope).compile(expansion);
+        m_macro = const_cast<malLambda*>(macro);
+    }
+    return m_expansion;
+}
+
+void Call::evalArgs(const malEnvPtr& env, malStackFrame& args) const
+{
+    for (auto it = m_args.begin(), end = m_args.end(); it != end; ++it) {
+        args.push((*it)->eval(env));
+    }
+}
+
+malValuePtr Call::evalInline(const malValuePtr& op,
+                             malStackFrame& args) const
+{
+    if (m_args.size() != 2) {
+        return NULL;
+    }
+    malValueIter it = args.begin();
+    return applyInline(op, it[0], it[1]);
+}
+
+NodePtr Compiler::compile(const malValuePtr& form)
+{
+    if (form.isInteger()) {
+        return new Const(form);
+    }
+    switch (form.type()) {
+        case TYPE_SYMBOL:
+            return compileSymbol(STATIC_CAST(malSymbol, form));
+
+        case TYPE_LIST:
+            return compileList(form);
+
+        case TYPE_VECTOR:
+            return compileVector(STATIC_CAST(malVector, form));
+
+        case TYPE_HASH:
+            return compileHash(STATIC_CAST(malHash, form));
+
+        default:
+            return new Const(form);
+    }
+}
+
+NodePtr Compiler::compileList(const malValuePtr& form)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    if (list->isEmpty()) {
+        return new Const(form);
+    }
+
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        try {
+            NodePtr special = compileSpecial(symbol->identity(), list);
+            if (special) {
+                return special;
+            }
+        }
+        catch (String& s) {
+            return new Fail(s);
+        }
+    }
+
+    NodePtr op = compile(list->item(0));
+    NodeVec args;
+    for (int i = 1; i < list->count(); i++) {
+        args.push_back(compile(list->item(i)));
+    }
+    return new Call(form, m_scope, op, args);
+}
+
+//  Return the node for a special form, or NULL if it isn't one.
+NodePtr Compiler::compileSpecial(const malSymbol* special,
+                                 const malList* list)
+{
+    int argCount = list->count() - 1;
+
+    if (special == s_def) {
+        checkArgsIs("def!", 2, argCount);
+        const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+        return new Def(id->identity(), compile(list->item(2)));
+    }
+
+    if (special == s_defmacro) {
+        checkArgsIs("defmacro!", 2, argCount);
+        const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+        return new DefMacro(id->identity(), compile(list->item(2)));
+    }
+
+    if (special == s_do) {
+        return compileDo(list);
+    }
+
+    if (special == s_fn) {
+        return compileFn(list);
+    }
+
+    if (special == s_if) {
+        return compileIf(list);
+    }
+
+    if (special == s_let) {
+        return compileLet(list);
+    }
+
+    if (special == s_macroexpand) {
+        checkArgsIs("macroexpand", 1, argCount);
+        return new MacroExpand(list->item(1));
+    }
+
+    if (special == s_quasiquoteexpand) {
+        checkArgsIs("quasiquote", 1, argCount);
+        return new Const(quasiquote(list->item(1)));
+    }
+
+    if (special == s_quasiquote) {
+        checkArgsIs("quasiquote", 1, argCount);
+        return compileQuasiquote(list->item(1));
+    }
+
+    if (special == s_quote) {
+        checkArgsIs("quote", 1, argCount);
+        return new Const(list->item(1));
+    }
+
+    if (special == s_try) {
+        return compileTry(list);
+    }
+
+    return NULL;
+}
+
+NodePtr Compiler::compileSymbol(const malSymbol* symbol)
+{
+    int depth, slot;
+    if (malScope::resolve(m_scope.ptr(), symbol, depth, slot)) {
+        return new Local(symbol->identity(), depth, slot);
+    }
+    return new Global(symbol, malScope::layoutOf(m_scope.ptr()));
+}
+
+NodePtr Compiler::compileVector(const malVector* vector)
+{
+    NodeVec items;
+    for (int i = 0; i < vector->count(); i++) {
+        items.push_back(compile(vector->item(i)));
+    }
+    return new Vector(items);
+}
+
+NodePtr Compiler::compileHash(const malHash* hash)
+{
+    if (hash->isEvaluated()) {
+        return new Const(const_cast<malHash*>(hash));
+    }
+    malValueVec items;
+    hash->entries(items);
+    malValueVec keys;
+    NodeVec values;
+    for (auto it = items.begin(); it != items.end(); it += 2) {
+        keys.push_back(it[0]);
+        values.push_back(compile(it[1]));
+    }
+    return new Hash(keys, values);
+}
+
+NodePtr Compiler::compileDo(const malList* list)
+{
+    checkArgsAtLeast("do", 1, list->count() - 1);
+    if (list->count() == 2) {
+        return compile(list->item(1));
+    }
+    NodeVec body;
+    for (int i = 1; i < list->count(); i++) {
+        body.push_back(compile(list->item(i)));
+    }
+    return new Do(body);
+}
+
+NodePtr Compiler::compileFn(const malList* list)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    malSymbolVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        params.push_back(VALUE_CAST(malSymbol, bindings->item(i)));
+    }
+    malFrameLayoutPtr layout(new malFrameLayout(params));
+    return new Fn(layout, list->item(2), compileIn(layout, list->item(2)));
+}
+
+NodePtr Compiler::compileIf(const malList* list)
+{
+    int argCount = checkArgsBetween("if", 2, 3, list->count() - 1);
+    return new If(compile(list->item(1)), compile(list->item(2)),
+                  (argCount == 3) ? compile(list->item(3)) : NodePtr());
+}
+
+NodePtr Compiler::compileLet(const malList* list)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+    malFrameLayoutPtr layout(new malFrameLayout);
+    std::vector<int> slots;
+    for (int i = 0; i < count; i += 2) {
+        slots.push_back(layout->add(VALUE_CAST(malSymbol, bindings->item(i))));
+    }
+
+    // As in EVAL, every binding is in scope throughout, and an initialiser
+    // which sees one before it's set falls back to searching by name.
+    Compiler inner(new malScope(layout, m_scope.ptr()));
+    NodeVec inits;
+    for (int i = 0; i < count; i += 2) {
+        inits.push_back(inner.compile(bindings->item(i + 1)));
+    }
+    return new Let(layout, slots, inits, inner.compile(list->item(2)));
+}
+
+NodePtr Compiler::compileTry(const malList* list)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        return compile(list->item(1));
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol,
+        catchBlock->item(0))->identity() == s_catch,
+        "catch block must begin with catch*");
+
+    malFrameLayoutPtr layout(new malFrameLayout);
+    layout->add(VALUE_CAST(malSymbol, catchBlock->item(1)));
+    return new Try(compile(list->item(1)), layout,
+                   compileIn(layout, catchBlock->item(2)));
+}
+
+NodePtr Compiler::compileQuasiquote(const malValuePtr& form)
+{
+    malTemplatePtr quasi(new malTemplate(form));
+    if (malValuePtr unquoted = quasi->unquoted()) {
+        return compile(unquoted);
+    }
+    NodeVec holes;
+    for (int i = 0; i < quasi->holeCount(); i++) {
+        holes.push_back(compile(quasi->hole(i)));
+    }
+    return new Quasiquote(quasi, holes);
+}
+
+NodePtr Compiler::compileIn(const malFrameLayoutPtr& layout,
+                            const malValuePtr& form)
+{
+    return Compiler(new malScope(layout, m_scope.ptr())).compile(form);
+}
+
+malValuePtr compileAndRun(malValuePtr ast, malEnvPtr env)
+{
+    NodePtr node = Compiler(malScope::of(env)).compile(ast);
+    return node->eval(env);
+}
+
+malScope::malScope(const malFrameLayoutPtr& layout, malScope* outer)
+: m_layout(layout)
+, m_outer(outer)
+{
+
+}
+
+malScopePtr malScope::of(const malEnvPtr& env)
+{
+    std::vector<malEnv*> frames;
+    for (malEnv* frame = env.ptr(); frame && frame->layout();
+         frame = frame->outer()) {
+        frames.push_back(frame);
+    }
+    malScopePtr scope;
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        scope = new malScope((*it)->layout(), scope.ptr());
+    }
+    return scope;
+}
+
+bool malScope::resolve(const malScope* scope, const malSymbol* symbol,
+                       int& depth, int& slot)
+{
+    for (depth = 0; scope; scope = scope->outer(), depth++) {
+        slot = scope->layout()->slotOf(symbol);
+        if (slot >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//  Return the argument of form, if it's a call to symbol.
+static malValuePtr argumentOf(const malValuePtr& form, const malSymbol* symbol)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        return NULL;
+    }
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!head || (head->identity() != symbol)) {
+        return NULL;
+    }
+    checkArgsIs(symbol->value().c_str(), 1, list->count() - 1);
+    return list->item(1);
+}
+
+malTemplate::malTemplate(const malValuePtr& form)
+{
+    compile(form);
+}
+
+//  Add the steps which build form, as quasiquote() would expand it.
+void malTemplate::compile(const malValuePtr& form)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq) {
+        add(VALUE, form);
+        return;
+    }
+    if (malValuePtr unquoted = argumentOf(form, s_unquote)) {
+        add(HOLE, unquoted);
+        return;
+    }
+
+    int start = m_steps.size();
+    int holes = m_holes.size();
+    add(BEGIN);
+    for (int i = 0; i < seq->count(); i++) {
+        malValuePtr item = seq->item(i);
+        if (malValuePtr spliced = argumentOf(item, s_spliceUnquote)) {
+            add(SPLICE, spliced);
+        }
+        else {
+            compile(item);
+        }
+    }
+    add((form.type() == TYPE_VECTOR) ? END_VECTOR : END_LIST);
+
+    // A sequence with nothing unquoted in it builds a copy of itself.
+    if ((int)m_holes.size() == holes) {
+        m_steps.resize(start);
+        add(VALUE, form);
+    }
+}
+
+void malTemplate::add(Op op, const malValuePtr& value)
+{
+    Step step = { op, value };
+    if ((op == HOLE) || (op == SPLICE)) {
+        // The value is the hole's, when the template is built.
+        m_holes.push_back(value);
+        step.value = malValuePtr();
+    }
+    m_steps.push_back(step);
+}
+
+malValuePtr malTemplate::unquoted() const
+{
+    if ((m_steps.size() == 1) && (m_steps[0].op == HOLE)) {
+        return m_holes[0];
+    }
+    return NULL;
+}
+
+malValuePtr malTemplate::build(malValueIter values) const
+{
+    // The sequences being built, innermost last, under one which collects
+    // the whole form.
+    std::vector<malValueVec> open(1);
+    for (auto it = m_steps.begin(), end = m_steps.end(); it != end; ++it) {
+        switch (it->op) {
+            case VALUE:
+                open.back().push_back(it->value);
+                break;
+
+            case HOLE:
+                open.back().push_back(*values++);
+                break;
+
+            case SPLICE: {
+                const malSequence* seq = VALUE_CAST(malSequence, *values++);
+                open.back().insert(open.back().end(),
+                                   seq->begin(), seq->end());
+                break;
+            }
+
+            case BEGIN:
+                open.push_back(malValueVec());
+                break;
+
+            case END_LIST:
+            case END_VECTOR: {
+                malValueVec* items = new malValueVec;
+                items->swap(open.back());
+                open.pop_back();
+                open.back().push_back((it->op == END_LIST)
+                                      ? mal::list(items)
+                                      : mal::vector(items));
+                break;
+            }
+        }
+    }
+    return open[0][0];
+}
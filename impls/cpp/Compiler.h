@@ -0,0 +1,90 @@
+#ifndef INCLUDE_COMPILER_H
+#define INCLUDE_COMPILER_H
+
+#include "MAL.h"
+#include "Environment.h"
+
+//  The closure compiler, an alternative to the tree-walking EVAL. Each form
+//  is compiled once into a tree of nodes, one kind for each special form,
+//  call and reference, with its symbols already resolved to frame slots or
+//  global cells. Running the form runs the nodes. Macros are expanded when
+//  a call first finds that it has one, and the compiled expansion is kept
+//  for as long as the call finds the same macro.
+extern malValuePtr compileAndRun(malValuePtr ast, malEnvPtr env);
+
+//  The bytecode compiler and VM. Each form, and each fn* body, is compiled
+//  to a chunk of instructions for a stack machine. A chunk's operands, and
+//  the arguments it passes, live in one array shared by every chunk, and a
+//  call from one chunk to another runs in the same loop as the caller.
+extern malValuePtr runBytecode(malValuePtr ast, malEnvPtr env);
+
+class malScope;
+typedef RefCountedPtr<malScope> malScopePtr;
+
+//  The layouts of the frames a form is compiled to run in, innermost
+//  first. The global frame has no layout, and so no scope.
+class malScope : public RefCounted {
+public:
+    malScope(const malFrameLayoutPtr& layout, malScope* outer);
+
+    //  The scopes of env and the frames around it.
+    static malScopePtr of(const malEnvPtr& env);
+
+    //  Find the frame, counting out from scope, and slot which symbol
+    //  names. Return false if it isn't a local.
+    static bool resolve(const malScope* scope, const malSymbol* symbol,
+                        int& depth, int& slot);
+
+    //  The layout of the innermost frame, which a malGlobalRef is cached
+    //  against.
+    static malFrameLayoutPtr layoutOf(const malScope* scope) {
+        return scope ? scope->layout() : malFrameLayoutPtr();
+    }
+
+    const malFrameLayoutPtr& layout() const { return m_layout; }
+    malScope* outer() const { return m_outer.ptr(); }
+
+private:
+    const malFrameLayoutPtr m_layout;
+    const malScopePtr       m_outer;
+};
+
+class malTemplate;
+typedef RefCountedPtr<const malTemplate> malTemplatePtr;
+
+//  A quasiquoted form, compiled once into the steps which build it. The
+//  unquoted parts are its holes, which the evaluator evaluates in order,
+//  and build() makes the form from their values in a single pass, rather
+//  than with the cons and concat calls which quasiquote() expands to.
+class malTemplate : public RefCounted {
+public:
+    malTemplate(const malValuePtr& form);
+
+    int holeCount() const { return m_holes.size(); }
+    malValuePtr hole(int index) const { return m_holes[index]; }
+
+    //  The form to evaluate in place of the template, if all of it was
+    //  unquoted, otherwise NULL.
+    malValuePtr unquoted() const;
+
+    malValuePtr build(malValueIter values) const;
+
+private:
+    enum Op { VALUE, HOLE, SPLICE, BEGIN, END_LIST, END_VECTOR };
+    struct Step {
+        Op          op;
+        malValuePtr value;
+    };
+
+    void compile(const malValuePtr& form);
+    void add(Op op, const malValuePtr& value = malValuePtr());
+
+    std::vector<Step> m_steps;
+    malValueVec       m_holes;
+};
+
+// stepA_mal.cpp
+extern malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+extern malValuePtr quasiquote(malValuePtr obj);
+
+#endif // INCLUDE_COMPILER_H
@@ -21,21 +21,29 @@
 
 static String printValues(malValueIter begin, malValueIter end,
                            const String& sep, bool readably);
+static String readFile(const String& filename);
 
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define ARG_INT(name) int64_t name = INTEGER_VALUE(*argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
-#define BUILTIN_DEF(uniq, symbol) \
+#define BUILTIN_DEF(uniq, symbol, intrinsic) \
     static malBuiltIn::ApplyFunc FUNCNAME(uniq); \
     static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
-        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq))); \
+        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq), \
+                                  malBuiltIn::intrinsic)); \
     malValuePtr FUNCNAME(uniq)(const String& name, \
         malValueIter argsBegin, malValueIter argsEnd)
 
-#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
+#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol, NONE)
+
+//  A builtin which the evaluators may run inline, see applyInline. The
+//  handler must give the same result for the cases that covers.
+#define BUILTIN_INLINE(symbol, intrinsic) \
+    BUILTIN_DEF(__LINE__, symbol, intrinsic)
 
 #define BUILTIN_ISA(symbol, type) \
     BUILTIN(symbol) { \
@@ -49,15 +57,32 @@ static StaticList<malBuiltIn*> handlers;
         return mal::boolean(*argsBegin == mal::constant()); \
     }
 
-#define BUILTIN_INTOP(op, checkDivByZero) \
-    BUILTIN(#op) { \
+//  INT64_MIN / -1 doesn't fit in an int64_t, and traps rather than
+//  wrapping, as does INT64_MIN % -1.
+#define BUILTIN_INTOP(op, intrinsic, checkDivByZero) \
+    BUILTIN_INLINE(#op, intrinsic) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+        ARG_INT(lhs); \
+        ARG_INT(rhs); \
         if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+            MAL_CHECK(rhs != 0, "Division by zero"); \
+            MAL_CHECK((lhs != INT64_MIN) || (rhs != -1), \
+                      "integer out of range"); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(lhs op rhs); \
+    }
+
+//  A result which doesn't fit in an int64_t is an error, rather than the
+//  undefined behaviour of letting it overflow. check is one of the
+//  __builtin_*_overflow functions.
+#define BUILTIN_CHECKED_INTOP(op, intrinsic, check) \
+    BUILTIN_INLINE(#op, intrinsic) { \
+        CHECK_ARGS_IS(2); \
+        ARG_INT(lhs); \
+        ARG_INT(rhs); \
+        int64_t result; \
+        MAL_CHECK(!check(lhs, rhs, &result), "integer out of range"); \
+        return mal::integer(result); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
@@ -70,70 +95,74 @@ BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
 BUILTIN_ISA("vector?",      malVector);
 
-BUILTIN_INTOP(+,            false);
-BUILTIN_INTOP(/,            true);
-BUILTIN_INTOP(*,            false);
-BUILTIN_INTOP(%,            true);
+BUILTIN_CHECKED_INTOP(+,    ADD,        __builtin_add_overflow);
+BUILTIN_INTOP(/,            DIVIDE,     true);
+BUILTIN_CHECKED_INTOP(*,    MULTIPLY,   __builtin_mul_overflow);
+BUILTIN_INTOP(%,            NONE,       true);
 
 BUILTIN_IS("true?",         trueValue);
 BUILTIN_IS("false?",        falseValue);
 BUILTIN_IS("nil?",          nilValue);
 
-BUILTIN("-")
+BUILTIN_INLINE("-", SUBTRACT)
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
+    ARG_INT(lhs);
     if (argCount == 1) {
-        return mal::integer(- lhs->value());
+        MAL_CHECK(lhs != INT64_MIN, "integer out of range");
+        return mal::integer(- lhs);
     }
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    ARG_INT(rhs);
+    int64_t result;
+    MAL_CHECK(!__builtin_sub_overflow(lhs, rhs, &result),
+              "integer out of range");
+    return mal::integer(result);
 }
 
-BUILTIN("<=")
+BUILTIN_INLINE("<=", LESS_EQUAL)
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs <= rhs);
 }
 
-BUILTIN(">=")
+BUILTIN_INLINE(">=", GREATER_EQUAL)
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() >= rhs->value());
+    return mal::boolean(lhs >= rhs);
 }
 
-BUILTIN("<")
+BUILTIN_INLINE("<", LESS)
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() < rhs->value());
+    return mal::boolean(lhs < rhs);
 }
 
-BUILTIN(">")
+BUILTIN_INLINE(">", GREATER)
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() > rhs->value());
+    return mal::boolean(lhs > rhs);
 }
 
-BUILTIN("=")
+BUILTIN_INLINE("=", EQUAL)
 {
     CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    const malValuePtr& lhs = *argsBegin++;
+    const malValuePtr& rhs = *argsBegin++;
 
-    return mal::boolean(lhs->isEqualTo(rhs));
+    return mal::boolean(lhs.isEqualTo(rhs));
 }
 
 BUILTIN("apply")
@@ -150,12 +179,24 @@ BUILTIN("apply")
         args.push_back(lastArg->item(i));
     }
 
-    return APPLY(op, args.begin(), args.end());
+    return APPLY(op, args.data(), args.data() + args.size());
 }
 
 BUILTIN("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if (const malVector* vec = DYNAMIC_CAST(malVector, *argsBegin)) {
+        malValuePtr ret = *argsBegin++;
+        MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+                  "assoc requires an even-sized list");
+        while (argsBegin != argsEnd) {
+            ARG_INT(i);
+            MAL_CHECK(i >= 0 && i <= vec->count(), "Index out of range");
+            ret = vec->assoc(i, *argsBegin++);
+            vec = STATIC_CAST(malVector, ret);
+        }
+        return ret;
+    }
     ARG(malHash, hash);
 
     return hash->assoc(argsBegin, argsEnd);
@@ -170,21 +211,21 @@ BUILTIN("atom")
 
 BUILTIN("concat")
 {
-    int count = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = VALUE_CAST(malSequence, *it);
-        count += seq->count();
+    if (argsBegin == argsEnd) {
+        return mal::list(new malValueVec(0));
     }
 
-    malValueVec* items = new malValueVec(count);
-    int offset = 0;
+    // Share the last sequence, and add the others to the front of it.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = STATIC_CAST(malSequence, *it);
-        std::copy(seq->begin(), seq->end(), items->begin() + offset);
-        offset += seq->count();
+        VALUE_CAST(malSequence, *it);
     }
-
-    return mal::list(items);
+    malValuePtr result = STATIC_CAST(malSequence, *(argsEnd-1))->asList();
+    for (auto it = argsEnd-1; it != argsBegin; ) {
+        const malSequence* seq = STATIC_CAST(malSequence, *--it);
+        result = STATIC_CAST(malSequence, result)->prepend(seq->begin(),
+                                                           seq->end());
+    }
+    return result;
 }
 
 BUILTIN("conj")
@@ -201,11 +242,7 @@ BUILTIN("cons")
     malValuePtr first = *argsBegin++;
     ARG(malSequence, rest);
 
-    malValueVec* items = new malValueVec(1 + rest->count());
-    items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
-
-    return mal::list(items);
+    return rest->cons(first);
 }
 
 BUILTIN("contains?")
@@ -282,6 +319,22 @@ BUILTIN("fn?")
     return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
 }
 
+//  Run the collector now, and return how much it freed, how long that took,
+//  and how much is still allocated.
+BUILTIN("gc")
+{
+    CHECK_ARGS_IS(0);
+    malCollector::Stats freed = malCollector::collect();
+    malValueRef items[] = {
+        mal::keyword(":objects"),    mal::integer(freed.objects),
+        mal::keyword(":bytes"),      mal::integer(freed.bytes),
+        mal::keyword(":pause-us"),   mal::integer(freed.pauseMicros),
+        mal::keyword(":heap-bytes"),
+        mal::integer(malAllocator::stats().bytesInUse),
+    };
+    return mal::hash(items, items + 8, true);
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
@@ -320,6 +373,25 @@ BUILTIN("list")
     return mal::list(argsBegin, argsEnd);
 }
 
+//  Each form is read, or taken from the cache if the file hasn't changed
+//  since it was last read, and then evaluated in turn.
+BUILTIN("load-file")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+
+    String source = readFile(filename->value());
+    malValueVec forms;
+    if (!loadCachedForms(filename->value(), source, forms)) {
+        readForms(source, forms);
+        saveCachedForms(filename->value(), source, forms);
+    }
+    for (auto it = forms.begin(), end = forms.end(); it != end; ++it) {
+        EVAL(*it, NULL);
+    }
+    return mal::nilValue();
+}
+
 BUILTIN("macro?")
 {
     CHECK_ARGS_IS(1);
@@ -357,9 +429,8 @@ BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
     ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    ARG_INT(i);
 
-    int i = index->value();
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
@@ -447,18 +518,7 @@ BUILTIN("slurp")
     CHECK_ARGS_IS(1);
     ARG(malString, filename);
 
-    std::ios_base::openmode openmode =
-        std::ios::ate | std::ios::in | std::ios::binary;
-    std::ifstream file(filename->value().c_str(), openmode);
-    MAL_CHECK(!file.fail(), "Cannot open %s", filename->value().c_str());
-
-    String data;
-    data.reserve(file.tellg());
-    file.seekg(0, std::ios::beg);
-    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
-                std::istreambuf_iterator<char>());
-
-    return mal::string(data);
+    return mal::string(readFile(filename->value()));
 }
 
 BUILTIN("str")
@@ -477,7 +537,7 @@ BUILTIN("swap!")
     args[0] = atom->deref();
     std::copy(argsBegin, argsEnd, args.begin() + 1);
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
+    malValuePtr value = APPLY(op, args.data(), args.data() + args.size());
     return atom->reset(value);
 }
 
@@ -491,7 +551,7 @@ BUILTIN("symbol")
 BUILTIN("throw")
 {
     CHECK_ARGS_IS(1);
-    throw *argsBegin;
+    throw malValuePtr(*argsBegin);
 }
 
 BUILTIN("time-ms")
@@ -516,6 +576,13 @@ BUILTIN("vals")
 BUILTIN("vec")
 {
     CHECK_ARGS_IS(1);
+    if (const malVector* vec = DYNAMIC_CAST(malVector, *argsBegin)) {
+        // Share the items, but not the metadata.
+        if (vec->hasMeta()) {
+            return vec->withMeta(mal::nilValue());
+        }
+        return *argsBegin;
+    }
     ARG(malSequence, s);
     return mal::vector(s->begin(), s->end());
 }
@@ -533,6 +600,16 @@ BUILTIN("with-meta")
     return obj->withMeta(meta);
 }
 
+malValuePtr findBuiltIn(const String& name)
+{
+    for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
+        if ((*it)->name() == name) {
+            return *it;
+        }
+    }
+    return NULL;
+}
+
 void installCore(malEnvPtr env) {
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
@@ -540,6 +617,21 @@ void installCore(malEnvPtr env) {
     }
 }
 
+static String readFile(const String& filename)
+{
+    std::ios_base::openmode openmode =
+        std::ios::ate | std::ios::in | std::ios::binary;
+    std::ifstream file(filename.c_str(), openmode);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+
+    String data;
+    data.reserve(file.tellg());
+    file.seekg(0, std::ios::beg);
+    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
+                std::istreambuf_iterator<char>());
+    return data;
+}
+
 static String printValues(malValueIter begin, malValueIter end,
                           const String& sep, bool readably)
 {
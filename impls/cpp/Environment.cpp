@@ -2,66 +2,239 @@
 #include "Types.h"
 
 #include <algorithm>
+#include <unordered_set>
+
+unsigned malEnv::s_version = 0;
+
+//  Names which def! has bound outside the global frame.
+static std::unordered_set<const malSymbol*> s_localDefs;
+
+static const malSymbol* intern(const String& symbol)
+{
+    return STATIC_CAST(malSymbol, mal::symbol(symbol));
+}
+
+malFrameLayout::malFrameLayout()
+: m_isVariadic(false)
+, m_arity(0)
+{
+
+}
+
+malFrameLayout::malFrameLayout(const malSymbolVec& params)
+: m_isVariadic(false)
+, m_arity(0)
+{
+    static const malSymbol* ampersand = intern("&");
+    int n = params.size();
+    for (int i = 0; i < n; i++) {
+        if (params[i]->identity() == ampersand) {
+            MAL_CHECK(i == n - 2, "There must be one parameter after the &");
+            m_isVariadic = true;
+            continue;
+        }
+        add(params[i]);
+    }
+    m_arity = count() - (m_isVariadic ? 1 : 0);
+}
+
+malFrameLayout::malFrameLayout(const malSymbolVec& names, bool isVariadic,
+                               int arity)
+: m_names(names)
+, m_isVariadic(isVariadic)
+, m_arity(arity)
+{
+
+}
+
+int malFrameLayout::add(const malSymbol* name)
+{
+    int slot = slotOf(name);
+    if (slot < 0) {
+        slot = m_names.size();
+        m_names.push_back(name->identity());
+    }
+    return slot;
+}
+
+int malFrameLayout::slotOf(const malSymbol* name) const
+{
+    auto it = std::find(m_names.begin(), m_names.end(), name->identity());
+    return (it == m_names.end()) ? -1 : it - m_names.begin();
+}
 
 malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+: RefCounted(TRACED)
+, m_slots(m_inlineSlots)
+, m_outer(outer)
+, m_root(this)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
+malEnv::malEnv(malEnvPtr outer, const malFrameLayoutPtr& layout)
+: RefCounted(TRACED)
+, m_layout(layout)
+, m_outer(outer)
+, m_root(this)
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    makeSlots(layout->count());
+}
+
+malEnv::malEnv(malEnvPtr outer, const malFrameLayoutPtr& params,
                malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+: RefCounted(TRACED)
+, m_layout(params)
+, m_outer(outer)
+, m_root(this)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
-    int n = bindings.size();
-    auto it = argsBegin;
-    for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
-            MAL_CHECK(i == n - 2, "There must be one parameter after the &");
+    int arity = params->arity();
+    int argCount = argsEnd - argsBegin;
+    MAL_CHECK(argCount >= arity, "Not enough parameters");
+    MAL_CHECK(params->isVariadic() || (argCount == arity),
+              "Too many parameters");
 
-            set(bindings[n-1], mal::list(it, argsEnd));
-            return;
-        }
-        MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
-        ++it;
+    makeSlots(params->count());
+    std::copy(argsBegin, argsBegin + arity, m_slots);
+    if (params->isVariadic()) {
+        m_slots[arity] = mal::list(argsBegin + arity, argsEnd);
     }
-    MAL_CHECK(it == argsEnd, "Too many parameters");
 }
 
 malEnv::~malEnv()
 {
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+    if (m_slots != m_inlineSlots) {
+        delete [] m_slots;
+    }
 }
 
-malEnvPtr malEnv::find(const String& symbol)
+void malEnv::visitChildren(Visitor& visit) const
+{
+    int count = m_layout ? m_layout->count() : 0;
+    for (int i = 0; i < count; i++) {
+        visit(m_slots[i].counted());
+    }
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        visit(it->second.counted());
+    }
+    visit(m_outer.ptr());
+}
+
+//  Only the bindings can close a cycle, as the outer frame is older.
+void malEnv::clearChildren()
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    int count = m_layout ? m_layout->count() : 0;
+    for (int i = 0; i < count; i++) {
+        m_slots[i] = malValuePtr();
+    }
+    m_map.clear();
+}
+
+void malEnv::makeSlots(int count)
+{
+    m_slots = (count <= INLINE_SLOTS) ? m_inlineSlots
+                                      : new malValueRef[count];
+}
+
+//  Return the value bound to key in this frame alone, or NULL.
+const malValueRef* malEnv::findLocal(const malSymbol* key) const
+{
+    if (m_layout) {
+        int slot = m_layout->slotOf(key);
+        if ((slot >= 0) && m_slots[slot]) {
+            return &m_slots[slot];
+        }
+    }
+    auto it = m_map.find(key);
+    return (it == m_map.end()) ? NULL : &it->second;
+}
+
+malEnvPtr malEnv::find(const malSymbol* symbol)
+{
+    const malSymbol* key = symbol->identity();
+    for (malEnv* env = this; env; env = env->outer()) {
+        if (env->findLocal(key)) {
             return env;
         }
     }
     return NULL;
 }
 
-malValuePtr malEnv::get(const String& symbol)
+malValuePtr malEnv::lookup(const malSymbol* symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    const malSymbol* key = symbol->identity();
+    for (malEnv* env = this; env; env = env->outer()) {
+        if (const malValueRef* value = env->findLocal(key)) {
+            return *value;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    return NULL;
 }
 
-malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+const malValueRef* malEnv::globalCell(const malSymbol* symbol)
+{
+    const malSymbol* key = symbol->identity();
+    for (malEnv* env = this; env; env = env->outer()) {
+        if (const malValueRef* value = env->findLocal(key)) {
+            bool isGlobal = !env->outer() && (s_localDefs.count(key) == 0);
+            return isGlobal ? value : NULL;
+        }
+    }
+    return NULL;
+}
+
+malValuePtr malEnv::get(const malSymbol* symbol)
+{
+    malValuePtr value = lookup(symbol);
+    MAL_CHECK(value, "'%s' not found", symbol->value().c_str());
+    return value;
+}
+
+void malEnv::entries(malValueVec& items) const
+{
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        items.push_back(const_cast<malSymbol*>(it->first));
+        items.push_back(it->second);
+    }
+}
+
+malValuePtr malEnv::set(const malSymbol* symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
+    const malSymbol* key = symbol->identity();
+    int slot = m_layout ? m_layout->slotOf(key) : -1;
+    if (slot >= 0) {
+        m_slots[slot] = value;
+    }
+    else {
+        if (m_outer && (m_map.count(key) == 0)) {
+            // A new name outside the global frame may shadow a global
+            // which a malGlobalRef has cached.
+            s_localDefs.insert(key);
+            s_version++;
+        }
+        m_map[key] = value;
+    }
     return value;
 }
 
+malEnvPtr malEnv::find(const String& symbol)
+{
+    return find(intern(symbol));
+}
+
+malValuePtr malEnv::get(const String& symbol)
+{
+    return get(intern(symbol));
+}
+
+malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+{
+    return set(intern(symbol), value);
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
@@ -1,29 +1,112 @@
 #ifndef INCLUDE_ENVIRONMENT_H
 #define INCLUDE_ENVIRONMENT_H
 
+#include "Collector.h"
 #include "MAL.h"
 
-#include <map>
+#include <unordered_map>
 
+//  The names of the slots in a frame, in order. The layout of a function's
+//  frame comes from its parameters, where "& rest" makes the last slot
+//  collect any remaining arguments. Its arity is the number of parameters
+//  before the "&", worked out once, when the fn* is evaluated.
+class malFrameLayout : public RefCounted {
+public:
+    malFrameLayout();
+    malFrameLayout(const malSymbolVec& params);
+
+    //  A copy of a layout made by either of the above, as in an image.
+    malFrameLayout(const malSymbolVec& names, bool isVariadic, int arity);
+
+    //  Return the slot for name, adding one if it doesn't have one yet.
+    int add(const malSymbol* name);
+
+    //  Return the slot for name, or -1 if it doesn't have one.
+    int slotOf(const malSymbol* name) const;
+
+    int count() const { return m_names.size(); }
+    const malSymbol* name(int slot) const { return m_names[slot]; }
+    bool isVariadic() const { return m_isVariadic; }
+    int arity() const { return m_arity; }
+
+private:
+    malSymbolVec m_names;
+    bool         m_isVariadic;
+    int          m_arity;
+};
+
+//  A frame holds the values for its layout's names in a flat array of
+//  slots. Names without a slot, which are all of them in the global frame,
+//  and any made later with def!, are kept in a map instead. An entry in the
+//  map never moves once made, so a global binding is a stable cell which a
+//  malGlobalRef can keep a pointer to. The slots of a small frame are kept
+//  in the frame itself, so making one is a single allocation.
 class malEnv : public RefCounted {
 public:
     malEnv(malEnvPtr outer = NULL);
+    malEnv(malEnvPtr outer, const malFrameLayoutPtr& layout);
     malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+           const malFrameLayoutPtr& params,
            malValueIter argsBegin,
            malValueIter argsEnd);
 
     ~malEnv();
 
+    virtual void visitChildren(Visitor& visit) const;
+    virtual void clearChildren();
+
+    malValuePtr get(const malSymbol* symbol);
+    malEnvPtr   find(const malSymbol* symbol);
+    malValuePtr set(const malSymbol* symbol, malValuePtr value);
+
+    //  As get, but returns NULL if the symbol isn't bound.
+    malValuePtr lookup(const malSymbol* symbol);
+
+    //  Return the global cell the symbol is bound to, or NULL if it's bound
+    //  elsewhere, or to a name which def! has ever bound outside the global
+    //  frame. Such a name could be shadowed by a frame with the same layout
+    //  as this one, so it can't be cached.
+    const malValueRef* globalCell(const malSymbol* symbol);
+
+    //  Changes whenever def! binds a new name outside the global frame,
+    //  which might shadow a global.
+    static unsigned version() { return s_version; }
+
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
+
     malEnvPtr   getRoot();
 
+    malEnv* outer() const { return m_outer.ptr(); }
+    const malFrameLayoutPtr& layout() const { return m_layout; }
+    bool hasUnslotted() const { return !m_map.empty(); }
+
+    //  Append the bindings which have no slot to items, as alternating
+    //  symbols and values.
+    void entries(malValueVec& items) const;
+
+    //  An empty slot is one whose let* binding hasn't been evaluated yet.
+    const malValueRef& slot(int index) const { return m_slots[index]; }
+    void setSlot(int index, malValuePtr value) { m_slots[index] = value; }
+
 private:
-    typedef std::map<String, malValuePtr> Map;
+    enum { INLINE_SLOTS = 4 };
+
+    void makeSlots(int count);
+    const malValueRef* findLocal(const malSymbol* key) const;
+
+    // Keyed on the interned symbol, see malSymbol::identity().
+    typedef std::unordered_map<const malSymbol*, malValueRef> Map;
+
+    static unsigned s_version;
+
+    malFrameLayoutPtr m_layout;
+    malValueRef* m_slots;
+    malValueRef m_inlineSlots[INLINE_SLOTS];
     Map m_map;
-    malEnvPtr m_outer;
+    malEnvRef m_outer;
+    malCycleRoot m_root;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -0,0 +1,949 @@
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+//  An image is everything reachable from an environment, written as a list
+//  of records, each of which makes one object from those before it. Every
+//  number is a varint, and every string its length followed by its bytes.
+//  A reference to a value is 0 for none, a small integer n as 2n+1, with n
+//  zigzagged, or record i as 2i+2, so those never need a record of their
+//  own.
+//
+//  An object is only written once everything it refers to has been, which
+//  leaves the cycles. Those can only pass through environments and atoms,
+//  the objects which change after they're made, so each of those is written
+//  empty first, and filled in by the records at the end.
+//
+//  Compiled code, and what the evaluators keep with forms they've already
+//  seen, are left out, and made again as they would be from source. Builtins
+//  are written by name, and found by that name when the image is loaded.
+//
+//  load-file caches the forms it reads from each file in the same format,
+//  as a single value, see saveCachedForms().
+
+static const char IMAGE_MAGIC[] = "mal-image 1\n";
+static const char FORMS_MAGIC[] = "mal-forms 1\n";
+
+enum ImageRecord {
+    IMAGE_END,
+    IMAGE_CONSTANT,     // name
+    IMAGE_INTEGER,      // zigzagged value, if it's not a small integer
+    IMAGE_STRING,       // text
+    IMAGE_KEYWORD,      // text
+    IMAGE_SYMBOL,       // text
+    IMAGE_LOCAL_REF,    // text, depth, slot, layout
+    IMAGE_GLOBAL_REF,   // text, scope layout
+    IMAGE_LIST,         // count, items
+    IMAGE_VECTOR,       // count, items
+    IMAGE_HASH,         // isEvaluated, count, keys and values
+    IMAGE_BUILTIN,      // name
+    IMAGE_LAMBDA,       // params layout, body, env, isMacro
+    IMAGE_ATOM,         // an empty atom, see IMAGE_ATOM_VALUE
+    IMAGE_WITH_META,    // value, meta
+    IMAGE_LAYOUT,       // count, names, isVariadic, arity
+    IMAGE_ROOT,         // the environment the image was made from
+    IMAGE_ENV,          // outer, layout; empty, see IMAGE_SLOT and IMAGE_BIND
+    IMAGE_SLOT,         // env, index, value
+    IMAGE_BIND,         // env, name, value
+    IMAGE_ATOM_VALUE,   // atom, value
+};
+
+//  Interleaves negative and positive integers, so that small ones of either
+//  sign are written in few bytes.
+static uint64_t zigzag(int64_t n)
+{
+    return (static_cast<uint64_t>(n) << 1) ^ static_cast<uint64_t>(n >> 63);
+}
+
+static int64_t unzigzag(uint64_t n)
+{
+    return static_cast<int64_t>(n >> 1) ^ -static_cast<int64_t>(n & 1);
+}
+
+class ImageWriter {
+public:
+    ImageWriter(const char* magic);
+
+    //  Write everything reachable from root, which becomes the environment
+    //  the image is loaded into.
+    void writeEnv(const malEnvPtr& root);
+
+    //  Write value, and everything reachable from it.
+    void writeValue(const malValuePtr& value);
+
+    void putNumber(uint64_t number);
+    void putString(const String& text);
+
+    const String& data() const { return m_data; }
+
+private:
+    enum Kind { VALUE, ENV, LAYOUT };
+
+    //  An object still to be written, once what it refers to has been.
+    struct Pending {
+        Kind        kind;
+        const void* object;
+        bool        isReady;
+    };
+
+    void write(Kind kind, const void* object);
+    void push(Kind kind, const void* object);
+    void pushValue(const malValuePtr& value);
+    void pushChildren(Kind kind, const void* object);
+    void record(Kind kind, const void* object);
+    void recordValue(const malValue* value);
+    void fill(const malEnv* env);
+    void fill(const malAtom* atom);
+    void finish();
+
+    void putInteger(int64_t n);
+    void putRef(const void* object);
+    void putValue(const malValuePtr& value);
+
+    void startRecord(ImageRecord record, const void* object);
+
+    malEnvPtr                               m_root;
+    String                                  m_data;
+    size_t                                  m_count;
+    std::unordered_map<const void*, size_t> m_ids;
+    std::unordered_set<const void*>         m_writing;
+    std::vector<Pending>                    m_pending;
+    std::vector<const malEnv*>              m_envs;
+    std::vector<const malAtom*>             m_atoms;
+};
+
+ImageWriter::ImageWriter(const char* magic)
+: m_data(magic)
+, m_count(0)
+{
+
+}
+
+void ImageWriter::writeEnv(const malEnvPtr& root)
+{
+    MAL_CHECK(!root->outer(), "Only the root environment can be saved");
+    m_root = root;
+    write(ENV, root.ptr());
+    finish();
+}
+
+void ImageWriter::writeValue(const malValuePtr& value)
+{
+    if (value && !value.isInteger()) {
+        write(VALUE, value.ptr());
+    }
+    finish();
+    putValue(value);
+}
+
+void ImageWriter::finish()
+{
+    // Filling in an environment or an atom can find more of them.
+    for (size_t e = 0, a = 0; (e < m_envs.size()) || (a < m_atoms.size()); ) {
+        if (e < m_envs.size()) {
+            fill(m_envs[e++]);
+        }
+        else {
+            fill(m_atoms[a++]);
+        }
+    }
+    putNumber(IMAGE_END);
+}
+
+//  Write object, after everything it refers to, working through a list of
+//  objects rather than recursing, as a value can be nested arbitrarily
+//  deeply.
+void ImageWriter::write(Kind kind, const void* object)
+{
+    push(kind, object);
+    while (!m_pending.empty()) {
+        Pending next = m_pending.back();
+        m_pending.pop_back();
+        if (m_ids.count(next.object)) {
+            continue;
+        }
+        if (next.isReady) {
+            m_writing.erase(next.object);
+            record(next.kind, next.object);
+            continue;
+        }
+        MAL_CHECK(m_writing.insert(next.object).second,
+                  "Can't save a value which contains itself");
+        Pending ready = { next.kind, next.object, true };
+        m_pending.push_back(ready);
+        pushChildren(next.kind, next.object);
+    }
+}
+
+void ImageWriter::push(Kind kind, const void* object)
+{
+    if (object && !m_ids.count(object)) {
+        Pending pending = { kind, object, false };
+        m_pending.push_back(pending);
+    }
+}
+
+void ImageWriter::pushValue(const malValuePtr& value)
+{
+    if (value && !value.isInteger()) {
+        push(VALUE, value.ptr());
+    }
+}
+
+//  What must be written before object. An environment's bindings and an
+//  atom's value are written after it, see fill().
+void ImageWriter::pushChildren(Kind kind, const void* object)
+{
+    if (kind == LAYOUT) {
+        return;
+    }
+    if (kind == ENV) {
+        const malEnv* env = static_cast<const malEnv*>(object);
+        push(ENV, env->outer());
+        push(LAYOUT, env->layout().ptr());
+        return;
+    }
+
+    const malValue* value = static_cast<const malValue*>(object);
+    malValuePtr meta = value->meta();
+    if (meta != mal::nilValue()) {
+        pushValue(meta);
+    }
+    switch (value->type()) {
+        case TYPE_SYMBOL: {
+            const malSymbol* symbol = static_cast<const malSymbol*>(value);
+            if (const malLocalRef* ref = symbol->asLocalRef()) {
+                push(LAYOUT, ref->layout().ptr());
+            }
+            else if (const malGlobalRef* ref = symbol->asGlobalRef()) {
+                push(LAYOUT, ref->scope().ptr());
+            }
+            break;
+        }
+
+        case TYPE_LIST:
+        case TYPE_VECTOR: {
+            const malSequence* seq = static_cast<const malSequence*>(value);
+            for (int i = seq->count() - 1; i >= 0; i--) {
+                pushValue(seq->item(i));
+            }
+            break;
+        }
+
+        case TYPE_HASH: {
+            malValueVec items;
+            static_cast<const malHash*>(value)->entries(items);
+            for (auto it = items.rbegin(), end = items.rend();
+                                                    it != end; ++it) {
+                pushValue(*it);
+            }
+            break;
+        }
+
+        case TYPE_LAMBDA: {
+            const malLambda* lambda = static_cast<const malLambda*>(value);
+            push(ENV, lambda->env());
+            pushValue(lambda->getBody());
+            push(LAYOUT, lambda->params().ptr());
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+void ImageWriter::record(Kind kind, const void* object)
+{
+    if (kind == LAYOUT) {
+        const malFrameLayout* layout
+            = static_cast<const malFrameLayout*>(object);
+        startRecord(IMAGE_LAYOUT, object);
+        putNumber(layout->count());
+        for (int i = 0; i < layout->count(); i++) {
+            putString(layout->name(i)->value());
+        }
+        putNumber(layout->isVariadic());
+        putNumber(layout->arity());
+    }
+    else if (kind == ENV) {
+        const malEnv* env = static_cast<const malEnv*>(object);
+        if (env == m_root.ptr()) {
+            startRecord(IMAGE_ROOT, object);
+        }
+        else {
+            startRecord(IMAGE_ENV, object);
+            putRef(env->outer());
+            putRef(env->layout().ptr());
+        }
+        m_envs.push_back(env);
+    }
+    else {
+        recordValue(static_cast<const malValue*>(object));
+    }
+}
+
+//  A value with metadata is written without it, and then given it.
+void ImageWriter::recordValue(const malValue* value)
+{
+    malValuePtr meta = value->meta();
+    bool hasMeta = (meta != mal::nilValue());
+    const void* id = hasMeta ? NULL : value;
+
+    switch (value->type()) {
+        case TYPE_CONSTANT:
+            startRecord(IMAGE_CONSTANT, id);
+            putString(value->print(true));
+            break;
+
+        case TYPE_INTEGER:
+            startRecord(IMAGE_INTEGER, id);
+            putInteger(static_cast<const malInteger*>(value)->value());
+            break;
+
+        case TYPE_STRING:
+        case TYPE_KEYWORD:
+        case TYPE_SYMBOL: {
+            const malStringBase* text
+                = static_cast<const malStringBase*>(value);
+            const malSymbol* symbol = (value->type() == TYPE_SYMBOL)
+                ? static_cast<const malSymbol*>(value) : NULL;
+            const malLocalRef* local = symbol ? symbol->asLocalRef() : NULL;
+            const malGlobalRef* global = symbol ? symbol->asGlobalRef()
+                                                : NULL;
+            if (local) {
+                startRecord(IMAGE_LOCAL_REF, id);
+                putString(text->value());
+                putNumber(local->depth());
+                putNumber(local->slot());
+                putRef(local->layout().ptr());
+            }
+            else if (global) {
+                startRecord(IMAGE_GLOBAL_REF, id);
+                putString(text->value());
+                putRef(global->scope().ptr());
+            }
+            else {
+                startRecord((value->type() == TYPE_STRING) ? IMAGE_STRING
+                          : (value->type() == TYPE_KEYWORD) ? IMAGE_KEYWORD
+                          : IMAGE_SYMBOL, id);
+                putString(text->value());
+            }
+            break;
+        }
+
+        case TYPE_LIST:
+        case TYPE_VECTOR: {
+            const malSequence* seq = static_cast<const malSequence*>(value);
+            startRecord((value->type() == TYPE_LIST) ? IMAGE_LIST
+                                                     : IMAGE_VECTOR, id);
+            putNumber(seq->count());
+            for (int i = 0; i < seq->count(); i++) {
+                putValue(seq->item(i));
+            }
+            break;
+        }
+
+        case TYPE_HASH: {
+            const malHash* hash = static_cast<const malHash*>(value);
+            malValueVec items;
+            hash->entries(items);
+            startRecord(IMAGE_HASH, id);
+            putNumber(hash->isEvaluated());
+            putNumber(items.size());
+            for (auto it = items.begin(), end = items.end(); it != end; ++it) {
+                putValue(*it);
+            }
+            break;
+        }
+
+        case TYPE_BUILTIN:
+            startRecord(IMAGE_BUILTIN, id);
+            putString(static_cast<const malBuiltIn*>(value)->name());
+            break;
+
+        case TYPE_LAMBDA: {
+            const malLambda* lambda = static_cast<const malLambda*>(value);
+            startRecord(IMAGE_LAMBDA, id);
+            putRef(lambda->params().ptr());
+            putValue(lambda->getBody());
+            putRef(lambda->env());
+            putNumber(lambda->isMacro());
+            break;
+        }
+
+        case TYPE_ATOM:
+            startRecord(IMAGE_ATOM, id);
+            break;
+
+        default:
+            MAL_FAIL("Can't save %s in an image", value->print(true).c_str());
+    }
+
+    if (hasMeta) {
+        size_t base = m_count - 1;
+        startRecord(IMAGE_WITH_META, value);
+        putNumber(2 * base + 2);
+        putValue(meta);
+    }
+    if (value->type() == TYPE_ATOM) {
+        m_atoms.push_back(static_cast<const malAtom*>(value));
+    }
+}
+
+void ImageWriter::fill(const malEnv* env)
+{
+    int count = env->layout() ? env->layout()->count() : 0;
+    for (int i = 0; i < count; i++) {
+        malValuePtr value = env->slot(i);
+        if (value) {
+            write(VALUE, value.isInteger() ? NULL : value.ptr());
+            putNumber(IMAGE_SLOT);
+            putRef(env);
+            putNumber(i);
+            putValue(value);
+        }
+    }
+
+    malValueVec items;
+    env->entries(items);
+    for (auto it = items.begin(), end = items.end(); it != end; it += 2) {
+        malValuePtr value = it[1];
+        if (value && !value.isInteger()) {
+            write(VALUE, value.ptr());
+        }
+        putNumber(IMAGE_BIND);
+        putRef(env);
+        putString(STATIC_CAST(malSymbol, it[0])->value());
+        putValue(value);
+    }
+}
+
+void ImageWriter::fill(const malAtom* atom)
+{
+    malValuePtr value = atom->deref();
+    if (value && !value.isInteger()) {
+        write(VALUE, value.ptr());
+    }
+    putNumber(IMAGE_ATOM_VALUE);
+    putRef(atom);
+    putValue(value);
+}
+
+void ImageWriter::putNumber(uint64_t number)
+{
+    while (number >= 0x80) {
+        m_data += static_cast<char>((number & 0x7f) | 0x80);
+        number >>= 7;
+    }
+    m_data += static_cast<char>(number);
+}
+
+void ImageWriter::putInteger(int64_t n)
+{
+    putNumber(zigzag(n));
+}
+
+void ImageWriter::putString(const String& text)
+{
+    putNumber(text.size());
+    m_data += text;
+}
+
+void ImageWriter::putRef(const void* object)
+{
+    putNumber(object ? 2 * m_ids.at(object) + 2 : 0);
+}
+
+void ImageWriter::putValue(const malValuePtr& value)
+{
+    if (!value) {
+        putNumber(0);
+    }
+    else if (value.isInteger()) {
+        putNumber(2 * zigzag(value.integerValue()) + 1);
+    }
+    else {
+        putRef(value.ptr());
+    }
+}
+
+//  Start the record which makes object. A value written without its
+//  metadata is made for the next record alone, and so has no object.
+void ImageWriter::startRecord(ImageRecord record, const void* object)
+{
+    if (object) {
+        m_ids[object] = m_count;
+    }
+    m_count++;
+    putNumber(record);
+}
+
+void saveImage(const String& path, const malEnvPtr& env)
+{
+    ImageWriter writer(IMAGE_MAGIC);
+    writer.writeEnv(env);
+    std::ofstream file(path.c_str(), std::ios::binary);
+    MAL_CHECK(file, "Can't write the image %s", path.c_str());
+    file.write(writer.data().data(), writer.data().size());
+    MAL_CHECK(file, "Can't write the image %s", path.c_str());
+}
+
+class ImageReader {
+public:
+    ImageReader(const String& data, const char* magic);
+
+    //  Read what ImageWriter::writeEnv() wrote into root.
+    void readEnv(const malEnvPtr& root);
+
+    //  Read what ImageWriter::writeValue() wrote.
+    malValuePtr readValue();
+
+    uint64_t    getNumber();
+    String      getString();
+
+private:
+    void read();
+    void add(const malValuePtr& value) { m_values.push_back(value); }
+
+    int64_t     getInteger();
+    int         getInt(uint64_t limit);
+    malValuePtr getValue(bool canBeNone = false);
+    size_t      getIndex();
+    malEnvPtr   getEnv();
+    malFrameLayoutPtr getLayout();
+    void        getValues();
+    const malSymbol* getSymbol() {
+        return STATIC_CAST(malSymbol, mal::symbol(getString()));
+    }
+
+    malEnvPtr           m_root;
+    const String&       m_data;
+    size_t              m_pos;
+
+    //  What each record made, by its index. Most make a value, and the few
+    //  which make an environment or a layout leave their value empty.
+    malValueVec                                   m_values;
+    std::unordered_map<size_t, malEnvPtr>         m_envs;
+    std::unordered_map<size_t, malFrameLayoutPtr> m_layouts;
+
+    //  The items of the list, vector or hash being read.
+    malValueVec m_items;
+};
+
+ImageReader::ImageReader(const String& data, const char* magic)
+: m_data(data)
+, m_pos(strlen(magic))
+{
+    MAL_CHECK(data.compare(0, m_pos, magic) == 0, "Not a mal image");
+}
+
+void ImageReader::readEnv(const malEnvPtr& root)
+{
+    m_root = root;
+    read();
+}
+
+malValuePtr ImageReader::readValue()
+{
+    read();
+    return getValue();
+}
+
+void ImageReader::read()
+{
+    while (1) {
+        ImageRecord record = static_cast<ImageRecord>(getNumber());
+        switch (record) {
+            case IMAGE_END:
+                return;
+
+            case IMAGE_CONSTANT: {
+                String name = getString();
+                MAL_CHECK((name == "nil") || (name == "true") ||
+                          (name == "false"), "Bad constant in image");
+                add((name == "nil")  ? mal::nilValue()
+                  : (name == "true") ? mal::trueValue()
+                  : mal::falseValue());
+                break;
+            }
+
+            case IMAGE_INTEGER:
+                add(mal::integer(getInteger()));
+                break;
+
+            case IMAGE_STRING:
+                add(mal::string(getString()));
+                break;
+
+            case IMAGE_KEYWORD:
+                add(mal::keyword(getString()));
+                break;
+
+            case IMAGE_SYMBOL:
+                add(mal::symbol(getString()));
+                break;
+
+            case IMAGE_LOCAL_REF: {
+                // The depth needn't be checked, as lookup() stops at the
+                // last frame, and the slot is only used in a frame with
+                // this layout.
+                const malSymbol* symbol = getSymbol();
+                int depth = getInt(INT_MAX);
+                int slot = getInt(INT_MAX);
+                malFrameLayoutPtr layout = getLayout();
+                MAL_CHECK(layout && (slot < layout->count()),
+                          "Bad local in image");
+                add(new malLocalRef(*symbol, depth, slot, layout));
+                break;
+            }
+
+            case IMAGE_GLOBAL_REF: {
+                const malSymbol* symbol = getSymbol();
+                add(new malGlobalRef(*symbol, getLayout()));
+                break;
+            }
+
+            case IMAGE_LIST:
+            case IMAGE_VECTOR: {
+                getValues();
+                malValueIter begin = m_items.data();
+                malValueIter end = begin + m_items.size();
+                add((record == IMAGE_LIST) ? mal::list(begin, end)
+                                           : mal::vector(begin, end));
+                break;
+            }
+
+            case IMAGE_HASH: {
+                bool isEvaluated = getNumber();
+                getValues();
+                add(mal::hash(m_items.data(), m_items.data() + m_items.size(),
+                              isEvaluated));
+                break;
+            }
+
+            case IMAGE_BUILTIN: {
+                String name = getString();
+                malValuePtr builtIn = findBuiltIn(name);
+                MAL_CHECK(builtIn, "Image refers to unknown builtin %s",
+                          name.c_str());
+                add(builtIn);
+                break;
+            }
+
+            case IMAGE_LAMBDA: {
+                malFrameLayoutPtr params = getLayout();
+                malValuePtr body = getValue();
+                malEnvPtr env = getEnv();
+                MAL_CHECK(params && env, "Bad function in image");
+                malValuePtr lambda = mal::lambda(params, body, env);
+                if (getNumber()) {
+                    lambda = mal::macro(*STATIC_CAST(malLambda, lambda));
+                }
+                add(lambda);
+                break;
+            }
+
+            case IMAGE_ATOM:
+                add(mal::atom(mal::nilValue()));
+                break;
+
+            case IMAGE_WITH_META: {
+                malValuePtr value = getValue();
+                malValuePtr meta = getValue();
+                add(value->withMeta(meta));
+                break;
+            }
+
+            case IMAGE_LAYOUT: {
+                // Each name takes at least a byte.
+                malSymbolVec names(getInt(m_data.size() - m_pos + 1));
+                for (auto it = names.begin(), end = names.end();
+                                                    it != end; ++it) {
+                    *it = getSymbol();
+                }
+                bool isVariadic = getNumber();
+                int arity = getInt(names.size() - isVariadic + 1);
+                m_layouts[m_values.size()]
+                    = new malFrameLayout(names, isVariadic, arity);
+                add(NULL);
+                break;
+            }
+
+            case IMAGE_ROOT:
+            case IMAGE_ENV: {
+                malEnvPtr env;
+                if (record == IMAGE_ROOT) {
+                    MAL_CHECK(m_root, "Bad environment in image");
+                    env = m_root;
+                }
+                else {
+                    malEnvPtr outer = getEnv();
+                    malFrameLayoutPtr layout = getLayout();
+                    env = layout ? new malEnv(outer, layout)
+                                 : new malEnv(outer);
+                }
+                m_envs[m_values.size()] = env;
+                add(NULL);
+                break;
+            }
+
+            case IMAGE_SLOT: {
+                malEnvPtr env = getEnv();
+                MAL_CHECK(env && env->layout(), "Bad slot in image");
+                int index = getInt(env->layout()->count());
+                env->setSlot(index, getValue());
+                break;
+            }
+
+            case IMAGE_BIND: {
+                malEnvPtr env = getEnv();
+                MAL_CHECK(env, "Bad environment in image");
+                const malSymbol* symbol = getSymbol();
+                env->set(symbol, getValue(true));
+                break;
+            }
+
+            case IMAGE_ATOM_VALUE: {
+                malAtom* atom = VALUE_CAST(malAtom, getValue());
+                atom->reset(getValue());
+                break;
+            }
+
+            default:
+                MAL_FAIL("Bad record in image");
+        }
+    }
+}
+
+uint64_t ImageReader::getNumber()
+{
+    uint64_t number = 0;
+    for (int shift = 0; ; shift += 7) {
+        MAL_CHECK(shift < 64, "Bad number in image");
+        MAL_CHECK(m_pos < m_data.size(), "Image is truncated");
+        unsigned char byte = m_data[m_pos++];
+        number |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return number;
+        }
+    }
+}
+
+int64_t ImageReader::getInteger()
+{
+    return unzigzag(getNumber());
+}
+
+//  Read a number which must be less than limit, and fit in an int.
+int ImageReader::getInt(uint64_t limit)
+{
+    uint64_t number = getNumber();
+    MAL_CHECK((number < limit) && (number <= INT_MAX), "Bad number in image");
+    return static_cast<int>(number);
+}
+
+String ImageReader::getString()
+{
+    uint64_t length = getNumber();
+    MAL_CHECK(length <= m_data.size() - m_pos, "Image is truncated");
+    String text = m_data.substr(m_pos, length);
+    m_pos += length;
+    return text;
+}
+
+malValuePtr ImageReader::getValue(bool canBeNone)
+{
+    uint64_t ref = getNumber();
+    if (ref == 0) {
+        MAL_CHECK(canBeNone, "Bad reference in image");
+        return malValuePtr();
+    }
+    if (ref & 1) {
+        return mal::integer(unzigzag(ref >> 1));
+    }
+    uint64_t index = ref / 2 - 1;
+    MAL_CHECK((index < m_values.size()) && m_values[index],
+              "Bad reference in image");
+    return m_values[index];
+}
+
+//  The index of the record an environment or layout reference refers to,
+//  or SIZE_MAX for none.
+size_t ImageReader::getIndex()
+{
+    uint64_t ref = getNumber();
+    MAL_CHECK(!(ref & 1), "Bad reference in image");
+    return (ref == 0) ? SIZE_MAX : (ref / 2 - 1);
+}
+
+malEnvPtr ImageReader::getEnv()
+{
+    size_t index = getIndex();
+    if (index == SIZE_MAX) {
+        return malEnvPtr();
+    }
+    auto it = m_envs.find(index);
+    MAL_CHECK(it != m_envs.end(), "Bad environment in image");
+    return it->second;
+}
+
+malFrameLayoutPtr ImageReader::getLayout()
+{
+    size_t index = getIndex();
+    if (index == SIZE_MAX) {
+        return malFrameLayoutPtr();
+    }
+    auto it = m_layouts.find(index);
+    MAL_CHECK(it != m_layouts.end(), "Bad layout in image");
+    return it->second;
+}
+
+//  Read a count, and that many values into m_items.
+void ImageReader::getValues()
+{
+    uint64_t count = getNumber();
+    MAL_CHECK(count <= m_data.size() - m_pos, "Image is truncated");
+    m_items.clear();
+    for (uint64_t i = 0; i < count; i++) {
+        m_items.push_back(getValue());
+    }
+}
+
+void loadImage(const String& path, const malEnvPtr& env)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    MAL_CHECK(file, "Can't read the image %s", path.c_str());
+    std::stringstream data;
+    data << file.rdbuf();
+    String contents = data.str();
+    ImageReader reader(contents, IMAGE_MAGIC);
+    reader.readEnv(env);
+}
+
+//  A file smaller than this is read faster than its cache can be opened.
+enum { MIN_CACHED_SIZE = 2048 };
+
+//  FNV-1a, which is enough to tell whether a file has changed, and is the
+//  same from one build to the next.
+static uint64_t contentHash(const String& text)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto it = text.begin(), end = text.end(); it != end; ++it) {
+        hash = (hash ^ static_cast<unsigned char>(*it)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//  The directory cached forms go in, or empty for none. Nothing is cached
+//  unless MAL_CACHE_DIR asks for it, so that running a program doesn't
+//  write files anywhere it wasn't told to.
+static String cacheDirectory()
+{
+    const char* dir = getenv("MAL_CACHE_DIR");
+    return dir ? dir : "";
+}
+
+//  Files are cached by their full path, so that each has one cache whichever
+//  directory it's loaded from.
+static String cacheKey(const String& path)
+{
+    char fullPath[PATH_MAX];
+    return realpath(path.c_str(), fullPath) ? String(fullPath) : path;
+}
+
+//  The file the forms read from the file with key are cached in, or empty
+//  if there's no cache.
+static String cacheFile(const String& key)
+{
+    String dir = cacheDirectory();
+    if (dir.empty()) {
+        return String();
+    }
+    return STRF("%s/%016llx.forms", dir.c_str(),
+                static_cast<unsigned long long>(contentHash(key)));
+}
+
+//  The cache is only ever a shortcut, so if it can't be read, or was made
+//  from another file or another version of this one, the file is read as
+//  usual.
+bool loadCachedForms(const String& path, const String& source,
+                     malValueVec& forms)
+{
+    if (source.size() < MIN_CACHED_SIZE) {
+        return false;
+    }
+    String key = cacheKey(path);
+    String cache = cacheFile(key);
+    std::ifstream file(cache.c_str(), std::ios::binary);
+    if (cache.empty() || !file) {
+        return false;
+    }
+    std::stringstream data;
+    data << file.rdbuf();
+    String contents = data.str();
+    try {
+        ImageReader reader(contents, FORMS_MAGIC);
+        if ((reader.getNumber() != contentHash(source)) ||
+            (reader.getNumber() != source.size()) ||
+            (reader.getString() != key)) {
+            return false;
+        }
+        malList* list = DYNAMIC_CAST(malList, reader.readValue());
+        if (!list) {
+            return false;
+        }
+        forms.assign(list->begin(), list->end());
+        return true;
+    }
+    catch (String&) {
+        return false;
+    }
+    catch (std::exception&) {
+        return false;
+    }
+}
+
+//  Likewise, a cache which can't be written is left alone. Each is written
+//  to a file of its own and then renamed, so that a program reading the
+//  same file never sees half of it.
+void saveCachedForms(const String& path, const String& source,
+                     const malValueVec& forms)
+{
+    if (source.size() < MIN_CACHED_SIZE) {
+        return;
+    }
+    String key = cacheKey(path);
+    String cache = cacheFile(key);
+    if (cache.empty()) {
+        return;
+    }
+    ImageWriter writer(FORMS_MAGIC);
+    writer.putNumber(contentHash(source));
+    writer.putNumber(source.size());
+    writer.putString(key);
+    writer.writeValue(mal::list(new malValueVec(forms)));
+
+    mkdir(cacheDirectory().c_str(), 0777);
+
+    String temp = STRF("%s.%d", cache.c_str(), static_cast<int>(getpid()));
+    std::ofstream file(temp.c_str(), std::ios::binary);
+    file.write(writer.data().data(), writer.data().size());
+    file.close();
+    if (!file || (rename(temp.c_str(), cache.c_str()) != 0)) {
+        remove(temp.c_str());
+    }
+}
@@ -1,20 +1,31 @@
 #ifndef INCLUDE_MAL_H
 #define INCLUDE_MAL_H
 
+#include "Collector.h"
 #include "Debug.h"
 #include "RefCountedPtr.h"
 #include "String.h"
 #include "Validation.h"
+#include "ValuePtr.h"
 
 #include <vector>
 
-class malValue;
-typedef RefCountedPtr<malValue>  malValuePtr;
+#if MAL_TRACING_GC
+typedef std::vector<malValueRef, malRootAllocator<malValueRef> > malValueVec;
+#else
 typedef std::vector<malValuePtr> malValueVec;
-typedef malValueVec::iterator    malValueIter;
+#endif
+typedef malValueRef*             malValueIter;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
+typedef RefCountedRef<malEnv>     malEnvRef;
+
+class malFrameLayout;
+typedef RefCountedPtr<malFrameLayout> malFrameLayoutPtr;
+
+class malSymbol;
+typedef std::vector<const malSymbol*> malSymbolVec;
 
 // step*.cpp
 extern malValuePtr APPLY(malValuePtr op,
@@ -25,8 +36,18 @@ extern String rep(const String& input, malEnvPtr env);
 
 // Core.cpp
 extern void installCore(malEnvPtr env);
+extern malValuePtr findBuiltIn(const String& name);
+
+// Image.cpp
+extern void saveImage(const String& path, const malEnvPtr& env);
+extern void loadImage(const String& path, const malEnvPtr& env);
+extern bool loadCachedForms(const String& path, const String& source,
+                            malValueVec& forms);
+extern void saveCachedForms(const String& path, const String& source,
+                            const malValueVec& forms);
 
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
+extern void readForms(const String& input, malValueVec& forms);
 
 #endif // INCLUDE_MAL_H
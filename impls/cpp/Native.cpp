@@ -0,0 +1,95 @@
+#include "Native.h"
+
+#include <iostream>
+
+malValuePtr malNativeCode::run(const malEnvPtr& env) const
+{
+    malNativeTail tail;
+    malValuePtr value = m_body(env, tail);
+    while (!value) {
+        malValuePtr op = tail.op;
+        malValueVec args;
+        args.swap(tail.args);
+
+        // Only malc gives a lambda code in a compiled program, as the
+        // interpreter there is always the tree-walking EVAL.
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (lambda && lambda->code()) {
+            const malNativeCode* code =
+                static_cast<const malNativeCode*>(lambda->code());
+            value = code->m_body(lambda->makeEnv(args.data(),
+                                                 args.data() + args.size()),
+                                 tail);
+        }
+        else {
+            value = APPLY(op, args.data(), args.data() + args.size());
+        }
+    }
+    return value;
+}
+
+void malNativeGlobal::init(const malEnvPtr& root, malValuePtr symbol)
+{
+    m_root = root;
+    m_symbol = STATIC_CAST(malSymbol, symbol)->identity();
+}
+
+malValuePtr malNativeGlobal::find()
+{
+    m_cell = m_root->globalCell(m_symbol);
+    return m_cell ? malValuePtr(*m_cell) : m_root->get(m_symbol);
+}
+
+malValuePtr malNativeCall(const malValuePtr& op,
+                          malValueIter argsBegin, malValueIter argsEnd)
+{
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    if (lambda && lambda->code()) {
+        return lambda->code()->run(lambda->makeEnv(argsBegin, argsEnd));
+    }
+    return APPLY(op, argsBegin, argsEnd);
+}
+
+malValuePtr malNativeSlot(malEnv* env, int depth, int slot,
+                          const malValuePtr& symbol)
+{
+    malEnv* frame = env;
+    for (int i = 0; i < depth; i++) {
+        frame = frame->outer();
+    }
+    const malValuePtr& value = frame->slot(slot);
+    return value ? value : env->get(STATIC_CAST(malSymbol, symbol));
+}
+
+malFrameLayoutPtr malNativeLayout(const malValuePtr& names, bool isParams)
+{
+    const malSequence* seq = STATIC_CAST(malSequence, names);
+    malSymbolVec symbols;
+    for (int i = 0; i < seq->count(); i++) {
+        symbols.push_back(STATIC_CAST(malSymbol, seq->item(i)));
+    }
+    if (isParams) {
+        return new malFrameLayout(symbols);
+    }
+    malFrameLayoutPtr layout(new malFrameLayout);
+    for (auto it = symbols.begin(); it != symbols.end(); ++it) {
+        layout->add(*it);
+    }
+    return layout;
+}
+
+int malNativeMain(int argc, char* argv[], void (*program)(malEnvPtr env))
+{
+    try {
+        program(nativeStartup(argc - 1, argv + 1));
+    }
+    catch (malValuePtr& mv) {
+        std::cerr << "Error: " << mv->print(true) << "\n";
+        return 1;
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+        return 1;
+    }
+    return 0;
+}
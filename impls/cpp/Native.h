@@ -0,0 +1,103 @@
+#ifndef INCLUDE_NATIVE_H
+#define INCLUDE_NATIVE_H
+
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+//  The runtime for programs which malc has compiled to C++. Each fn* in
+//  the program becomes a C++ function, whose locals are C++ variables, and
+//  is run by a lambda whose code is a malNativeCode. Anything malc can't
+//  compile is read and evaluated by the interpreter when the program runs.
+
+//  A tail call, which a compiled function makes by filling this in and
+//  returning NULL, for malNativeCode::run to make in a loop.
+struct malNativeTail {
+    malValuePtr op;
+    malValueVec args;
+};
+
+typedef malValuePtr (malNativeBody)(malEnvPtr env, malNativeTail& tail);
+
+class malNativeCode : public malCode {
+public:
+    malNativeCode(malNativeBody* body) : m_body(body) { }
+
+    virtual malValuePtr run(const malEnvPtr& env) const;
+
+private:
+    malNativeBody* const m_body;
+};
+
+//  A global which compiled code refers to. Its cell in the global frame is
+//  found on first use, and kept.
+class malNativeGlobal {
+public:
+    malNativeGlobal() : m_symbol(NULL), m_cell(NULL) { }
+
+    void init(const malEnvPtr& root, malValuePtr symbol);
+
+    malValuePtr get() {
+        return m_cell ? malValuePtr(*m_cell) : find();
+    }
+
+    malValuePtr set(malValuePtr value) {
+        return m_root->set(m_symbol, value);
+    }
+
+private:
+    malValuePtr find();
+
+    malEnvPtr          m_root;
+    const malSymbol*   m_symbol;
+    const malValueRef* m_cell;
+};
+
+//  Call op with args. Compiled lambdas run their code directly, anything
+//  else is applied as usual.
+extern malValuePtr malNativeCall(const malValuePtr& op,
+                                 malValueIter argsBegin, malValueIter argsEnd);
+
+//  Call op with args in tail position. A compiled lambda is left in tail
+//  for malNativeCode::run to call, so that the stack doesn't grow, and
+//  anything else is applied at once.
+inline malValuePtr malNativeTailCall(const malValuePtr& op, malValueVec& args,
+                                     malNativeTail& tail)
+{
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    if (lambda && lambda->code()) {
+        tail.op = op;
+        tail.args.swap(args);
+        return malValuePtr();
+    }
+    return APPLY(op, args.data(), args.data() + args.size());
+}
+
+//  Whether op is the lambda made from code, so that a tail call to it can
+//  loop rather than return to run().
+inline bool malNativeIsCode(const malValuePtr& op, const malCodePtr& code)
+{
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+    return lambda && (lambda->code() == code.ptr());
+}
+
+//  The value in slot of the frame depth levels out from env, which is a
+//  frame of an enclosing function. A slot which a let* hasn't set yet is
+//  looked up by name, as the interpreter would.
+extern malValuePtr malNativeSlot(malEnv* env, int depth, int slot,
+                                 const malValuePtr& symbol);
+
+//  The layout of a function's parameters, or of a let* or catch* frame,
+//  from a vector of their names.
+extern malFrameLayoutPtr malNativeLayout(const malValuePtr& names,
+                                         bool isParams);
+
+//  The main() of a compiled program, which sets up the environment as
+//  stepA_mal does, and runs program in it.
+extern int malNativeMain(int argc, char* argv[],
+                         void (*program)(malEnvPtr env));
+
+// stepA_mal.cpp
+extern malEnvPtr nativeStartup(int argc, char* argv[]);
+
+#endif // INCLUDE_NATIVE_H
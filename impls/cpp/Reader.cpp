@@ -1,19 +1,73 @@
 #include "MAL.h"
 #include "Types.h"
 
-#include <regex>
+#include <memory>
+#include <string.h>
+
+// Character classes used by the scanner. A character may be in several.
+enum {
+    CC_SPACE    = 1 << 0,   // skipped between tokens, includes ','
+    CC_SPECIAL  = 1 << 1,   // a single character token
+    CC_DELIM    = 1 << 2,   // terminates a symbol, number or keyword
+    CC_DIGIT    = 1 << 3,
+};
 
-typedef std::regex              Regex;
+class CharClassTable
+{
+public:
+    CharClassTable() {
+        memset(m_classes, 0, sizeof(m_classes));
+        add(" \t\n\v\f\r,",     CC_SPACE | CC_DELIM);
+        add("[]{}()'`~^@",      CC_SPECIAL);
+        add("[]{}('\"`;)",      CC_DELIM);
+        add("0123456789",       CC_DIGIT);
+    }
 
-static const Regex intRegex("^[-+]?\\d+$");
-static const Regex closeRegex("[\\)\\]}]");
+    bool is(char c, int mask) const {
+        return (m_classes[static_cast<unsigned char>(c)] & mask) != 0;
+    }
 
-static const Regex whitespaceRegex("[\\s,]+|;.*");
-static const Regex tokenRegexes[] = {
-    Regex("~@"),
-    Regex("[\\[\\]{}()'`~^@]"),
-    Regex("\"(?:\\\\.|[^\\\\\"])*\""),
-    Regex("[^\\s\\[\\]{}('\"`,;)]+"),
+private:
+    void add(const char* chars, int mask) {
+        for (const char* c = chars; *c; ++c) {
+            m_classes[static_cast<unsigned char>(*c)] |= mask;
+        }
+    }
+
+    unsigned char m_classes[256];
+};
+
+static const CharClassTable charClasses;
+
+// A token is a view into the input buffer, so it is only valid for as long
+// as the string being read.
+class Token
+{
+public:
+    Token() : m_begin(NULL), m_length(0) { }
+    Token(const char* begin, size_t length)
+        : m_begin(begin), m_length(length) { }
+
+    const char* begin() const { return m_begin; }
+    const char* end()   const { return m_begin + m_length; }
+    size_t length()     const { return m_length; }
+
+    char operator [] (size_t index) const { return m_begin[index]; }
+
+    bool operator == (const char* text) const {
+        return (strncmp(m_begin, text, m_length) == 0)
+            && (text[m_length] == '\0');
+    }
+
+    bool operator != (const char* text) const {
+        return !(*this == text);
+    }
+
+    String str() const { return String(m_begin, m_length); }
+
+private:
+    const char* m_begin;
+    size_t      m_length;
 };
 
 class Tokeniser
@@ -21,14 +75,14 @@ class Tokeniser
 public:
     Tokeniser(const String& input);
 
-    String peek() const {
+    Token peek() const {
         ASSERT(!eof(), "Tokeniser reading past EOF in peek\n");
         return m_token;
     }
 
-    String next() {
+    Token next() {
         ASSERT(!eof(), "Tokeniser reading past EOF in next\n");
-        String ret = peek();
+        Token ret = peek();
         nextToken();
         return ret;
     }
@@ -41,82 +95,134 @@ private:
     void skipWhitespace();
     void nextToken();
 
-    bool matchRegex(const Regex& regex);
-
-    typedef String::const_iterator StringIter;
+    const char* scanString(const char* p) const;
 
-    String      m_token;
-    StringIter  m_iter;
-    StringIter  m_end;
+    Token       m_token;
+    const char* m_iter;
+    const char* m_end;
 };
 
 Tokeniser::Tokeniser(const String& input)
-:   m_iter(input.begin())
-,   m_end(input.end())
+:   m_iter(input.data())
+,   m_end(input.data() + input.size())
 {
     nextToken();
 }
 
-bool Tokeniser::matchRegex(const Regex& regex)
+void Tokeniser::nextToken()
 {
+    // Don't advance m_iter until the current token has been consumed in
+    // next(). If we did, we'd hit eof() when there's still one token left.
+    m_iter += m_token.length();
+
+    skipWhitespace();
     if (eof()) {
-        return false;
+        return;
     }
 
-    std::smatch match;
-    auto flags = std::regex_constants::match_continuous;
-    if (!std::regex_search(m_iter, m_end, match, regex, flags)) {
-        return false;
+    const char* p = m_iter;
+    char c = *p;
+    if ((c == '~') && (p + 1 != m_end) && (p[1] == '@')) {
+        p += 2;
+    }
+    else if (charClasses.is(c, CC_SPECIAL)) {
+        p += 1;
+    }
+    else if (c == '"') {
+        p = scanString(p);
+        MAL_CHECK(p != NULL, "expected '\"', got EOF");
+    }
+    else if (!charClasses.is(c, CC_DELIM)) {
+        while ((p != m_end) && !charClasses.is(*p, CC_DELIM)) {
+            ++p;
+        }
+    }
+    else {
+        String mismatch(m_iter, m_end);
+        MAL_CHECK(false, "unexpected '%s'", mismatch.c_str());
     }
 
-    ASSERT(match.size() == 1, "Should only have one submatch, not %lu\n",
-                              match.size());
-    ASSERT(match.position(0) == 0, "Need to match first character\n");
-    ASSERT(match.length(0) > 0, "Need to match a non-empty string\n");
-
-    // Don't advance  m_iter now, do it after we've consumed the token in
-    // next().  If we do it now, we hit eof() when there's still one token left.
-    m_token = match.str(0);
-
-    return true;
+    m_token = Token(m_iter, p - m_iter);
 }
 
-void Tokeniser::nextToken()
+//  Return the end of the string literal starting at p, or NULL if it
+//  isn't terminated.
+const char* Tokeniser::scanString(const char* p) const
 {
-    m_iter += m_token.size();
-
-    skipWhitespace();
-    if (eof()) {
-        return;
+    for (++p; p != m_end; ++p) {
+        if (*p == '"') {
+            return p + 1;
+        }
+        if (*p == '\\') {
+            // An escape can't span a line break.
+            if ((++p == m_end) || (*p == '\n') || (*p == '\r')) {
+                return NULL;
+            }
+        }
     }
+    return NULL;
+}
 
-    for (auto &it : tokenRegexes) {
-        if (matchRegex(it)) {
-            return;
+void Tokeniser::skipWhitespace()
+{
+    while (m_iter != m_end) {
+        if (charClasses.is(*m_iter, CC_SPACE)) {
+            ++m_iter;
+        }
+        else if (*m_iter == ';') {
+            while ((m_iter != m_end) &&
+                   (*m_iter != '\n') && (*m_iter != '\r')) {
+                ++m_iter;
+            }
+        }
+        else {
+            break;
         }
     }
+}
 
-    String mismatch(m_iter, m_end);
-    if (mismatch[0] == '"') {
-        MAL_CHECK(false, "expected '\"', got EOF");
+static bool isInteger(const Token& token)
+{
+    const char* p = token.begin();
+    const char* end = token.end();
+    if ((p != end) && ((*p == '-') || (*p == '+'))) {
+        ++p;
     }
-    else {
-        MAL_CHECK(false, "unexpected '%s'", mismatch.c_str());
+    if (p == end) {
+        return false;
     }
+    for ( ; p != end; ++p) {
+        if (!charClasses.is(*p, CC_DIGIT)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void Tokeniser::skipWhitespace()
+static int64_t parseInteger(const Token& token)
 {
-    while (matchRegex(whitespaceRegex)) {
-        m_iter += m_token.size();
+    const char* p = token.begin();
+    bool negative = (*p == '-');
+    if ((*p == '-') || (*p == '+')) {
+        ++p;
+    }
+    //  Accumulate the magnitude unsigned, so that INT64_MIN can be read.
+    const uint64_t limit = negative ? uint64_t(INT64_MAX) + 1 : INT64_MAX;
+    uint64_t value = 0;
+    for ( ; p != token.end(); ++p) {
+        uint64_t digit = *p - '0';
+        MAL_CHECK(value <= (limit - digit) / 10, "integer out of range");
+        value = value * 10 + digit;
     }
+    return negative ? static_cast<int64_t>(0 - value)
+                    : static_cast<int64_t>(value);
 }
 
 static malValuePtr readAtom(Tokeniser& tokeniser);
 static malValuePtr readForm(Tokeniser& tokeniser);
 static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end);
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol);
+                      const char* end);
+static malValuePtr processMacro(Tokeniser& tokeniser, const char* symbol);
 
 malValuePtr readStr(const String& input)
 {
@@ -127,31 +233,44 @@ malValuePtr readStr(const String& input)
     return readForm(tokeniser);
 }
 
+void readForms(const String& input, malValueVec& forms)
+{
+    Tokeniser tokeniser(input);
+    while (!tokeniser.eof()) {
+        forms.push_back(readForm(tokeniser));
+    }
+}
+
 static malValuePtr readForm(Tokeniser& tokeniser)
 {
     MAL_CHECK(!tokeniser.eof(), "expected form, got EOF");
-    String token = tokeniser.peek();
-
-    MAL_CHECK(!std::regex_match(token, closeRegex),
-            "unexpected '%s'", token.c_str());
-
-    if (token == "(") {
-        tokeniser.next();
-        std::unique_ptr<malValueVec> items(new malValueVec);
-        readList(tokeniser, items.get(), ")");
-        return mal::list(items.release());
-    }
-    if (token == "[") {
-        tokeniser.next();
-        std::unique_ptr<malValueVec> items(new malValueVec);
-        readList(tokeniser, items.get(), "]");
-        return mal::vector(items.release());
-    }
-    if (token == "{") {
-        tokeniser.next();
-        malValueVec items;
-        readList(tokeniser, &items, "}");
-        return mal::hash(items.begin(), items.end(), false);
+    Token token = tokeniser.peek();
+
+    if (token.length() == 1) {
+        switch (token[0]) {
+            case ')': case ']': case '}':
+                MAL_FAIL("unexpected '%c'", token[0]);
+
+            case '(': {
+                tokeniser.next();
+                std::unique_ptr<malValueVec> items(new malValueVec);
+                readList(tokeniser, items.get(), ")");
+                return mal::list(items.release());
+            }
+            case '[': {
+                tokeniser.next();
+                std::unique_ptr<malValueVec> items(new malValueVec);
+                readList(tokeniser, items.get(), "]");
+                return mal::vector(items.release());
+            }
+            case '{': {
+                tokeniser.next();
+                malValueVec items;
+                readList(tokeniser, &items, "}");
+                return mal::hash(items.data(),
+                                 items.data() + items.size(), false);
+            }
+        }
     }
     return readAtom(tokeniser);
 }
@@ -162,7 +281,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         const char* token;
         const char* symbol;
     };
-    ReaderMacro macroTable[] = {
+    static const ReaderMacro macroTable[] = {
         { "@",   "deref" },
         { "`",   "quasiquote" },
         { "'",   "quote" },
@@ -170,50 +289,57 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         { "~",   "unquote" },
     };
 
-    struct Constant {
-        const char* token;
-        malValuePtr value;
-    };
-    Constant constantTable[] = {
-        { "false",  mal::falseValue()  },
-        { "nil",    mal::nilValue()          },
-        { "true",   mal::trueValue()   },
-    };
+    Token token = tokeniser.next();
+    switch (token[0]) {
+        case '"':
+            return mal::string(unescape(token.begin(), token.end()));
 
-    String token = tokeniser.next();
-    if (token[0] == '"') {
-        return mal::string(unescape(token));
-    }
-    if (token[0] == ':') {
-        return mal::keyword(token);
-    }
-    if (token == "^") {
-        malValuePtr meta = readForm(tokeniser);
-        malValuePtr value = readForm(tokeniser);
-        // Note that meta and value switch places
-        return mal::list(mal::symbol("with-meta"), value, meta);
-    }
-    for (auto &constant : constantTable) {
-        if (token == constant.token) {
-            return constant.value;
+        case ':':
+            return mal::keyword(token.str());
+
+        case '^': {
+            malValuePtr meta = readForm(tokeniser);
+            malValuePtr value = readForm(tokeniser);
+            // Note that meta and value switch places
+            return mal::list(mal::symbol("with-meta"), value, meta);
         }
+
+        case 'f':
+            if (token == "false") {
+                return mal::falseValue();
+            }
+            break;
+
+        case 'n':
+            if (token == "nil") {
+                return mal::nilValue();
+            }
+            break;
+
+        case 't':
+            if (token == "true") {
+                return mal::trueValue();
+            }
+            break;
     }
-    for (auto &macro : macroTable) {
-        if (token == macro.token) {
-            return processMacro(tokeniser, macro.symbol);
+    if (charClasses.is(token[0], CC_SPECIAL)) {
+        for (auto &macro : macroTable) {
+            if (token == macro.token) {
+                return processMacro(tokeniser, macro.symbol);
+            }
         }
     }
-    if (std::regex_match(token, intRegex)) {
-        return mal::integer(token);
+    if (isInteger(token)) {
+        return mal::integer(parseInteger(token));
     }
-    return mal::symbol(token);
+    return mal::symbol(token.str());
 }
 
 static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end)
+                      const char* end)
 {
     while (1) {
-        MAL_CHECK(!tokeniser.eof(), "expected '%s', got EOF", end.c_str());
+        MAL_CHECK(!tokeniser.eof(), "expected '%s', got EOF", end);
         if (tokeniser.peek() == end) {
             tokeniser.next();
             return;
@@ -222,7 +348,7 @@ static void readList(Tokeniser& tokeniser, malValueVec* items,
     }
 }
 
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol)
+static malValuePtr processMacro(Tokeniser& tokeniser, const char* symbol)
 {
     return mal::list(mal::symbol(symbol), readForm(tokeniser));
 }
@@ -1,27 +1,110 @@
 #ifndef INCLUDE_REFCOUNTEDPTR_H
 #define INCLUDE_REFCOUNTEDPTR_H
 
+#include "Allocator.h"
 #include "Debug.h"
 
 #include <cstddef>
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+    RefCounted() : m_refCount(0), m_color(0), m_isTraced(false) { }
     virtual ~RefCounted() { }
 
+    static void* operator new(size_t size) {
+        return allocate(size);
+    }
+
+    static void operator delete(void* block, size_t size) {
+        malAllocator::free(block, size);
+    }
+
+    //  Free this, once nothing refers to it. Only an object whose size isn't
+    //  that of its class need do more than delete itself.
+    virtual void destroy() const { delete this; }
+
+    //  Free this, now that its count has dropped to zero. The objects that
+    //  frees in turn are queued rather than freed from within its
+    //  destructor, so freeing a deeply nested structure can't overflow the
+    //  stack. Up to FREE_NOW objects are freed before this returns, and the
+    //  rest a few at a time as new objects are allocated.
+    void dispose() const;
+
+    //  Free up to limit of the objects waiting to be freed.
+    static void freePending(size_t limit);
+    static void freeAllPending() { freePending(size_t(-1)); }
+
     const RefCounted* acquire() const { m_refCount++; return this; }
     int release() const { return --m_refCount; }
     int refCount() const { return m_refCount; }
 
+    //  Whether this is freed by the tracing collector, when it's in use,
+    //  rather than when its count drops to zero.
+    bool isTraced() const { return MAL_TRACING_GC && m_isTraced; }
+
+    //  Shown each of the counted references an object holds, in turn.
+    class Visitor {
+    public:
+        void operator () (const RefCounted* object) {
+            if (object != NULL) {
+                visit(object);
+            }
+        }
+
+    protected:
+        virtual void visit(const RefCounted* object) = 0;
+    };
+
+    //  Show the visitor the references this holds, which is how the cycle
+    //  collector finds its way around the heap. A reference left out is
+    //  taken to come from outside the heap, so cycles through it are never
+    //  freed, but one shown must really be held and counted.
+    virtual void visitChildren(Visitor& visitor) const { }
+
+    //  Drop the references which could close a cycle, for the collector to
+    //  free one this is part of.
+    virtual void clearChildren() { }
+
+protected:
+    //  For values and environments, and the objects which make them up.
+    enum Traced { TRACED };
+    RefCounted(Traced) : m_refCount(0), m_color(0), m_isTraced(true) { }
+
+    //  Allocate a block for an object, freeing a few of those waiting to be
+    //  freed first.
+    static void* allocate(size_t size) {
+        if ((s_pendingCount != 0) && !s_isFreeing) {
+            freePending(FREE_PER_ALLOCATION);
+        }
+        return malAllocator::allocate(size);
+    }
+
+    //  Queue this to be freed later, as dispose() does with anything freed
+    //  from a destructor.
+    static void addPending(const RefCounted* object);
+
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
+    friend class malCollector;
+
+    enum {
+        FREE_NOW            = 10000,
+        FREE_PER_ALLOCATION = 4,
+    };
+
+    //  Both are plain data, so they're set before any object is made.
+    static size_t s_pendingCount;
+    static bool   s_isFreeing;
+
     mutable int m_refCount;
+    mutable unsigned char m_color;  // used only while collecting
+    const bool m_isTraced;
 };
 
-template<class T>
+//  Pointers which aren't Counted leave the count alone, see RefCountedRef.
+template<class T, bool Counted = true>
 class RefCountedPtr {
 public:
     RefCountedPtr() : m_object(0) { }
@@ -32,11 +115,21 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    template<bool C>
+    RefCountedPtr(const RefCountedPtr<T, C>& rhs) : m_object(0)
+    { acquire(rhs.ptr()); }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    template<bool C>
+    const RefCountedPtr& operator = (const RefCountedPtr<T, C>& rhs) {
+        acquire(rhs.ptr());
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -58,7 +151,7 @@ public:
 
 private:
     void acquire(T* object) {
-        if (object != NULL) {
+        if (Counted && (object != NULL)) {
             object->acquire();
         }
         release();
@@ -66,12 +159,19 @@ private:
     }
 
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+        if (Counted && (m_object != NULL) && (m_object->release() == 0) &&
+                !m_object->isTraced()) {
+            m_object->dispose();
         }
     }
 
     T* m_object;
 };
 
+//  A pointer held by one value or environment to a part of another, such
+//  as its frame or its items. The tracing collector follows these with
+//  visitChildren, so they needn't be counted.
+template<class T>
+using RefCountedRef = RefCountedPtr<T, !MAL_TRACING_GC>;
+
 #endif // INCLUDE_REFCOUNTEDPTR_H
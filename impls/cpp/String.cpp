@@ -65,16 +65,21 @@ static char unescape(char c)
 }
 
 String unescape(const String& in)
+{
+    return unescape(in.data(), in.data() + in.size());
+}
+
+String unescape(const char* begin, const char* end)
 {
     String out;
-    out.reserve(in.size()); // unescaped string will always be shorter
+    out.reserve(end - begin); // unescaped string will always be shorter
 
     // in will have double-quotes at either end, so move the iterators in
-    for (auto it = in.begin()+1, end = in.end()-1; it != end; ++it) {
+    for (auto it = begin+1, last = end-1; it != last; ++it) {
         char c = *it;
         if (c == '\\') {
             ++it;
-            if (it != end) {
+            if (it != last) {
                 out += unescape(*it);
             }
         }
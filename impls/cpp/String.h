@@ -14,5 +14,6 @@ extern String stringPrintf(const char* fmt, ...);
 extern String copyAndFree(char* mallocedString);
 extern String escape(const String& s);
 extern String unescape(const String& s);
+extern String unescape(const char* begin, const char* end);
 
 #endif // INCLUDE_STRING_H
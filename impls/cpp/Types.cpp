@@ -4,7 +4,32 @@
 
 #include <algorithm>
 #include <memory>
-#include <typeinfo>
+#include <unordered_map>
+
+//  Return the single instance of a symbol or keyword with this name.
+//  These are never freed, which lets them be compared, hashed and used as
+//  environment keys by address.
+template<class T>
+static malValuePtr intern(const String& name)
+{
+    typedef std::unordered_map<String, malValuePtr> Table;
+    static Table table;
+
+    auto it = table.find(name);
+    if (it == table.end()) {
+        it = table.insert(std::make_pair(name, new T(name))).first;
+    }
+    return malValuePtr::immortal(it->second.ptr());
+}
+
+//  Create one of the nil, true and false singletons. These hold a reference
+//  to themselves, so they can be passed around without being counted.
+static malValuePtr constant(const String& name)
+{
+    malConstant* c = new malConstant(name);
+    c->acquire();
+    return malValuePtr::immortal(c);
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
@@ -20,30 +45,23 @@ namespace mal {
     };
 
     malValuePtr falseValue() {
-        static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
+        static malValuePtr c(constant("false"));
+        return c;
     };
 
 
-    malValuePtr hash(const malHash::Map& map) {
-        return malValuePtr(new malHash(map));
-    }
-
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated) {
         return malValuePtr(new malHash(argsBegin, argsEnd, isEvaluated));
     }
 
     malValuePtr integer(int64_t value) {
-        return malValuePtr(new malInteger(value));
-    };
-
-    malValuePtr integer(const String& token) {
-        return integer(std::stoi(token));
+        malValuePtr immediate = malValuePtr::immediate(value);
+        return immediate ? immediate : malValuePtr(new malInteger(value));
     };
 
     malValuePtr keyword(const String& token) {
-        return malValuePtr(new malKeyword(token));
+        return intern<malKeyword>(token);
     };
 
     malValuePtr lambda(const StringVec& bindings,
@@ -51,33 +69,38 @@ namespace mal {
         return malValuePtr(new malLambda(bindings, body, env));
     }
 
+    malValuePtr lambda(const malSymbolVec& bindings,
+                       malValuePtr body, malEnvPtr env) {
+        return malValuePtr(new malLambda(bindings, body, env));
+    }
+
+    malValuePtr lambda(const malFrameLayoutPtr& params,
+                       malValuePtr body, malEnvPtr env,
+                       const malCodePtr& code) {
+        return malValuePtr(new malLambda(params, body, env, code));
+    }
+
     malValuePtr list(malValueVec* items) {
-        return malValuePtr(new malList(items));
+        return malValuePtr(malSequenceStore::createList(items));
     };
 
     malValuePtr list(malValueIter begin, malValueIter end) {
-        return malValuePtr(new malList(begin, end));
+        return malValuePtr(malSequenceStore::createList(begin, end));
     };
 
     malValuePtr list(malValuePtr a) {
-        malValueVec* items = new malValueVec(1);
-        items->at(0) = a;
-        return malValuePtr(new malList(items));
+        malValueRef items[] = { a };
+        return list(items, items + 1);
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b) {
-        malValueVec* items = new malValueVec(2);
-        items->at(0) = a;
-        items->at(1) = b;
-        return malValuePtr(new malList(items));
+        malValueRef items[] = { a, b };
+        return list(items, items + 2);
     }
 
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c) {
-        malValueVec* items = new malValueVec(3);
-        items->at(0) = a;
-        items->at(1) = b;
-        items->at(2) = c;
-        return malValuePtr(new malList(items));
+        malValueRef items[] = { a, b, c };
+        return list(items, items + 3);
     }
 
     malValuePtr macro(const malLambda& lambda) {
@@ -85,8 +108,8 @@ namespace mal {
     };
 
     malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
+        static malValuePtr c(constant("nil"));
+        return c;
     };
 
     malValuePtr string(const String& token) {
@@ -94,12 +117,12 @@ namespace mal {
     }
 
     malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
+        return intern<malSymbol>(token);
     };
 
     malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
+        static malValuePtr c(constant("true"));
+        return c;
     };
 
     malValuePtr vector(malValueVec* items) {
@@ -117,48 +140,368 @@ malValuePtr malBuiltIn::apply(malValueIter argsBegin,
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+enum {
+    HASH_BITS  = 5,
+    HASH_MASK  = (1 << HASH_BITS) - 1,
+    HASH_DEPTH = sizeof(size_t) * 8,    // shift at which the bits run out
+};
+
+class malHashNode : public RefCounted {
+public:
+    malHashNode() : RefCounted(TRACED) { }
+
+    //  Return the value for key, or NULL if it isn't in this node.
+    virtual malValuePtr find(int shift, size_t hash,
+                             const malValuePtr& key) const = 0;
+
+    //  Return a copy of this node with key set to value. added is set if
+    //  the key wasn't already there.
+    virtual malHashNodePtr assoc(int shift, size_t hash,
+                                 const malValuePtr& key,
+                                 const malValuePtr& value,
+                                 bool& added) const = 0;
+
+    //  Return a copy of this node without key, this node if it doesn't
+    //  contain key, or NULL if nothing is left.
+    virtual malHashNodePtr dissoc(int shift, size_t hash,
+                                  const malValuePtr& key) const = 0;
+
+    virtual void entries(malValueVec& items) const = 0;
+};
+
+//  A list of entries searched in order. This is the root of a small map,
+//  and holds keys whose hashes are identical at the bottom of the trie.
+class malHashArrayNode : public malHashNode {
+public:
+    malHashArrayNode() { }
+    template <class Items>
+    malHashArrayNode(const Items& items)
+    : m_items(items.begin(), items.end()) { }
+
+    virtual malValuePtr find(int shift, size_t hash,
+                             const malValuePtr& key) const;
+    virtual malHashNodePtr assoc(int shift, size_t hash,
+                                 const malValuePtr& key,
+                                 const malValuePtr& value,
+                                 bool& added) const;
+    virtual malHashNodePtr dissoc(int shift, size_t hash,
+                                  const malValuePtr& key) const;
+
+    virtual void entries(malValueVec& items) const {
+        items.insert(items.end(), m_items.begin(), m_items.end());
+    }
+
+    virtual void visitChildren(Visitor& visit) const {
+        for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+            visit(it->counted());
+        }
+    }
+
+private:
+    int indexOf(const malValuePtr& key) const;
+
+    std::vector<malValueRef> m_items;   // alternating keys and values
+};
+
+//  A trie node, which holds an entry or a child for each 5 bit slice of the
+//  hash present in the bitmap.
+class malHashBranch : public malHashNode {
+public:
+    malHashBranch() : m_bitmap(0) { }
+    malHashBranch(const malHashBranch* that)
+        : m_bitmap(that->m_bitmap), m_slots(that->m_slots) { }
+
+    virtual malValuePtr find(int shift, size_t hash,
+                             const malValuePtr& key) const;
+    virtual malHashNodePtr assoc(int shift, size_t hash,
+                                 const malValuePtr& key,
+                                 const malValuePtr& value,
+                                 bool& added) const;
+    virtual malHashNodePtr dissoc(int shift, size_t hash,
+                                  const malValuePtr& key) const;
+    virtual void entries(malValueVec& items) const;
+
+    virtual void visitChildren(Visitor& visit) const;
+
+private:
+    struct Slot {
+        malValueRef    key;
+        malValueRef    value;
+        malHashNodeRef child;   // if set, key and value are unused
+    };
+
+    static uint32_t bitFor(int shift, size_t hash) {
+        return uint32_t(1) << ((hash >> shift) & HASH_MASK);
+    }
+
+    int indexOf(uint32_t bit) const {
+        return __builtin_popcount(m_bitmap & (bit - 1));
+    }
+
+    static malHashNodePtr split(int shift,
+                                const malValuePtr& key1,
+                                const malValuePtr& value1,
+                                size_t hash2,
+                                const malValuePtr& key2,
+                                const malValuePtr& value2);
+
+    uint32_t          m_bitmap;
+    std::vector<Slot> m_slots;
+};
+
+int malHashArrayNode::indexOf(const malValuePtr& key) const
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
+    for (int i = 0, count = m_items.size(); i < count; i += 2) {
+        if (m_items[i].isEqualTo(key)) {
+            return i;
+        }
     }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
+    return -1;
+}
+
+malValuePtr malHashArrayNode::find(int shift, size_t hash,
+                                   const malValuePtr& key) const
+{
+    int index = indexOf(key);
+    return (index < 0) ? malValuePtr() : malValuePtr(m_items[index + 1]);
+}
+
+malHashNodePtr malHashArrayNode::assoc(int shift, size_t hash,
+                                       const malValuePtr& key,
+                                       const malValuePtr& value,
+                                       bool& added) const
+{
+    int index = indexOf(key);
+    if (index >= 0) {
+        malHashArrayNode* node = new malHashArrayNode(m_items);
+        node->m_items[index + 1] = value;
+        return node;
+    }
+
+    added = true;
+    if ((shift < HASH_DEPTH) && (m_items.size() / 2 >= malHash::FLAT_MAX)) {
+        // This small map has outgrown its array, so move it into a trie.
+        malHashNodePtr root = new malHashBranch;
+        bool ignored;
+        for (auto it = m_items.begin(); it != m_items.end(); it += 2) {
+            root = root->assoc(shift, it[0].hash(), it[0], it[1], ignored);
+        }
+        return root->assoc(shift, hash, key, value, ignored);
     }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+
+    malHashArrayNode* node = new malHashArrayNode;
+    node->m_items.reserve(m_items.size() + 2);
+    node->m_items = m_items;
+    node->m_items.push_back(key);
+    node->m_items.push_back(value);
+    return node;
 }
 
-static malHash::Map addToMap(malHash::Map& map,
-    malValueIter argsBegin, malValueIter argsEnd)
+malHashNodePtr malHashArrayNode::dissoc(int shift, size_t hash,
+                                        const malValuePtr& key) const
 {
-    // This is intended to be called with pre-evaluated arguments.
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+    int index = indexOf(key);
+    if (index < 0) {
+        return const_cast<malHashArrayNode*>(this);
     }
+    if (m_items.size() == 2) {
+        return NULL;
+    }
+    malHashArrayNode* node = new malHashArrayNode(m_items);
+    node->m_items.erase(node->m_items.begin() + index,
+                        node->m_items.begin() + index + 2);
+    return node;
+}
 
-    return map;
+malValuePtr malHashBranch::find(int shift, size_t hash,
+                                const malValuePtr& key) const
+{
+    const malHashBranch* node = this;
+    while (1) {
+        uint32_t bit = bitFor(shift, hash);
+        if ((node->m_bitmap & bit) == 0) {
+            return malValuePtr();
+        }
+        const Slot& slot = node->m_slots[node->indexOf(bit)];
+        if (!slot.child) {
+            return slot.key.isEqualTo(key) ? malValuePtr(slot.value)
+                                           : malValuePtr();
+        }
+        shift += HASH_BITS;
+        if (shift >= HASH_DEPTH) {
+            return slot.child->find(shift, hash, key);
+        }
+        node = static_cast<const malHashBranch*>(slot.child.ptr());
+    }
 }
 
-static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
+malHashNodePtr malHashBranch::assoc(int shift, size_t hash,
+                                    const malValuePtr& key,
+                                    const malValuePtr& value,
+                                    bool& added) const
 {
-    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
-            "hash-map requires an even-sized list");
+    uint32_t bit = bitFor(shift, hash);
+    int index = indexOf(bit);
+
+    malHashBranch* node = new malHashBranch(this);
+    malHashNodePtr ret(node);
+    if ((m_bitmap & bit) == 0) {
+        Slot slot;
+        slot.key = key;
+        slot.value = value;
+        node->m_bitmap |= bit;
+        node->m_slots.insert(node->m_slots.begin() + index, slot);
+        added = true;
+        return ret;
+    }
+
+    Slot& slot = node->m_slots[index];
+    if (slot.child) {
+        slot.child = slot.child->assoc(shift + HASH_BITS, hash,
+                                       key, value, added);
+    }
+    else if (slot.key.isEqualTo(key)) {
+        slot.value = value;
+    }
+    else {
+        slot.child = split(shift + HASH_BITS, slot.key, slot.value,
+                           hash, key, value);
+        slot.key = slot.value = malValuePtr();
+        added = true;
+    }
+    return ret;
+}
+
+//  Return a node holding two entries which share a slot at the level above.
+malHashNodePtr malHashBranch::split(int shift,
+                                    const malValuePtr& key1,
+                                    const malValuePtr& value1,
+                                    size_t hash2,
+                                    const malValuePtr& key2,
+                                    const malValuePtr& value2)
+{
+    malHashNodePtr node;
+    if (shift >= HASH_DEPTH) {
+        node = new malHashArrayNode;
+    }
+    else {
+        node = new malHashBranch;
+    }
+    bool ignored;
+    node = node->assoc(shift, key1.hash(), key1, value1, ignored);
+    return node->assoc(shift, hash2, key2, value2, ignored);
+}
+
+malHashNodePtr malHashBranch::dissoc(int shift, size_t hash,
+                                     const malValuePtr& key) const
+{
+    malHashBranch* self = const_cast<malHashBranch*>(this);
+    uint32_t bit = bitFor(shift, hash);
+    if ((m_bitmap & bit) == 0) {
+        return self;
+    }
+
+    int index = indexOf(bit);
+    const Slot& slot = m_slots[index];
+    malHashNodePtr child;
+    if (slot.child) {
+        child = slot.child->dissoc(shift + HASH_BITS, hash, key);
+        if (child == slot.child) {
+            return self;
+        }
+    }
+    else if (!slot.key.isEqualTo(key)) {
+        return self;
+    }
 
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+    if (!child && (m_slots.size() == 1)) {
+        return NULL;
+    }
+    malHashBranch* node = new malHashBranch(this);
+    if (child) {
+        node->m_slots[index].child = child;
+    }
+    else {
+        node->m_bitmap &= ~bit;
+        node->m_slots.erase(node->m_slots.begin() + index);
+    }
+    return node;
+}
+
+void malHashBranch::entries(malValueVec& items) const
+{
+    for (auto it = m_slots.begin(), end = m_slots.end(); it != end; ++it) {
+        if (it->child) {
+            it->child->entries(items);
+        }
+        else {
+            items.push_back(it->key);
+            items.push_back(it->value);
+        }
+    }
+}
+
+void malHashBranch::visitChildren(Visitor& visit) const
+{
+    for (auto it = m_slots.begin(), end = m_slots.end(); it != end; ++it) {
+        visit(it->key.counted());
+        visit(it->value.counted());
+        visit(it->child.ptr());
+    }
+}
+
+//  Set key to value in the map rooted at root.
+static void assocEntry(malHashNodePtr& root, int& count,
+                       const malValuePtr& key, const malValuePtr& value)
+{
+    size_t hash = key.hash();
+    if (!root) {
+        root = new malHashArrayNode;
+    }
+    bool added = false;
+    root = root->assoc(0, hash, key, value, added);
+    if (added) {
+        count++;
+    }
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
+: malValue(TYPE_HASH)
+, m_count(0)
 , m_isEvaluated(isEvaluated)
+, m_hash(0)
 {
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "hash-map requires an even-sized list");
 
+    malHashNodePtr root;
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        assocEntry(root, m_count, it[0], it[1]);
+    }
+    m_root = root;
 }
 
-malHash::malHash(const malHash::Map& map)
-: m_map(map)
+malHash::malHash(malHashNodePtr root, int count)
+: malValue(TYPE_HASH)
+, m_root(root)
+, m_count(count)
 , m_isEvaluated(true)
+, m_hash(0)
+{
+
+}
+
+malHash::malHash(const malHash& that, malValuePtr meta)
+: malValue(TYPE_HASH, meta)
+, m_root(that.m_root)
+, m_count(that.m_count)
+, m_isEvaluated(that.m_isEvaluated)
+, m_hash(that.m_hash)
+{
+
+}
+
+malHash::~malHash()
 {
 
 }
@@ -169,25 +512,73 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    malHashNodePtr root = m_root;
+    int count = m_count;
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        assocEntry(root, count, it[0], it[1]);
+    }
+    return malValuePtr(new malHash(root, count));
+}
+
+malValuePtr malHash::find(const malValuePtr& key) const
+{
+    size_t hash = key.hash();
+    return m_root ? m_root->find(0, hash, key) : malValuePtr();
 }
 
 bool malHash::contains(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return find(key);
 }
 
 malValuePtr
 malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    malHash::Map map(m_map);
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+    malHashNodePtr root = m_root;
+    int count = m_count;
+    for (auto it = argsBegin; it != argsEnd && root; ++it) {
+        malHashNodePtr newRoot = root->dissoc(0, it->hash(), *it);
+        if (newRoot != root) {
+            root = newRoot;
+            count--;
+        }
+    }
+
+    if (root && (m_count > FLAT_MAX) && (count <= FLAT_MAX)) {
+        malValueVec items;
+        root->entries(items);
+        root = new malHashArrayNode(items);
+    }
+    return malValuePtr(new malHash(root, count));
+}
+
+//  The hash of a map mustn't depend on the order of its entries.
+size_t malHash::hash() const
+{
+    if (m_hash == 0) {
+        malValueVec items;
+        entries(items);
+        size_t hash = TYPE_HASH;
+        for (auto it = items.begin(); it != items.end(); it += 2) {
+            hash += combineHash(it[0].hash(), it[1].hash());
+        }
+        m_hash = hash;
+    }
+    return m_hash;
+}
+
+void malHash::visitChildren(Visitor& visit) const
+{
+    malValue::visitChildren(visit);
+    visit(m_root.ptr());
+}
+
+void malHash::entries(malValueVec& items) const
+{
+    if (m_root) {
+        items.reserve(items.size() + 2 * m_count);
+        m_root->entries(items);
     }
-    return mal::hash(map);
 }
 
 malValuePtr malHash::eval(malEnvPtr env)
@@ -196,83 +587,91 @@ malValuePtr malHash::eval(malEnvPtr env)
         return malValuePtr(this);
     }
 
-    malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
+    malValueVec items;
+    entries(items);
+    for (auto it = items.begin(); it != items.end(); it += 2) {
+        it[1] = EVAL(it[1], env);
     }
-    return mal::hash(map);
+    return mal::hash(items.data(), items.data() + items.size(), true);
 }
 
 malValuePtr malHash::get(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    malValuePtr value = find(key);
+    return value ? value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
 {
+    malValueVec items;
+    entries(items);
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
+    keys->reserve(m_count);
+    for (auto it = items.begin(); it != items.end(); it += 2) {
+        keys->push_back(it[0]);
     }
     return mal::list(keys);
 }
 
 malValuePtr malHash::values() const
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
+    malValueVec items;
+    entries(items);
+    malValueVec* values = new malValueVec();
+    values->reserve(m_count);
+    for (auto it = items.begin(); it != items.end(); it += 2) {
+        values->push_back(it[1]);
     }
-    return mal::list(keys);
+    return mal::list(values);
 }
 
 String malHash::print(bool readably) const
 {
-    String s = "{";
+    malValueVec items;
+    entries(items);
 
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+    String s = "{";
+    for (auto it = items.begin(); it != items.end(); ++it) {
+        if (it != items.begin()) {
+            s += " ";
+        }
+        s += (*it)->print(readably);
     }
-
     return s + "}";
 }
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
+    const malHash* rhsHash = static_cast<const malHash*>(rhs);
+    if (m_count != rhsHash->m_count) {
         return false;
     }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
-
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
+    malValueVec items;
+    entries(items);
+    for (auto it = items.begin(); it != items.end(); it += 2) {
+        malValuePtr value = rhsHash->find(it[0]);
+        if (!value || !value.isEqualTo(it[1])) {
             return false;
         }
     }
     return true;
 }
 
+static malSymbolVec internBindings(const StringVec& bindings)
+{
+    malSymbolVec symbols;
+    symbols.reserve(bindings.size());
+    for (auto it = bindings.begin(), end = bindings.end(); it != end; ++it) {
+        symbols.push_back(STATIC_CAST(malSymbol, mal::symbol(*it)));
+    }
+    return symbols;
+}
+
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
+: malApplicable(TYPE_LAMBDA)
+, m_params(new malFrameLayout(internBindings(bindings)))
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
@@ -280,29 +679,63 @@ malLambda::malLambda(const StringVec& bindings,
 
 }
 
+malLambda::malLambda(const malSymbolVec& bindings,
+                     malValuePtr body, malEnvPtr env)
+: malApplicable(TYPE_LAMBDA)
+, m_params(new malFrameLayout(bindings))
+, m_body(body)
+, m_env(env)
+, m_isMacro(false)
+{
+
+}
+
+malLambda::malLambda(const malFrameLayoutPtr& params,
+                     malValuePtr body, malEnvPtr env,
+                     const malCodePtr& code)
+: malApplicable(TYPE_LAMBDA)
+, m_params(params)
+, m_body(body)
+, m_env(env)
+, m_code(code)
+, m_isMacro(false)
+{
+
+}
+
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
-, m_bindings(that.m_bindings)
+: malApplicable(TYPE_LAMBDA, meta)
+, m_params(that.m_params)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_code(that.m_code)
 , m_isMacro(that.m_isMacro)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
-, m_bindings(that.m_bindings)
+: malApplicable(TYPE_LAMBDA, that.meta())
+, m_params(that.m_params)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_code(that.m_code)
 , m_isMacro(isMacro)
 {
 
 }
 
+malLambda::~malLambda()
+{
+
+}
+
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
+    if (m_code) {
+        return m_code->run(makeEnv(argsBegin, argsEnd));
+    }
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
 
@@ -311,22 +744,29 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
     return new malLambda(*this, meta);
 }
 
+//  The compiled code is left out, so cycles through it are never freed.
+void malLambda::visitChildren(Visitor& visit) const
+{
+    malValue::visitChildren(visit);
+    visit(m_body.counted());
+    visit(m_env.ptr());
+}
+
+//  Every engine's calls come through here, which makes it the place to see
+//  whether the cycle collector is due, with everything in use held.
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
+    malCollector::collectIfDue();
+    return malEnvPtr(new malEnv(m_env, m_params, argsBegin, argsEnd));
 }
 
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
-
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
-
-    return mal::list(items);
+    // The items are added to the front one at a time, so end up reversed.
+    malValueVec items(argsBegin, argsEnd);
+    std::reverse(items.begin(), items.end());
+    return prepend(items.data(), items.data() + items.size());
 }
 
 malValuePtr malList::eval(malEnvPtr env)
@@ -338,9 +778,9 @@ malValuePtr malList::eval(malEnvPtr env)
     }
 
     std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
+    malValueIter it = items->data();
     malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    return APPLY(op, it + 1, it + items->size());
 }
 
 String malList::print(bool readably) const
@@ -348,6 +788,65 @@ String malList::print(bool readably) const
     return '(' + malSequence::print(readably) + ')';
 }
 
+malConsList::malConsList(malValuePtr first, malValuePtr rest)
+: m_first(first)
+, m_rest(rest)
+, m_count(1 + STATIC_CAST(malSequence, rest)->count())
+{
+
+}
+
+//  Walk the cells to the one holding the item, or to the list they lead to,
+//  unless there are so many that it's quicker to lay this out.
+malValuePtr malConsList::item(int index) const
+{
+    const malSequence* seq = this;
+    for (int i = 0; i <= MAX_WALKED_CELLS; i++) {
+        if (seq->m_store) {
+            return seq->item(index - i);
+        }
+        const malConsList* cell = static_cast<const malConsList*>(seq);
+        if (i == index) {
+            return cell->m_first;
+        }
+        seq = STATIC_CAST(malSequence, cell->m_rest);
+    }
+    flatten();
+    return m_begin[index];
+}
+
+malValuePtr malConsList::rest() const
+{
+    return m_store ? malSequence::rest() : malValuePtr(m_rest);
+}
+
+void malConsList::takeItems(malValueVec& out) const
+{
+    out.reserve(m_count);
+    const malSequence* seq = this;
+    while (!seq->m_store) {
+        const malConsList* cell = static_cast<const malConsList*>(seq);
+        out.push_back(cell->m_first);
+        seq = STATIC_CAST(malSequence, cell->m_rest);
+    }
+    out.insert(out.end(), seq->begin(), seq->end());
+    m_first = malValuePtr();
+    m_rest = malValuePtr();
+}
+
+void malConsList::visitChildren(Visitor& visit) const
+{
+    malList::visitChildren(visit);
+    visit(m_first.counted());
+    visit(m_rest.counted());
+}
+
+malValuePtr malConsList::doWithMeta(malValuePtr meta) const
+{
+    flatten();
+    return new malList(*this, meta);
+}
+
 malValuePtr malValue::eval(malEnvPtr env)
 {
     // Default case of eval is just to return the object itself.
@@ -357,9 +856,8 @@ malValuePtr malValue::eval(malEnvPtr env)
 bool malValue::isEqualTo(const malValue* rhs) const
 {
     // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    bool matchingTypes = (type() == rhs->type()) ||
+        (malSequence::isTypeOf(type()) && malSequence::isTypeOf(rhs->type()));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
@@ -370,9 +868,41 @@ bool malValue::isTrue() const
         && (this != mal::nilValue().ptr());
 }
 
+//  The metadata of every value which has any. This is never freed, as values
+//  may still be freed as the program exits.
+static std::unordered_map<const malValue*, malValueRef>& metaTable()
+{
+    static auto table = new std::unordered_map<const malValue*, malValueRef>;
+    return *table;
+}
+
+//  A nil meta is left out, as it's the same as none.
+malValue::malValue(malType type, malValuePtr meta)
+: RefCounted(TRACED)
+, m_type(type)
+, m_hasMeta(false)
+{
+    TRACE_OBJECT("Creating malValue %p\n", this);
+    if (meta && (meta != mal::nilValue())) {
+        metaTable()[this] = meta;
+        m_hasMeta = true;
+    }
+}
+
+void malValue::eraseMeta()
+{
+    metaTable().erase(this);
+}
+
+void malValue::visitMeta(Visitor& visit) const
+{
+    visit(metaTable().find(this)->second.counted());
+}
+
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    return m_hasMeta ? malValuePtr(metaTable().find(this)->second)
+                     : mal::nilValue();
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
@@ -380,28 +910,218 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
     return doWithMeta(meta);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+malSequenceStore* malSequenceStore::create(malValueVec* items)
 {
+    int count = items->size();
+    void* block = allocate(sizeFor(count));
+    malSequenceStore* store = ::new (block) malSequenceStore(0, count);
+    std::move(items->begin(), items->end(), store->m_front);
+    delete items;
+    return store;
+}
 
+malSequenceStore* malSequenceStore::create(int spare,
+                                           malValueIter begin,
+                                           malValueIter end)
+{
+    int count = end - begin;
+    void* block = allocate(sizeFor(spare + count));
+    malSequenceStore* store = ::new (block) malSequenceStore(spare, count);
+    std::copy(begin, end, store->m_front);
+    return store;
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+//  The tracing collector finds each object by the block it starts, so there
+//  a list and its store are always made in blocks of their own.
+malList* malSequenceStore::createList(malValueVec* items)
+{
+    if (MAL_TRACING_GC) {
+        return new malList(items);
+    }
+    int count = items->size();
+    malSequenceStore* store = ::new (allocateList(count))
+        malSequenceStore(0, count, true);
+    std::move(items->begin(), items->end(), store->m_front);
+    delete items;
+    return ::new (reinterpret_cast<malList*>(store) - 1)
+        malList(store, store->begin(), store->end());
+}
+
+malList* malSequenceStore::createList(malValueIter begin, malValueIter end)
+{
+    if (MAL_TRACING_GC) {
+        return new malList(begin, end);
+    }
+    int count = end - begin;
+    malSequenceStore* store = ::new (allocateList(count))
+        malSequenceStore(0, count, true);
+    std::copy(begin, end, store->m_front);
+    return ::new (reinterpret_cast<malList*>(store) - 1)
+        malList(store, store->begin(), store->end());
+}
+
+//  Allocate the block for a list and its store of count items, and return
+//  where the store goes in it.
+void* malSequenceStore::allocateList(int count)
+{
+    malList* list = static_cast<malList*>(
+        allocate(sizeof(malList) + sizeFor(count)));
+    return list + 1;
+}
+
+bool malSequenceStore::isInBlockOf(const malSequence* seq) const
+{
+    return m_isInList &&
+           (static_cast<const malSequence*>(
+                reinterpret_cast<const malList*>(this) - 1) == seq);
+}
+
+//  Every slot starts out empty, for create() to fill.
+malSequenceStore::malSequenceStore(int spare, int count, bool isInList)
+: RefCounted(TRACED)
+, m_slotCount(spare + count)
+, m_isRoot(false)
+, m_isInList(isInList)
+, m_front(slots() + spare)
+, m_end(m_front + count)
+{
+    std::uninitialized_fill_n(slots(), m_slotCount, malValueRef());
+}
+
+malSequenceStore::~malSequenceStore()
+{
+    malValueRef* slots = this->slots();
+    for (int i = 0; i < m_slotCount; i++) {
+        slots[i].~malValueRef();
+    }
+}
+
+void malSequenceStore::destroy() const
+{
+    // Drop a long store's items a chunk at a time, from the end, with the
+    // store queued to be freed again behind them, so that freeing a long
+    // list is spread out just as freeing a deep one is. No view is left to
+    // see them go.
+    malSequenceStore* self = const_cast<malSequenceStore*>(this);
+    if (!MAL_TRACING_GC && (m_end - slots() > FREE_CHUNK)) {
+        addPending(this);
+        for (int i = 0; i < FREE_CHUNK; i++) {
+            *--self->m_end = malValueRef();
+        }
+        return;
+    }
+
+    if (m_isRoot) {
+        malCollector::removeRoot(this);
+    }
+    void* block = self;
+    size_t size = sizeFor(m_slotCount);
+    if (m_isInList) {
+        // The list was destroyed before this, as it held this.
+        block = reinterpret_cast<malList*>(self) - 1;
+        size += sizeof(malList);
+    }
+    self->~malSequenceStore();
+    malAllocator::free(block, size);
+}
+
+//  Claim count spare slots in front of begin, which must be the first item
+//  of a view of this store. Fails if another view has already claimed them.
+//  What goes in them can be newer than the store, and so could refer back
+//  to it, which makes the store a root for the cycle collector.
+bool malSequenceStore::canClaim(malValueIter begin, int count) const
+{
+    return (begin == m_front) && (m_front - slots() >= count);
+}
+
+bool malSequenceStore::claim(malValueIter begin, int count)
+{
+    if (!canClaim(begin, count)) {
+        return false;
+    }
+    m_front -= count;
+    if (!m_isRoot) {
+        m_isRoot = true;
+        malCollector::addRoot(this);
+    }
+    return true;
+}
+
+void malSequenceStore::visitChildren(Visitor& visit) const
+{
+    for (malValueIter it = m_front; it != m_end; ++it) {
+        visit(it->counted());
+    }
+}
+
+void malSequenceStore::clearChildren()
+{
+    std::fill(m_front, m_end, malValuePtr());
+}
+
+malSequence::malSequence(malType type, malValueVec* items)
+: malValue(type)
+, m_store(malSequenceStore::create(items))
+, m_begin(m_store->begin())
+, m_end(m_store->end())
+, m_hash(0)
+{
+
+}
+
+malSequence::malSequence(malType type, malValueIter begin, malValueIter end)
+: malValue(type)
+, m_store(malSequenceStore::create(0, begin, end))
+, m_begin(m_store->begin())
+, m_end(m_store->end())
+, m_hash(0)
+{
+
+}
+
+malSequence::malSequence(malType type, malSequenceStorePtr store,
+                         malValueIter begin, malValueIter end)
+: malValue(type)
+, m_store(store)
+, m_begin(begin)
+, m_end(end)
+, m_hash(0)
 {
 
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+: malValue(that.type(), meta)
+, m_store(that.m_store)
+, m_begin(that.m_begin)
+, m_end(that.m_end)
+, m_hash(that.m_hash)
+{
+
+}
+
+malSequence::malSequence(malType type, malValuePtr meta)
+: malValue(type, meta)
+, m_hash(0)
 {
 
 }
 
 malSequence::~malSequence()
 {
-    delete m_items;
+
+}
+
+//  A list made in one block with its store leaves the block for the store
+//  to free, and holds on to the store until it's gone.
+void malSequence::destroy() const
+{
+    if (!m_store || !m_store->isInBlockOf(this)) {
+        delete this;
+        return;
+    }
+    malSequenceStorePtr store = m_store;
+    this->~malSequence();
 }
 
 bool malSequence::doIsEqualTo(const malValue* rhs) const
@@ -411,9 +1131,9 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
+    for (malValueIter it0 = begin(),
                       it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+                      end = this->end(); it0 != end; ++it0, ++it1) {
 
         if (! (*it0)->isEqualTo((*it1).ptr())) {
             return false;
@@ -422,11 +1142,34 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
+size_t malSequence::hash() const
+{
+    if (m_hash == 0) {
+        // Walk by index, so hashing a vector doesn't flatten it, but lay out
+        // a consed list, as finding each of its items can walk its cells.
+        if (type() == TYPE_LIST) {
+            flatten();
+        }
+        size_t hash = TYPE_LIST;
+        for (int i = 0, count = this->count(); i < count; i++) {
+            hash = combineHash(hash, item(i).hash());
+        }
+        m_hash = hash;
+    }
+    return m_hash;
+}
+
+malValueStack& valueStack()
+{
+    static malValueStack stack;
+    return stack;
+}
+
 malValueVec* malSequence::evalItems(malEnvPtr env) const
 {
     malValueVec* items = new malValueVec;;
     items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+    for (auto it = begin(), end = this->end(); it != end; ++it) {
         items->push_back(EVAL(*it, env));
     }
     return items;
@@ -440,8 +1183,8 @@ malValuePtr malSequence::first() const
 String malSequence::print(bool readably) const
 {
     String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
+    auto end = this->end();
+    auto it = begin();
     if (it != end) {
         str += (*it)->print(readably);
         ++it;
@@ -456,7 +1199,90 @@ String malSequence::print(bool readably) const
 malValuePtr malSequence::rest() const
 {
     malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+    return malValuePtr(new malList(m_store, start, end()));
+}
+
+void malSequence::flattenItems() const
+{
+    malValueVec* items = new malValueVec;
+    if (type() == TYPE_VECTOR) {
+        static_cast<const malVector*>(this)->copyItems(*items);
+    }
+    else {
+        static_cast<const malConsList*>(this)->takeItems(*items);
+    }
+    m_store = malSequenceStore::create(items);
+    m_begin = m_store->begin();
+    m_end = m_store->end();
+}
+
+bool malSequence::canClaimFront(int count) const
+{
+    flatten();
+    return m_store->canClaim(m_begin, count);
+}
+
+//  Find room for count items in front of this sequence, either by claiming
+//  spare slots in front of it, or by copying it into a new store.
+malValueIter malSequence::claimFront(int count,
+                                     malSequenceStorePtr& store) const
+{
+    flatten();
+    store = m_store;
+    if (m_store->claim(m_begin, count)) {
+        return m_begin - count;
+    }
+    // Leave enough room in front for the list to double in size before
+    // it needs copying again.
+    store = malSequenceStore::create(this->count() + count, m_begin, m_end);
+    store->claim(store->begin(), count);
+    return store->begin();
+}
+
+malValuePtr malSequence::prepend(malValueIter argsBegin,
+                                 malValueIter argsEnd) const
+{
+    int newItemCount = std::distance(argsBegin, argsEnd);
+    if (newItemCount == 0) {
+        return asList();
+    }
+
+    malSequenceStorePtr store;
+    malValueIter start = claimFront(newItemCount, store);
+    std::copy(argsBegin, argsEnd, start);
+    return malValuePtr(new malList(store, start,
+                                   start + newItemCount + count()));
+}
+
+malValuePtr malSequence::cons(malValuePtr item) const
+{
+    // A consed list is consed onto without laying it out, and a long list
+    // is shared rather than copied if there's no room in front of it.
+    bool isConsList = (type() == TYPE_LIST) && !m_store;
+    if (isConsList ||
+        ((count() > MAX_COPIED_COUNT) && !canClaimFront(1))) {
+        return malValuePtr(new malConsList(item, asList()));
+    }
+
+    malSequenceStorePtr store;
+    malValueIter start = claimFront(1, store);
+    *start = item;
+    return malValuePtr(new malList(store, start, start + 1 + count()));
+}
+
+malValuePtr malSequence::asList() const
+{
+    if ((type() == TYPE_LIST) && !hasMeta()) {
+        return malValuePtr(const_cast<malSequence*>(this));
+    }
+    flatten();
+    return malValuePtr(new malList(m_store, m_begin, m_end));
+}
+
+void malSequence::visitChildren(Visitor& visit) const
+{
+    malValue::visitChildren(visit);
+    visit(m_store.ptr());
 }
 
 String malString::escapedValue() const
@@ -464,6 +1290,14 @@ String malString::escapedValue() const
     return escape(value());
 }
 
+size_t malString::hash() const
+{
+    if (m_hash == 0) {
+        m_hash = std::hash<String>()(value());
+    }
+    return m_hash;
+}
+
 String malString::print(bool readably) const
 {
     return readably ? escapedValue() : value();
@@ -471,25 +1305,329 @@ String malString::print(bool readably) const
 
 malValuePtr malSymbol::eval(malEnvPtr env)
 {
-    return env->get(value());
+    malValuePtr bound = lookup(env);
+    MAL_CHECK(bound, "'%s' not found", value().c_str());
+    return bound;
+}
+
+malValuePtr malSymbol::lookup(const malEnvPtr& env) const
+{
+    return env->lookup(this);
+}
+
+malLocalRef::malLocalRef(const malSymbol& symbol, int depth, int slot,
+                         const malFrameLayoutPtr& layout)
+: malSymbol(symbol, symbol.meta())
+, m_depth(depth)
+, m_slot(slot)
+, m_layout(layout)
+{
+
+}
+
+malLocalRef::~malLocalRef()
+{
+
+}
+
+malValuePtr malLocalRef::lookup(const malEnvPtr& env) const
+{
+    // Names which def! adds to a frame between here and the slot's frame
+    // would shadow it, so those frames need a search by name.
+    malEnv* frame = env.ptr();
+    for (int i = 0; (i < m_depth) && frame; i++) {
+        if (frame->hasUnslotted()) {
+            return env->lookup(this);
+        }
+        frame = frame->outer();
+    }
+    if (frame && (frame->layout() == m_layout)) {
+        const malValuePtr& value = frame->slot(m_slot);
+        if (value) {
+            return value;
+        }
+    }
+    return env->lookup(this);
+}
+
+malGlobalRef::malGlobalRef(const malSymbol& symbol,
+                           const malFrameLayoutPtr& scope)
+: malSymbol(symbol, symbol.meta())
+, m_scope(scope)
+, m_cell(NULL)
+, m_version(0)
+{
+
+}
+
+malGlobalRef::~malGlobalRef()
+{
+
+}
+
+malValuePtr malGlobalRef::lookup(const malEnvPtr& env) const
+{
+    if (m_cell && (m_version == malEnv::version()) &&
+        (env->layout() == m_scope)) {
+        return *m_cell;
+    }
+    m_cell = env->globalCell(this);
+    if (m_cell) {
+        m_version = malEnv::version();
+        return *m_cell;
+    }
+    return env->lookup(this);
+}
+
+enum {
+    VECTOR_BITS  = 5,
+    VECTOR_WIDTH = 1 << VECTOR_BITS,
+    VECTOR_MASK  = VECTOR_WIDTH - 1,
+};
+
+class malVectorLeaf : public RefCounted {
+public:
+    malVectorLeaf() : RefCounted(TRACED) { }
+    malVectorLeaf(const malVectorLeaf* that, int count) : RefCounted(TRACED) {
+        std::copy(that->items, that->items + count, items);
+    }
+
+    virtual void visitChildren(Visitor& visit) const {
+        for (int i = 0; i < VECTOR_WIDTH; i++) {
+            visit(items[i].counted());
+        }
+    }
+
+    malValueRef items[VECTOR_WIDTH];
+};
+
+//  Children are branches, or leaves at the bottom level, so the type of a
+//  child depends on its depth.
+class malVectorBranch : public RefCounted {
+public:
+    malVectorBranch() : RefCounted(TRACED) { }
+    malVectorBranch(const malVectorBranch* that) : RefCounted(TRACED) {
+        std::copy(that->children, that->children + VECTOR_WIDTH, children);
+    }
+
+    const malVectorBranch* branch(int index) const {
+        return static_cast<const malVectorBranch*>(children[index].ptr());
+    }
+
+    const malVectorLeaf* leaf(int index) const {
+        return static_cast<const malVectorLeaf*>(children[index].ptr());
+    }
+
+    virtual void visitChildren(Visitor& visit) const {
+        for (int i = 0; i < VECTOR_WIDTH; i++) {
+            visit(children[i].ptr());
+        }
+    }
+
+    RefCountedRef<RefCounted> children[VECTOR_WIDTH];
+};
+
+malVector::malVector(malValueVec* items)
+: malSequence(TYPE_VECTOR, malValuePtr())
+, m_count(0)
+, m_shift(VECTOR_BITS)
+{
+    for (auto it = items->begin(), end = items->end(); it != end; ++it) {
+        append(*it);
+    }
+    delete items;
+}
+
+malVector::malVector(malValueIter begin, malValueIter end)
+: malSequence(TYPE_VECTOR, malValuePtr())
+, m_count(0)
+, m_shift(VECTOR_BITS)
+{
+    for (auto it = begin; it != end; ++it) {
+        append(*it);
+    }
+}
+
+malVector::malVector(const malVector& that, malValuePtr meta)
+: malSequence(that, meta)
+, m_count(that.m_count)
+, m_shift(that.m_shift)
+, m_root(that.m_root)
+, m_tail(that.m_tail)
+{
+
+}
+
+malVector::malVector(int count, int shift, BranchPtr root, LeafPtr tail)
+: malSequence(TYPE_VECTOR, malValuePtr())
+, m_count(count)
+, m_shift(shift)
+, m_root(root)
+, m_tail(tail)
+{
+
+}
+
+malVector::~malVector()
+{
+
+}
+
+//  The index of the first item in the tail.
+int malVector::tailOffset() const
+{
+    return (m_count < VECTOR_WIDTH) ? 0
+         : ((m_count - 1) >> VECTOR_BITS) << VECTOR_BITS;
+}
+
+const malVectorLeaf* malVector::leafFor(int index) const
+{
+    if (index >= tailOffset()) {
+        return m_tail.ptr();
+    }
+    const malVectorBranch* node = m_root.ptr();
+    for (int level = m_shift; level > VECTOR_BITS; level -= VECTOR_BITS) {
+        node = node->branch((index >> level) & VECTOR_MASK);
+    }
+    return node->leaf((index >> VECTOR_BITS) & VECTOR_MASK);
+}
+
+malValuePtr malVector::item(int index) const
+{
+    return leafFor(index)->items[index & VECTOR_MASK];
+}
+
+void malVector::visitChildren(Visitor& visit) const
+{
+    malSequence::visitChildren(visit);
+    visit(m_root.ptr());
+    visit(m_tail.ptr());
+}
+
+void malVector::copyItems(malValueVec& out) const
+{
+    out.reserve(out.size() + m_count);
+    for (int i = 0; i < m_count; i += VECTOR_WIDTH) {
+        const malVectorLeaf* leaf = leafFor(i);
+        int count = std::min<int>(m_count - i, VECTOR_WIDTH);
+        out.insert(out.end(), leaf->items, leaf->items + count);
+    }
+}
+
+//  Add the full tail to the trie, returning the new root and shift. Only
+//  the nodes on the path to the new leaf are copied.
+void malVector::pushTail(BranchPtr& root, int& shift) const
+{
+    int index = m_count - 1;
+    if ((m_count >> VECTOR_BITS) > (1 << m_shift)) {
+        // The trie is full, so it gets a new root one level up.
+        root = new malVectorBranch;
+        root->children[0] = m_root.ptr();
+        shift = m_shift + VECTOR_BITS;
+    }
+    else {
+        root = m_root ? new malVectorBranch(m_root.ptr())
+                      : new malVectorBranch;
+        shift = m_shift;
+    }
+
+    malVectorBranch* node = root.ptr();
+    for (int level = shift; level > VECTOR_BITS; level -= VECTOR_BITS) {
+        RefCountedRef<RefCounted>& child
+            = node->children[(index >> level) & VECTOR_MASK];
+        const malVectorBranch* old
+            = static_cast<const malVectorBranch*>(child.ptr());
+        malVectorBranch* copy = old ? new malVectorBranch(old)
+                                    : new malVectorBranch;
+        child = copy;
+        node = copy;
+    }
+    node->children[(index >> VECTOR_BITS) & VECTOR_MASK] = m_tail.ptr();
+}
+
+//  Append in place. This is only used while constructing a new vector,
+//  before the tail can be shared with anything else.
+void malVector::append(malValuePtr value)
+{
+    int tailCount = m_count - tailOffset();
+    if (!m_tail) {
+        m_tail = new malVectorLeaf;
+    }
+    else if (tailCount == VECTOR_WIDTH) {
+        BranchPtr root;
+        int shift;
+        pushTail(root, shift);
+        m_root = root;
+        m_shift = shift;
+        m_tail = new malVectorLeaf;
+        tailCount = 0;
+    }
+    m_tail->items[tailCount] = value;
+    m_count++;
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    if (argsBegin == argsEnd) {
+        return malValuePtr(const_cast<malVector*>(this));
+    }
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+    // Copy the tail if there's room in it, so it can be appended to in
+    // place. A full tail is never changed, only pushed into the trie.
+    LeafPtr tail = m_tail;
+    int tailCount = m_count - tailOffset();
+    if (m_tail && (tailCount < VECTOR_WIDTH)) {
+        tail = new malVectorLeaf(m_tail.ptr(), tailCount);
+    }
+    malVector* vec = new malVector(m_count, m_shift, m_root, tail);
+    malValuePtr ret(vec);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        vec->append(*it);
+    }
+    return ret;
+}
+malValuePtr malVector::assoc(int index, malValuePtr value) const
+{
+    if (index == m_count) {
+        malValueVec items(1, value);
+        return conj(items.data(), items.data() + items.size());
+    }
+
+    int tailStart = tailOffset();
+    if (index >= tailStart) {
+        LeafPtr tail = new malVectorLeaf(m_tail.ptr(), m_count - tailStart);
+        tail->items[index & VECTOR_MASK] = value;
+        return malValuePtr(new malVector(m_count, m_shift, m_root, tail));
+    }
 
-    return mal::vector(items);
+    // Copy the path down to the leaf.
+    BranchPtr root = new malVectorBranch(m_root.ptr());
+    malVectorBranch* node = root.ptr();
+    for (int level = m_shift; level > VECTOR_BITS; level -= VECTOR_BITS) {
+        RefCountedRef<RefCounted>& child
+            = node->children[(index >> level) & VECTOR_MASK];
+        malVectorBranch* copy = new malVectorBranch(
+            static_cast<const malVectorBranch*>(child.ptr()));
+        child = copy;
+        node = copy;
+    }
+    RefCountedRef<RefCounted>& child
+        = node->children[(index >> VECTOR_BITS) & VECTOR_MASK];
+    malVectorLeaf* leaf = new malVectorLeaf(
+        static_cast<const malVectorLeaf*>(child.ptr()), VECTOR_WIDTH);
+    leaf->items[index & VECTOR_MASK] = value;
+    child = leaf;
+    return malValuePtr(new malVector(m_count, m_shift, root, m_tail));
 }
 
 malValuePtr malVector::eval(malEnvPtr env)
 {
-    return mal::vector(evalItems(env));
+    malStackFrame items;
+    for (auto it = begin(), end = this->end(); it != end; ++it) {
+        items.push(EVAL(*it, env));
+    }
+    return mal::vector(items.begin(), items.end());
 }
 
 String malVector::print(bool readably) const
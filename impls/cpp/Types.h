@@ -1,54 +1,118 @@
 #ifndef INCLUDE_TYPES_H
 #define INCLUDE_TYPES_H
 
+#include "Collector.h"
 #include "MAL.h"
 
 #include <exception>
-#include <map>
+#include <functional>
+#include <type_traits>
 
 class malEmptyInputException : public std::exception { };
 
+//  Spread the bits of a hash, so that values which differ only slightly
+//  land in different slots of a hash map.
+inline size_t mixHash(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return static_cast<size_t>(hash);
+}
+
+inline size_t combineHash(size_t seed, size_t hash)
+{
+    return seed ^ (hash + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
 class malValue : public RefCounted {
 public:
-    malValue() {
-        TRACE_OBJECT("Creating malValue %p\n", this);
-    }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue(malType type)
+        : RefCounted(TRACED), m_type(type), m_hasMeta(false) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
+    malValue(malType type, malValuePtr meta);
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
+        if (m_hasMeta) {
+            eraseMeta();
+        }
     }
 
+    malType type() const { return static_cast<malType>(m_type); }
+
+    //  Each class answers whether a value of the given type is an instance
+    //  of it, which is what the casts below use instead of RTTI.
+    static bool isTypeOf(malType type) { return true; }
+
     malValuePtr withMeta(malValuePtr meta) const;
     virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
     malValuePtr meta() const;
+    bool hasMeta() const { return m_hasMeta; }
 
     bool isTrue() const;
 
     bool isEqualTo(const malValue* rhs) const;
 
+    //  Values which are isEqualTo each other have the same hash. By default
+    //  a value is only equal to itself, so it hashes by identity.
+    virtual size_t hash() const {
+        return mixHash(reinterpret_cast<uintptr_t>(this));
+    }
+
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual String print(bool readably) const = 0;
 
+    virtual void visitChildren(Visitor& visit) const {
+        if (m_hasMeta) {
+            visitMeta(visit);
+        }
+    }
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
-    malValuePtr m_meta;
+private:
+    //  Hardly any value has metadata, so it's kept in a table on the side,
+    //  rather than in every value.
+    void eraseMeta();
+    void visitMeta(Visitor& visit) const;
+
+    //  Both are bytes, so that they fit in the padding at the end of
+    //  RefCounted, and a value is no bigger than that.
+    const unsigned char m_type;
+    bool                m_hasMeta;
 };
 
+class malInteger;
+
+//  Immediate integers are only boxed if they could be a T.
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
+T* dynamic_value_cast(const malValuePtr& obj) {
+    if (obj.isInteger() && !std::is_base_of<T, malInteger>::value) {
+        return NULL;
+    }
+    if (!obj || !T::isTypeOf(obj.type())) {
+        return NULL;
+    }
+    return static_cast<T*>(obj.ptr());
+}
+
+template<class T>
+T* value_cast(const malValuePtr& obj, const char* typeName) {
+    T* dest = dynamic_value_cast<T>(obj);
     MAL_CHECK(dest != NULL, "%s is not a %s",
               obj->print(true).c_str(), typeName);
     return dest;
 }
 
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define DYNAMIC_CAST(Type, Value)  (dynamic_value_cast<Type>(Value))
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
+#define INTEGER_VALUE(Value)       integer_value(Value)
 
 #define WITH_META(Type) \
     virtual malValuePtr doWithMeta(malValuePtr meta) const { \
@@ -57,9 +121,11 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    malConstant(String name) : malValue(TYPE_CONSTANT), m_name(name) { }
     malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+        : malValue(TYPE_CONSTANT, meta), m_name(that.m_name) { }
+
+    static bool isTypeOf(malType type) { return type == TYPE_CONSTANT; }
 
     virtual String print(bool readably) const { return m_name; }
 
@@ -75,9 +141,11 @@ private:
 
 class malInteger : public malValue {
 public:
-    malInteger(int64_t value) : m_value(value) { }
+    malInteger(int64_t value) : malValue(TYPE_INTEGER), m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(TYPE_INTEGER, meta), m_value(that.m_value) { }
+
+    static bool isTypeOf(malType type) { return type == TYPE_INTEGER; }
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
@@ -89,6 +157,9 @@ public:
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
 
+    //  This must match the hash of an immediate integer.
+    virtual size_t hash() const { return mixHash(m_value); }
+
     WITH_META(malInteger);
 
 private:
@@ -97,10 +168,14 @@ private:
 
 class malStringBase : public malValue {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
+    malStringBase(malType type, const String& token)
+        : malValue(type), m_value(token) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : malValue(that.type(), meta), m_value(that.value()) { }
+
+    static bool isTypeOf(malType type) {
+        return (type >= TYPE_STRING) && (type <= TYPE_SYMBOL);
+    }
 
     virtual String print(bool readably) const { return m_value; }
 
@@ -113,9 +188,11 @@ private:
 class malString : public malStringBase {
 public:
     malString(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(TYPE_STRING, token), m_hash(0) { }
     malString(const malString& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_hash(that.m_hash) { }
+
+    static bool isTypeOf(malType type) { return type == TYPE_STRING; }
 
     virtual String print(bool readably) const;
 
@@ -125,92 +202,355 @@ public:
         return value() == static_cast<const malString*>(rhs)->value();
     }
 
+    virtual size_t hash() const;
+
     WITH_META(malString);
+
+private:
+    mutable size_t m_hash;
 };
 
+// Keywords and symbols are interned by mal::keyword and mal::symbol, so
+// each name has a single identity which is shared by every occurrence,
+// including copies made by with-meta.
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(TYPE_KEYWORD, token), m_identity(this),
+          m_hash(mixHash(std::hash<String>()(token))) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_identity(that.m_identity),
+          m_hash(that.m_hash) { }
+
+    static bool isTypeOf(malType type) { return type == TYPE_KEYWORD; }
+
+    const malKeyword* identity() const { return m_identity; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malKeyword*>(rhs)->value();
+        return m_identity == static_cast<const malKeyword*>(rhs)->m_identity;
     }
 
+    //  Hashed by name rather than by address, so that maps keyed by them
+    //  are in the same order from one run to the next.
+    virtual size_t hash() const { return m_hash; }
+
     WITH_META(malKeyword);
+
+private:
+    const malKeyword* const m_identity;
+    const size_t            m_hash;
 };
 
+class malLocalRef;
+class malGlobalRef;
+class malSequence;
+class malList;
+
 class malSymbol : public malStringBase {
 public:
     malSymbol(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(TYPE_SYMBOL, token), m_identity(this),
+          m_hash(mixHash(std::hash<String>()(token))) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_identity(that.m_identity),
+          m_hash(that.m_hash) { }
+
+    static bool isTypeOf(malType type) { return type == TYPE_SYMBOL; }
 
     virtual malValuePtr eval(malEnvPtr env);
 
+    //  Return the value bound to this symbol, or NULL if there isn't one.
+    virtual malValuePtr lookup(const malEnvPtr& env) const;
+
+    //  What scope analysis made of this symbol, if anything.
+    virtual const malLocalRef* asLocalRef() const { return NULL; }
+    virtual const malGlobalRef* asGlobalRef() const { return NULL; }
+
+    const malSymbol* identity() const { return m_identity; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malSymbol*>(rhs)->value();
+        return m_identity == static_cast<const malSymbol*>(rhs)->m_identity;
     }
 
+    //  By name, as with keywords.
+    virtual size_t hash() const { return m_hash; }
+
     WITH_META(malSymbol);
+
+private:
+    const malSymbol* const m_identity;
+    const size_t           m_hash;
+};
+
+//  A symbol which scope analysis found to name a local, in the slot of a
+//  frame a known number of frames out. Otherwise it is the same symbol, so
+//  macros and quoted forms see no difference. The frame's layout is checked
+//  before the slot is used, in case a macro moved the symbol elsewhere.
+class malLocalRef : public malSymbol {
+public:
+    malLocalRef(const malSymbol& symbol, int depth, int slot,
+                const malFrameLayoutPtr& layout);
+    virtual ~malLocalRef();
+
+    virtual malValuePtr lookup(const malEnvPtr& env) const;
+
+    virtual const malLocalRef* asLocalRef() const { return this; }
+
+    int depth() const { return m_depth; }
+    int slot() const { return m_slot; }
+    const malFrameLayoutPtr& layout() const { return m_layout; }
+
+private:
+    const int               m_depth;
+    const int               m_slot;
+    const malFrameLayoutPtr m_layout;
+};
+
+//  A symbol which scope analysis found doesn't name a local. It caches the
+//  global cell it was last found in, which stays good for as long as it's
+//  evaluated in frames of the same layout, and malEnv::version() doesn't
+//  change.
+class malGlobalRef : public malSymbol {
+public:
+    malGlobalRef(const malSymbol& symbol, const malFrameLayoutPtr& scope);
+    virtual ~malGlobalRef();
+
+    virtual malValuePtr lookup(const malEnvPtr& env) const;
+
+    virtual const malGlobalRef* asGlobalRef() const { return this; }
+
+    const malFrameLayoutPtr& scope() const { return m_scope; }
+
+private:
+    const malFrameLayoutPtr    m_scope;
+    mutable const malValueRef* m_cell;
+    mutable unsigned           m_version;
 };
 
+//  The items of one or more sequences. Each sequence is a view of a range
+//  of a store, which lets rest, cons and with-meta share the items rather
+//  than copy them. Stores may have spare slots in front of the first item,
+//  which are claimed by consing onto the sequence that starts there. No
+//  view ever covers those slots, so claiming them is safe while the store
+//  is shared. The slots follow the store in the same block.
+//
+//  A new list and its store are made in one block, list first. The list is
+//  destroyed as usual, but the block is only freed with the store, which
+//  outlives the list if other views of it do.
+class malSequenceStore : public RefCounted {
+public:
+    //  A store of the items, taken from the vector, which is deleted.
+    static malSequenceStore* create(malValueVec* items);
+
+    //  A store of copies of the items, with spare slots in front of them.
+    static malSequenceStore* create(int spare,
+                                    malValueIter begin, malValueIter end);
+
+    //  A list of the items, in one block with its store, as above.
+    static malList* createList(malValueVec* items);
+    static malList* createList(malValueIter begin, malValueIter end);
+
+    //  Whether this is in the block of seq, having been made with it.
+    bool isInBlockOf(const malSequence* seq) const;
+
+    malValueIter begin() { return m_front; }
+    malValueIter end()   { return m_end; }
+
+    bool canClaim(malValueIter begin, int count) const;
+    bool claim(malValueIter begin, int count);
+
+    virtual void destroy() const;
+
+    virtual void visitChildren(Visitor& visit) const;
+    virtual void clearChildren();
+
+private:
+    //  How many items a long store drops each time it's freed; see destroy.
+    enum { FREE_CHUNK = 4096 };
+
+    malSequenceStore(int spare, int count, bool isInList = false);
+    virtual ~malSequenceStore();
+
+    static void* allocateList(int count);
+
+    static size_t sizeFor(int slots) {
+        return sizeof(malSequenceStore) + slots * sizeof(malValueRef);
+    }
+
+    malValueRef* slots() const {
+        return reinterpret_cast<malValueRef*>(
+            const_cast<malSequenceStore*>(this) + 1);
+    }
+
+    const int    m_slotCount;
+    bool         m_isRoot;     // see claim()
+    const bool   m_isInList;   // made with a list, which starts the block
+    malValueIter m_front;
+    malValueIter m_end;
+};
+
+typedef RefCountedPtr<malSequenceStore> malSequenceStorePtr;
+typedef RefCountedRef<malSequenceStore> malSequenceStoreRef;
+
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
+    malSequence(malType type, malValueVec* items);
+    malSequence(malType type, malValueIter begin, malValueIter end);
+    malSequence(malType type, malSequenceStorePtr store,
+                malValueIter begin, malValueIter end);
     malSequence(const malSequence& that, malValuePtr meta);
     virtual ~malSequence();
 
+    static bool isTypeOf(malType type) {
+        return (type == TYPE_LIST) || (type == TYPE_VECTOR);
+    }
+
     virtual String print(bool readably) const;
 
     malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    inline int count() const;
+    bool isEmpty() const { return count() == 0; }
+    inline malValuePtr item(int index) const;
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    //  Vectors and consed lists don't lay their items out in a store until
+    //  they're first iterated over.
+    malValueIter begin() const { flatten(); return m_begin; }
+    malValueIter end()   const { flatten(); return m_end; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    //  Lists and vectors with equal items hash the same.
+    virtual size_t hash() const;
+
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
 
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    //  Return a list of [argsBegin, argsEnd) followed by these items.
+    malValuePtr prepend(malValueIter argsBegin, malValueIter argsEnd) const;
+
+    //  Return a list of item followed by these items, which shares them
+    //  whether or not the slot in front of them is free, see malConsList.
+    malValuePtr cons(malValuePtr item) const;
+
+    //  Return a list of these items without metadata, sharing them where
+    //  possible.
+    malValuePtr asList() const;
+
+    virtual void destroy() const;
+
+    virtual void visitChildren(Visitor& visit) const;
+
+protected:
+    malSequence(malType type, malValuePtr meta);
+
 private:
-    malValueVec* const m_items;
+    friend class malConsList;
+
+    //  A sequence of no more than this many items is copied by cons when
+    //  the slot in front of it is taken, which is cheaper than a cons cell.
+    enum { MAX_COPIED_COUNT = 32 };
+
+    void flatten() const {
+        if (!m_store) {
+            flattenItems();
+        }
+    }
+    void flattenItems() const;
+
+    bool canClaimFront(int count) const;
+    malValueIter claimFront(int count, malSequenceStorePtr& store) const;
+
+    mutable malSequenceStoreRef m_store;
+    mutable malValueIter        m_begin;
+    mutable malValueIter        m_end;
+    mutable size_t              m_hash;
 };
 
+//  Whatever the evaluator works out about a form and keeps with it, so it
+//  need only be worked out once. Only the evaluator knows the concrete type.
+class malFormInfo : public RefCounted {
+};
+
+typedef RefCountedPtr<malFormInfo> malFormInfoPtr;
+
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    malList(malValueVec* items) : malSequence(TYPE_LIST, items) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(TYPE_LIST, begin, end) { }
+    malList(malSequenceStorePtr store, malValueIter begin, malValueIter end)
+        : malSequence(TYPE_LIST, store, begin, end) { }
     malList(const malList& that, malValuePtr meta)
         : malSequence(that, meta) { }
 
+    static bool isTypeOf(malType type) { return type == TYPE_LIST; }
+
     virtual String print(bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    const malFormInfo* info() const { return m_info.ptr(); }
+    void setInfo(malFormInfo* info) const { m_info = info; }
+
     WITH_META(malList);
+
+protected:
+    //  For a malConsList, which has no store until it's laid out.
+    malList() : malSequence(TYPE_LIST, malValuePtr()) { }
+
+private:
+    mutable malFormInfoPtr m_info;
 };
 
+//  A list of an item followed by the items of another list, which cons
+//  makes when the slot in front of that list is taken, as it is when the
+//  list was made by rest or has been consed onto before, rather than copy
+//  the whole list. The items are laid out in a store of their own when
+//  they're first iterated over, and the cells are dropped.
+class malConsList : public malList {
+public:
+    malConsList(malValuePtr first, malValuePtr rest);
+
+    int count() const { return m_count; }
+    malValuePtr item(int index) const;
+
+    virtual malValuePtr rest() const;
+
+    //  Move the items, in order, to out, and drop the cells.
+    void takeItems(malValueVec& out) const;
+
+    virtual void visitChildren(Visitor& visit) const;
+
+    //  The copy is a plain list, so this is laid out first.
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+
+private:
+    enum { MAX_WALKED_CELLS = 32 };
+
+    mutable malValueRef m_first;
+    mutable malValueRef m_rest;     // a list
+    const int           m_count;
+};
+
+class malVectorLeaf;
+class malVectorBranch;
+
+//  A persistent vector: a trie of 32-way branches over full leaves of 32
+//  items, plus a partly filled tail leaf. conj and assoc copy only the path
+//  to the changed leaf and share the rest of the trie with the original.
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
-    malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
-    malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+    malVector(malValueVec* items);
+    malVector(malValueIter begin, malValueIter end);
+    malVector(const malVector& that, malValuePtr meta);
+    virtual ~malVector();
+
+    static bool isTypeOf(malType type) { return type == TYPE_VECTOR; }
 
     virtual malValuePtr eval(malEnvPtr env);
     virtual String print(bool readably) const;
@@ -218,26 +558,152 @@ public:
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    //  Return a copy with the item at index replaced, or appended if index
+    //  is count().
+    malValuePtr assoc(int index, malValuePtr value) const;
+
+    int count() const { return m_count; }
+    malValuePtr item(int index) const;
+
+    //  Copy the items, in order, to out.
+    void copyItems(malValueVec& out) const;
+
+    virtual void visitChildren(Visitor& visit) const;
+
     WITH_META(malVector);
+
+private:
+    typedef RefCountedPtr<malVectorBranch> BranchPtr;
+    typedef RefCountedPtr<malVectorLeaf>   LeafPtr;
+    typedef RefCountedRef<malVectorBranch> BranchRef;
+    typedef RefCountedRef<malVectorLeaf>   LeafRef;
+
+    malVector(int count, int shift, BranchPtr root, LeafPtr tail);
+
+    int tailOffset() const;
+    const malVectorLeaf* leafFor(int index) const;
+
+    void append(malValuePtr value);
+    void pushTail(BranchPtr& root, int& shift) const;
+
+    int       m_count;
+    int       m_shift;
+    BranchRef m_root;
+    LeafRef   m_tail;
 };
 
+inline int malSequence::count() const
+{
+    if (m_store) {
+        return m_end - m_begin;
+    }
+    if (type() == TYPE_VECTOR) {
+        return static_cast<const malVector*>(this)->count();
+    }
+    return static_cast<const malConsList*>(this)->count();
+}
+
+inline malValuePtr malSequence::item(int index) const
+{
+    if (m_store) {
+        return m_begin[index];
+    }
+    if (type() == TYPE_VECTOR) {
+        return static_cast<const malVector*>(this)->item(index);
+    }
+    return static_cast<const malConsList*>(this)->item(index);
+}
+
 class malApplicable : public malValue {
 public:
-    malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    malApplicable(malType type) : malValue(type) { }
+    malApplicable(malType type, malValuePtr meta) : malValue(type, meta) { }
+
+    static bool isTypeOf(malType type) {
+        return (type == TYPE_BUILTIN) || (type == TYPE_LAMBDA);
+    }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
 };
 
+//  The arguments of every call being made, in one array which never moves.
+//  Arguments are evaluated onto it and passed to APPLY, or bound into a new
+//  frame, where they are, even if the call evaluates more of its own.
+class malValueStack {
+public:
+    enum { CAPACITY = 1 << 18 };
+
+    malValueStack() : m_items(CAPACITY), m_top(0) { }
+
+    int top() const { return m_top; }
+
+    void push(const malValuePtr& value) {
+        MAL_CHECK(m_top < CAPACITY, "Stack overflow");
+        m_items[m_top++] = value;
+    }
+
+    malValuePtr pop() {
+        malValuePtr value = m_items[--m_top];
+        m_items[m_top] = malValuePtr();
+        return value;
+    }
+
+    const malValueRef& peek() const { return m_items[m_top - 1]; }
+
+    const malValueRef& operator [] (int index) const {
+        return m_items[index];
+    }
+
+    malValueIter at(int index) { return m_items.data() + index; }
+
+    //  Drop everything above index.
+    void truncate(int index) {
+        while (m_top > index) {
+            m_items[--m_top] = malValuePtr();
+        }
+    }
+
+private:
+    std::vector<malValueRef> m_items;
+    int                      m_top;
+};
+
+extern malValueStack& valueStack();
+
+//  The values pushed onto the value stack while this is in scope, which are
+//  dropped when it goes, whether by return or exception.
+class malStackFrame {
+public:
+    malStackFrame() : m_stack(valueStack()), m_base(m_stack.top()) { }
+    ~malStackFrame() { m_stack.truncate(m_base); }
+
+    void push(const malValuePtr& value) { m_stack.push(value); }
+
+    malValueIter begin() { return m_stack.at(m_base); }
+    malValueIter end()   { return m_stack.at(m_stack.top()); }
+
+private:
+    malValueStack& m_stack;
+    const int      m_base;
+};
+
+class malHashNode;
+typedef RefCountedPtr<malHashNode> malHashNodePtr;
+typedef RefCountedRef<malHashNode> malHashNodeRef;
+
+//  A persistent hash map. Maps of up to FLAT_MAX entries are a flat array
+//  of entries, searched in order. Larger maps are a hash array mapped trie,
+//  so assoc and dissoc copy only the path to the changed entry.
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    enum { FLAT_MAX = 8 };
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
-    malHash(const malHash::Map& map);
-    malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    malHash(const malHash& that, malValuePtr meta);
+    virtual ~malHash();
+
+    static bool isTypeOf(malType type) { return type == TYPE_HASH; }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
@@ -247,15 +713,30 @@ public:
     malValuePtr keys() const;
     malValuePtr values() const;
 
+    int count() const { return m_count; }
+    bool isEvaluated() const { return m_isEvaluated; }
+
+    //  Append the entries to items as alternating keys and values.
+    void entries(malValueVec& items) const;
+
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual size_t hash() const;
+
+    virtual void visitChildren(Visitor& visit) const;
 
     WITH_META(malHash);
 
 private:
-    const Map m_map;
+    malHash(malHashNodePtr root, int count);
+
+    malValuePtr find(const malValuePtr& key) const;
+
+    malHashNodeRef m_root;
+    int m_count;
     const bool m_isEvaluated;
+    mutable size_t m_hash;
 };
 
 class malBuiltIn : public malApplicable {
@@ -264,11 +745,26 @@ public:
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    //  The builtins which the evaluators can run inline, see applyInline.
+    enum Intrinsic {
+        NONE, ADD, SUBTRACT, MULTIPLY, DIVIDE,
+        LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL
+    };
+
+    malBuiltIn(const String& name, ApplyFunc* handler,
+               Intrinsic intrinsic = NONE)
+    : malApplicable(TYPE_BUILTIN)
+    , m_name(name)
+    , m_handler(handler)
+    , m_intrinsic(intrinsic) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(TYPE_BUILTIN, meta)
+    , m_name(that.m_name)
+    , m_handler(that.m_handler)
+    , m_intrinsic(that.m_intrinsic) { }
+
+    static bool isTypeOf(malType type) { return type == TYPE_BUILTIN; }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -282,24 +778,45 @@ public:
     }
 
     String name() const { return m_name; }
+    Intrinsic intrinsic() const { return m_intrinsic; }
 
     WITH_META(malBuiltIn);
 
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    const Intrinsic m_intrinsic;
 };
 
+//  A lambda's body compiled by one of the alternative engines, which it
+//  runs in place of evaluating the body form.
+class malCode : public RefCounted {
+public:
+    virtual malValuePtr run(const malEnvPtr& env) const = 0;
+};
+
+typedef RefCountedPtr<const malCode> malCodePtr;
+
 class malLambda : public malApplicable {
 public:
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const malSymbolVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const malFrameLayoutPtr& params,
+              malValuePtr body, malEnvPtr env,
+              const malCodePtr& code = malCodePtr());
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
+    virtual ~malLambda();
+
+    static bool isTypeOf(malType type) { return type == TYPE_LAMBDA; }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
     malValuePtr getBody() const { return m_body; }
+    const malFrameLayoutPtr& params() const { return m_params; }
+    malEnv* env() const { return m_env.ptr(); }
+    const malCode* code() const { return m_code.ptr(); }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -314,23 +831,32 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void visitChildren(Visitor& visit) const;
+
 private:
-    const StringVec   m_bindings;
-    const malValuePtr m_body;
-    const malEnvPtr   m_env;
-    const bool        m_isMacro;
+    const malFrameLayoutPtr m_params;
+    const malValueRef  m_body;
+    const malEnvRef    m_env;
+    const malCodePtr   m_code;
+    const bool         m_isMacro;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value)
+        : malValue(TYPE_ATOM), m_value(value), m_root(this) { }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(TYPE_ATOM, meta), m_value(that.m_value), m_root(this) { }
+
+    static bool isTypeOf(malType type) { return type == TYPE_ATOM; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
     }
 
+    //  An atom's value can change, so its hash can't depend on it.
+    virtual size_t hash() const { return TYPE_ATOM; }
+
     virtual String print(bool readably) const {
         return "(atom " + m_value->print(readably) + ")";
     };
@@ -339,12 +865,104 @@ public:
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual void visitChildren(Visitor& visit) const {
+        malValue::visitChildren(visit);
+        visit(m_value.counted());
+    }
+
+    virtual void clearChildren() { m_value = malValuePtr(); }
+
     WITH_META(malAtom);
 
 private:
-    malValuePtr m_value;
+    malValueRef  m_value;
+    malCycleRoot m_root;
 };
 
+template<bool Counted>
+inline malValue* malValueHandle<Counted>::ptr() const
+{
+    if (isInteger()) {
+        box();
+    }
+    return object();
+}
+
+template<bool Counted>
+inline void malValueHandle<Counted>::acquire(uintptr_t bits)
+{
+    if (Counted && ((bits & TAG_MASK) == 0) && (bits != 0)) {
+        reinterpret_cast<malValue*>(bits)->acquire();
+    }
+    release();
+    m_bits = bits;
+}
+
+//  Values are only ever freed by a sweep under the tracing collector.
+template<bool Counted>
+inline void malValueHandle<Counted>::release()
+{
+    if (Counted && isCounted() && (m_bits != 0) &&
+            (object()->release() == 0) && !MAL_TRACING_GC) {
+        object()->dispose();
+    }
+}
+
+template<bool Counted>
+inline void malValueHandle<Counted>::box() const
+{
+    malValue* boxed = new malInteger(integerValue());
+    if (Counted) {
+        boxed->acquire();
+    }
+    m_bits = reinterpret_cast<uintptr_t>(boxed);
+}
+
+template<bool Counted>
+inline bool malValueHandle<Counted>::isEqualTo(
+    const malValueHandle& rhs) const
+{
+    if (isInteger() || rhs.isInteger()) {
+        const malValueHandle& imm   = isInteger() ? *this : rhs;
+        const malValueHandle& other = isInteger() ? rhs : *this;
+        if (other.isInteger()) {
+            return m_bits == rhs.m_bits;
+        }
+        const malValue* boxed = other.object();
+        return (boxed->type() == TYPE_INTEGER) &&
+            (static_cast<const malInteger*>(boxed)->value() ==
+             imm.integerValue());
+    }
+    return ptr()->isEqualTo(rhs.ptr());
+}
+
+template<bool Counted>
+inline malType malValueHandle<Counted>::type() const
+{
+    return isInteger() ? TYPE_INTEGER : object()->type();
+}
+
+template<bool Counted>
+inline size_t malValueHandle<Counted>::hash() const
+{
+    return isInteger() ? mixHash(integerValue()) : object()->hash();
+}
+
+template<bool Counted>
+inline bool malValueHandle<Counted>::isTrue() const
+{
+    return isInteger() || object()->isTrue();
+}
+
+//  The value of an integer, without boxing it if it's immediate.
+inline int64_t integer_value(const malValuePtr& obj)
+{
+    if (obj.isInteger()) {
+        return obj.integerValue();
+    }
+    return VALUE_CAST(malInteger, obj)->value();
+}
+
 namespace mal {
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
@@ -352,11 +970,12 @@ namespace mal {
     malValuePtr falseValue();
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
-    malValuePtr hash(const malHash::Map& map);
     malValuePtr integer(int64_t value);
-    malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malSymbolVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malFrameLayoutPtr&, malValuePtr, malEnvPtr,
+                       const malCodePtr& code = malCodePtr());
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
@@ -371,4 +990,58 @@ namespace mal {
     malValuePtr vector(malValueIter begin, malValueIter end);
 };
 
+//  The value of (op lhs rhs), if op is the builtin for integer arithmetic,
+//  an integer comparison or =, and it can be worked out here without the
+//  builtin's checks. Otherwise NULL, and the call must be made as usual.
+//  The check is on op's value, so a name rebound to something else is
+//  always called.
+inline malValuePtr applyInline(const malValuePtr& op,
+                               const malValuePtr& lhs,
+                               const malValuePtr& rhs)
+{
+    if (op.type() != TYPE_BUILTIN) {
+        return NULL;
+    }
+    malBuiltIn::Intrinsic intrinsic = STATIC_CAST(malBuiltIn, op)->intrinsic();
+    if (intrinsic == malBuiltIn::EQUAL) {
+        return mal::boolean(lhs.isEqualTo(rhs));
+    }
+    if ((intrinsic == malBuiltIn::NONE) ||
+        !lhs.isInteger() || !rhs.isInteger()) {
+        return NULL;
+    }
+
+    int64_t a = lhs.integerValue();
+    int64_t b = rhs.integerValue();
+    if ((intrinsic == malBuiltIn::DIVIDE) &&
+        ((b == 0) || ((a == INT64_MIN) && (b == -1)))) {
+        return NULL; // for the builtin to report
+    }
+    //  Likewise a result which overflows.
+    int64_t result;
+    switch (intrinsic) {
+        case malBuiltIn::ADD:
+            if (__builtin_add_overflow(a, b, &result)) {
+                return NULL;
+            }
+            return mal::integer(result);
+        case malBuiltIn::SUBTRACT:
+            if (__builtin_sub_overflow(a, b, &result)) {
+                return NULL;
+            }
+            return mal::integer(result);
+        case malBuiltIn::MULTIPLY:
+            if (__builtin_mul_overflow(a, b, &result)) {
+                return NULL;
+            }
+            return mal::integer(result);
+        case malBuiltIn::DIVIDE:        return mal::integer(a / b);
+        case malBuiltIn::LESS:          return mal::boolean(a < b);
+        case malBuiltIn::LESS_EQUAL:    return mal::boolean(a <= b);
+        case malBuiltIn::GREATER:       return mal::boolean(a > b);
+        case malBuiltIn::GREATER_EQUAL: return mal::boolean(a >= b);
+        default:                        return NULL;
+    }
+}
+
 #endif // INCLUDE_TYPES_H
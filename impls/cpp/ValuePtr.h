@@ -0,0 +1,205 @@
+#ifndef INCLUDE_VALUEPTR_H
+#define INCLUDE_VALUEPTR_H
+
+#include "Allocator.h"
+#include "Debug.h"
+
+#include <cstddef>
+#include <stdint.h>
+
+class malValue;
+
+//  The concrete type of a malValue. Types which share a base class are kept
+//  together, so the base can be checked with a range comparison.
+enum malType {
+    TYPE_CONSTANT,
+    TYPE_INTEGER,
+    TYPE_STRING,        // malStringBase
+    TYPE_KEYWORD,       //      "
+    TYPE_SYMBOL,        //      "
+    TYPE_LIST,          // malSequence
+    TYPE_VECTOR,        //      "
+    TYPE_HASH,
+    TYPE_BUILTIN,       // malApplicable
+    TYPE_LAMBDA,        //      "
+    TYPE_ATOM,
+};
+
+//  A reference to a malValue. Most values are refcounted heap objects, but
+//  two kinds of value are held directly in the pointer bits instead:
+//
+//    ...xxx1   a small integer, stored shifted left by one.
+//    ...x10    a pointer to an object which is never freed, such as nil,
+//              true and false, which is copied without touching its count.
+//    ...x00    a refcounted pointer, or NULL.
+//
+//  Immediate integers are only turned into a malInteger when something asks
+//  for a malValue* with ptr(). That boxes the value in place, so the
+//  pointer lives as long as this handle, just as it does for heap values.
+//  operator->() boxes into a temporary instead, so calling a method on an
+//  integer doesn't change the handle.
+//
+//  Handles which aren't Counted leave the count alone, see malValueRef.
+template<bool Counted>
+class malValueHandle {
+public:
+    malValueHandle() : m_bits(0) { }
+
+    malValueHandle(malValue* object) : m_bits(0)
+    { acquire(reinterpret_cast<uintptr_t>(object)); }
+
+    malValueHandle(const malValueHandle& rhs) : m_bits(0)
+    { acquire(rhs.m_bits); }
+
+    template<bool C>
+    malValueHandle(const malValueHandle<C>& rhs) : m_bits(0)
+    { acquire(rhs.m_bits); }
+
+    //  Moving takes the reference, so the count needn't change.
+    malValueHandle(malValueHandle&& rhs) noexcept : m_bits(rhs.m_bits)
+    { rhs.m_bits = 0; }
+
+    ~malValueHandle() {
+        release();
+    }
+
+    const malValueHandle& operator = (const malValueHandle& rhs) {
+        acquire(rhs.m_bits);
+        return *this;
+    }
+
+    template<bool C>
+    const malValueHandle& operator = (const malValueHandle<C>& rhs) {
+        acquire(rhs.m_bits);
+        return *this;
+    }
+
+    const malValueHandle& operator = (malValueHandle&& rhs) noexcept {
+        if (this != &rhs) {
+            release();
+            m_bits = rhs.m_bits;
+            rhs.m_bits = 0;
+        }
+        return *this;
+    }
+
+    //  Return an immediate integer, or NULL if the value doesn't fit in
+    //  the pointer bits.
+    static malValueHandle immediate(int64_t value) {
+        malValueHandle ret;
+        intptr_t bits = static_cast<intptr_t>(
+            static_cast<uintptr_t>(value) << 1);
+        if ((bits >> 1) == value) {
+            ret.m_bits = static_cast<uintptr_t>(bits) | INTEGER_TAG;
+        }
+        return ret;
+    }
+
+    //  Return an uncounted reference to an object which must never be
+    //  freed. The caller is responsible for keeping its refcount above 0.
+    static malValueHandle immortal(malValue* object) {
+        malValueHandle ret;
+        ret.m_bits = reinterpret_cast<uintptr_t>(object) | IMMORTAL_TAG;
+        return ret;
+    }
+
+    bool isInteger() const { return (m_bits & INTEGER_TAG) != 0; }
+    inline malType type() const;
+
+    int64_t integerValue() const {
+        ASSERT(isInteger(), "Not an immediate integer\n");
+        return static_cast<intptr_t>(m_bits) >> 1;
+    }
+
+    bool operator == (const malValueHandle& rhs) const {
+        return key() == rhs.key();
+    }
+
+    bool operator != (const malValueHandle& rhs) const {
+        return key() != rhs.key();
+    }
+
+    operator bool () const {
+        return m_bits != 0;
+    }
+
+    //  The object, if this holds a counted reference to one, or NULL.
+    malValue* counted() const { return isCounted() ? object() : NULL; }
+
+    class Arrow;
+    Arrow operator -> () const;
+    inline malValue* ptr() const;
+
+    //  Value equality, as per malValue::isEqualTo, without boxing integers.
+    inline bool isEqualTo(const malValueHandle& rhs) const;
+    inline size_t hash() const;
+    inline bool isTrue() const;
+
+private:
+    template<bool C> friend class malValueHandle;
+
+    enum {
+        INTEGER_TAG  = 1,
+        IMMORTAL_TAG = 2,
+        TAG_MASK     = 3,
+    };
+
+    bool isCounted() const { return (m_bits & TAG_MASK) == 0; }
+
+    //  Pointers compare equal whether or not they're counted.
+    uintptr_t key() const {
+        return isInteger() ? m_bits : (m_bits & ~uintptr_t(IMMORTAL_TAG));
+    }
+
+    malValue* object() const {
+        return reinterpret_cast<malValue*>(m_bits & ~uintptr_t(TAG_MASK));
+    }
+
+    inline void acquire(uintptr_t bits);
+    inline void release();
+    inline void box() const;
+
+    mutable uintptr_t m_bits;
+};
+
+//  A reference held by code, which is always counted. Under the tracing
+//  collector, these are how it finds the values the program is using.
+typedef malValueHandle<true> malValuePtr;
+
+//  A reference held by one value or environment to another, or from the
+//  value stack or a malValueVec. The tracing collector follows these from
+//  the objects which hold them, or treats them as roots, so they needn't be
+//  counted.
+#if MAL_TRACING_GC
+typedef malValueHandle<false> malValueRef;
+#else
+typedef malValuePtr malValueRef;
+#endif
+
+template<bool Counted>
+class malValueHandle<Counted>::Arrow {
+public:
+    malValue* operator -> () const { return m_object; }
+
+private:
+    friend class malValueHandle<Counted>;
+    Arrow(malValue* object) : m_object(object) { }
+    Arrow(const malValuePtr& boxed) : m_boxed(boxed), m_object(boxed.ptr()) { }
+
+    malValuePtr m_boxed;
+    malValue*   m_object;
+};
+
+template<bool Counted>
+inline typename malValueHandle<Counted>::Arrow
+malValueHandle<Counted>::operator -> () const
+{
+    if (isInteger()) {
+        malValuePtr boxed(*this);
+        boxed.box();
+        return Arrow(boxed);
+    }
+    return Arrow(object());
+}
+
+#endif // INCLUDE_VALUEPTR_H
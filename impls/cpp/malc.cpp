@@ -0,0 +1,1220 @@
+#include "MAL.h"
+
+#include "Compiler.h"
+#include "Environment.h"
+#include "Native.h"
+#include "Types.h"
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string.h>
+
+//  malc translates a mal program into a C++ program, which links against
+//  libmal.a and malrt.o, the interpreter without its main().
+//
+//  Each fn* becomes a C++ function, which keeps its parameters and let*
+//  bindings in C++ variables and loops, rather than returns, to make a tail
+//  call to itself. Only a let* or catch* with a fn* inside it gets a frame,
+//  for the fn* to capture. Builtins and other globals are called through
+//  cells which are looked up once. Known macros are expanded as the program
+//  is compiled, and load-file of a literal path compiles that file in as
+//  though its forms were at the top level.
+//
+//  Top-level def! and defmacro! forms are also evaluated by malc itself, so
+//  that macros, and the functions they call, can be expanded. A top-level
+//  form which malc can't compile, because it calls something not yet
+//  defined, or uses def! or macroexpand other than at the top level, is
+//  left for the interpreter to evaluate when the program runs.
+
+static const malSymbol* internSymbol(const char* name)
+{
+    return STATIC_CAST(malSymbol, mal::symbol(name));
+}
+
+static const malSymbol* const s_catch = internSymbol("catch*");
+static const malSymbol* const s_def = internSymbol("def!");
+static const malSymbol* const s_defmacro = internSymbol("defmacro!");
+static const malSymbol* const s_do = internSymbol("do");
+static const malSymbol* const s_fn = internSymbol("fn*");
+static const malSymbol* const s_if = internSymbol("if");
+static const malSymbol* const s_let = internSymbol("let*");
+static const malSymbol* const s_loadFile = internSymbol("load-file");
+static const malSymbol* const s_loadFileOnce = internSymbol("load-file-once");
+static const malSymbol* const s_macroexpand = internSymbol("macroexpand");
+static const malSymbol* const s_quasiquote = internSymbol("quasiquote");
+static const malSymbol* const s_quasiquoteexpand =
+    internSymbol("quasiquoteexpand");
+static const malSymbol* const s_quote = internSymbol("quote");
+static const malSymbol* const s_try = internSymbol("try*");
+
+//  Thrown when a form can't be compiled, so that the top-level form it's in
+//  is left to the interpreter.
+struct Unsupported { };
+
+static bool isSymbol(const malValuePtr& value, const malSymbol* symbol)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, value);
+    return sym && (sym->identity() == symbol);
+}
+
+//  Whether value prints as something which reads back as an equal value.
+static bool isReadable(const malValuePtr& value)
+{
+    if (value.isInteger()) {
+        return true;
+    }
+    switch (value.type()) {
+        case TYPE_LIST:
+        case TYPE_VECTOR: {
+            const malSequence* seq = STATIC_CAST(malSequence, value);
+            for (int i = 0; i < seq->count(); i++) {
+                if (!isReadable(seq->item(i))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        case TYPE_HASH: {
+            malValueVec items;
+            STATIC_CAST(malHash, value)->entries(items);
+            for (auto it = items.begin(); it != items.end(); ++it) {
+                if (!isReadable(*it)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        case TYPE_BUILTIN:
+        case TYPE_LAMBDA:
+        case TYPE_ATOM:
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+//  A C++ string literal for s.
+static String cppString(const String& s)
+{
+    String out = "\"";
+    for (auto it = s.begin(); it != s.end(); ++it) {
+        unsigned char c = *it;
+        switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '"':  out += "\\\""; break;
+            case '?':  out += "\\?";  break; // no trigraphs
+            case '\n': out += "\\n";  break;
+            default:
+                if ((c < ' ') || (c == 127)) {
+                    out += STRF("\\%03o", c);
+                }
+                else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+static bool readFile(const String& path, String& text)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::ostringstream data;
+    data << file.rdbuf();
+    text = data.str();
+    return true;
+}
+
+//  A local which the function being compiled keeps in a C++ variable. It
+//  isn't ready until a let* has evaluated it, and until then the name
+//  refers to whatever it did outside the let*.
+struct Binding {
+    const malSymbol* name;
+    String           var;
+    int              slot;
+    bool             ready;
+};
+
+//  The names bound by a fn*, let* or catch*. If it has a frame, then fn*
+//  forms inside it capture that, and read its slots.
+struct Scope {
+    int                  function;
+    String               frame;
+    malFrameLayoutPtr    layout;
+    std::vector<Binding> bindings;
+};
+
+//  A tail call a function makes to itself, which can either assign the
+//  parameters, if it has the right number of arguments, or make a new
+//  frame, which it must if the function uses its frame.
+struct SelfCall {
+    bool   canAssign;
+    String assign;
+    String rebuild;
+};
+
+//  A fn* being compiled into C++ function fN.
+struct Function {
+    int                  index;
+    const malSymbol*     self;  // the name it's bound to, if any
+    int                  arity; // -1 if it's variadic
+    std::vector<String>  params;
+    bool                 usesEnv;
+    std::vector<SelfCall> selfCalls;
+};
+
+class Translator {
+public:
+    Translator(const malEnvPtr& env, const String& source);
+
+    void compileFile(const String& path);
+    void write(std::ostream& out);
+
+private:
+    void declare(const malValuePtr& form);
+    void topLevel(const malValuePtr& form);
+    void abandon(size_t mark, const malValuePtr& form);
+    void fallback(const malValuePtr& form);
+    void evalNow(const malValuePtr& form);
+
+    String expr(const malValuePtr& form);
+    void   ret(const malValuePtr& form);
+
+    //  Compile a list which might be a special form or macro, into either
+    //  a value or, if isTail, a return.
+    String compileList(const malValuePtr& form, bool isTail);
+    bool   compileSpecial(const malSymbol* special, const malList* list,
+                          bool isTail, String& value);
+    String compileCall(const malList* list, bool isTail);
+    String compileDo(const malList* list, bool isTail);
+    String compileIf(const malList* list, bool isTail);
+    String compileLet(const malList* list, bool isTail);
+    String compileTry(const malList* list, bool isTail);
+    String compileQuasiquote(const malValuePtr& form, bool isTail);
+    String compileFn(const malList* list, const malSymbol* self);
+    String compileInit(const malValuePtr& form, const malSymbol* name);
+    String compileSymbol(const malSymbol* symbol);
+    String compileSequence(const malSequence* seq, bool isVector);
+    String compileHash(const malHash* hash);
+
+    //  A value, as the form in tail position would produce it.
+    String result(const String& value, bool isTail);
+    void   discard(const String& value);
+
+    void pushScope(const malFrameLayoutPtr& layout, const String& frame);
+    void pushFrame(const malFrameLayoutPtr& layout, bool hasFrame);
+    void popScope() { m_scopes.pop_back(); }
+    String bind(const malSymbol* name, int slot, const String& value);
+    bool mayClose(const malValuePtr& form) const;
+    const malLambda* macroFor(const malSymbol* symbol) const;
+    bool isLocal(const malSymbol* symbol) const;
+
+    String constant(const malValuePtr& value);
+    String global(const malSymbol* symbol);
+    String layout(const malFrameLayoutPtr& layout, bool isParams);
+    String quasi(const malValuePtr& form);
+    String envVar() const;
+    String temp(const char* prefix);
+
+    void line(const String& text);
+
+    malEnvPtr                m_env;
+    String                   m_source;
+    std::set<String>         m_loaded;
+    std::set<const malSymbol*> m_functionNames;
+    std::set<const malSymbol*> m_macroNames;
+
+    std::vector<String>      m_consts;
+    std::map<String, int>    m_constIndex;
+    std::vector<String>      m_globals;
+    std::map<String, int>    m_globalIndex;
+    std::vector<String>      m_layouts;
+    std::vector<String>      m_templates;
+    std::vector<String>      m_functions;
+
+    String                   m_program;
+    String*                  m_out;
+    int                      m_indent;
+    int                      m_tempCount;
+
+    std::vector<Scope>       m_scopes;
+    std::vector<Function*>   m_stack; // the fn* forms being compiled
+};
+
+Translator::Translator(const malEnvPtr& env, const String& source)
+: m_env(env)
+, m_source(source)
+, m_out(&m_program)
+, m_indent(1)
+, m_tempCount(0)
+{
+
+}
+
+void Translator::compileFile(const String& path)
+{
+    String text;
+    MAL_CHECK(readFile(path, text), "Couldn't read %s", path.c_str());
+    m_loaded.insert(path);
+
+    malValuePtr program = readStr("(do " + text + "\nnil)");
+    const malList* list = STATIC_CAST(malList, program);
+    for (int i = 1; i < list->count() - 1; i++) {
+        declare(list->item(i));
+    }
+    for (int i = 1; i < list->count() - 1; i++) {
+        topLevel(list->item(i));
+    }
+}
+
+//  Note the names a top-level form defines, so that calls to a function
+//  before its def! can be compiled, as long as no defmacro! uses the name.
+void Translator::declare(const malValuePtr& form)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || (list->count() < 2)) {
+        return;
+    }
+    const malSymbol* name = DYNAMIC_CAST(malSymbol, list->item(1));
+    if (isSymbol(list->item(0), s_do)) {
+        for (int i = 1; i < list->count(); i++) {
+            declare(list->item(i));
+        }
+    }
+    else if (name && isSymbol(list->item(0), s_def)) {
+        m_functionNames.insert(name->identity());
+    }
+    else if (name && isSymbol(list->item(0), s_defmacro)) {
+        m_macroNames.insert(name->identity());
+    }
+}
+
+void Translator::topLevel(const malValuePtr& form)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    const malSymbol* head = list && !list->isEmpty()
+                          ? DYNAMIC_CAST(malSymbol, list->item(0)) : NULL;
+    const malSymbol* special = head ? head->identity() : NULL;
+    int argCount = list ? list->count() - 1 : 0;
+
+    if ((special == s_do) && (argCount > 0)) {
+        for (int i = 1; i <= argCount; i++) {
+            topLevel(list->item(i));
+        }
+        return;
+    }
+
+    if (((special == s_loadFile) || (special == s_loadFileOnce)) &&
+        (argCount == 1) && (list->item(1).type() == TYPE_STRING)) {
+        String path = STATIC_CAST(malString, list->item(1))->value();
+        String text;
+        if ((special == s_loadFileOnce) && m_loaded.count(path)) {
+            return;
+        }
+        if (readFile(path, text)) {
+            line("// " + path);
+            compileFile(path);
+            return;
+        }
+    }
+
+    if (special == s_defmacro) {
+        evalNow(form);
+        fallback(form);
+        return;
+    }
+
+    size_t mark = m_program.size();
+    try {
+        if ((special == s_def) && (argCount == 2) &&
+            (list->item(1).type() == TYPE_SYMBOL)) {
+            const malSymbol* name = STATIC_CAST(malSymbol, list->item(1));
+            evalNow(form);
+            String value = compileInit(list->item(2), name);
+            line(global(name) + ".set(" + value + ");");
+        }
+        else {
+            discard(expr(form));
+        }
+    }
+    catch (Unsupported&) {
+        abandon(mark, form);
+    }
+    catch (String&) {
+        abandon(mark, form);
+    }
+}
+
+//  Throw away what was compiled of form, from mark in the program, and leave
+//  it to the interpreter instead.
+void Translator::abandon(size_t mark, const malValuePtr& form)
+{
+    m_program.resize(mark);
+    m_out = &m_program;
+    m_indent = 1;
+    m_scopes.clear();
+    m_stack.clear();
+    fallback(form);
+}
+
+//  Leave form to the interpreter.
+void Translator::fallback(const malValuePtr& form)
+{
+    line("EVAL(" + constant(form) + ", env);");
+}
+
+//  Evaluate a top-level def! or defmacro! in malc's own environment, so
+//  that later forms can be compiled against it. If it fails, it's still
+//  known that the name isn't a macro.
+void Translator::evalNow(const malValuePtr& form)
+{
+    try {
+        EVAL(form, m_env);
+    }
+    catch (String&) {
+        m_env->set(STATIC_CAST(malSymbol,
+                   STATIC_CAST(malList, form)->item(1)), mal::nilValue());
+    }
+    catch (malValuePtr&) {
+        m_env->set(STATIC_CAST(malSymbol,
+                   STATIC_CAST(malList, form)->item(1)), mal::nilValue());
+    }
+}
+
+//  Compile form, and return a C++ expression for its value.
+String Translator::expr(const malValuePtr& form)
+{
+    if (form.isInteger()) {
+        return constant(form);
+    }
+    switch (form.type()) {
+        case TYPE_SYMBOL:
+            return compileSymbol(STATIC_CAST(malSymbol, form));
+
+        case TYPE_LIST:
+            return compileList(form, false);
+
+        case TYPE_VECTOR:
+            return compileSequence(STATIC_CAST(malSequence, form), true);
+
+        case TYPE_HASH:
+            return compileHash(STATIC_CAST(malHash, form));
+
+        default:
+            return constant(form);
+    }
+}
+
+//  Compile form in tail position, as statements which return its value.
+void Translator::ret(const malValuePtr& form)
+{
+    if (form.type() == TYPE_LIST) {
+        compileList(form, true);
+    }
+    else {
+        line("return " + expr(form) + ";");
+    }
+}
+
+String Translator::result(const String& value, bool isTail)
+{
+    if (isTail) {
+        line("return " + value + ";");
+    }
+    return value;
+}
+
+//  Evaluate a value which isn't used, if it has any effect.
+void Translator::discard(const String& value)
+{
+    if (value.find('(') != String::npos) {
+        line(value + ";");
+    }
+}
+
+String Translator::compileList(const malValuePtr& form, bool isTail)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    if (list->isEmpty()) {
+        return result(constant(form), isTail);
+    }
+
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        String value;
+        try {
+            if (compileSpecial(symbol->identity(), list, isTail, value)) {
+                return value;
+            }
+        }
+        catch (String&) {
+            throw Unsupported(); // leave the error for the interpreter
+        }
+
+        if (!isLocal(symbol)) {
+            if (const malLambda* macro = macroFor(symbol)) {
+                malValuePtr expansion;
+                try {
+                    expansion = macro->apply(list->begin() + 1, list->end());
+                }
+                catch (String&) {
+                    throw Unsupported();
+                }
+                catch (malValuePtr&) {
+                    throw Unsupported();
+                }
+                if (isTail) {
+                    ret(expansion);
+                    return String();
+                }
+                return expr(expansion);
+            }
+
+            // Anything else might be a macro defined later.
+            const malSymbol* name = symbol->identity();
+            if (!m_env->lookup(symbol) &&
+                (!m_functionNames.count(name) || m_macroNames.count(name))) {
+                throw Unsupported();
+            }
+        }
+    }
+    return compileCall(list, isTail);
+}
+
+//  Compile a special form into value, or return false if it isn't one.
+bool Translator::compileSpecial(const malSymbol* special,
+                                const malList* list, bool isTail,
+                                String& value)
+{
+    int argCount = list->count() - 1;
+
+    if ((special == s_def) || (special == s_defmacro) ||
+        (special == s_macroexpand)) {
+        throw Unsupported();
+    }
+
+    if (special == s_do) {
+        value = compileDo(list, isTail);
+        return true;
+    }
+
+    if (special == s_fn) {
+        value = result(compileFn(list, NULL), isTail);
+        return true;
+    }
+
+    if (special == s_if) {
+        value = compileIf(list, isTail);
+        return true;
+    }
+
+    if (special == s_let) {
+        value = compileLet(list, isTail);
+        return true;
+    }
+
+    if (special == s_quasiquoteexpand) {
+        checkArgsIs("quasiquote", 1, argCount);
+        value = result(constant(quasiquote(list->item(1))), isTail);
+        return true;
+    }
+
+    if (special == s_quasiquote) {
+        checkArgsIs("quasiquote", 1, argCount);
+        value = compileQuasiquote(list->item(1), isTail);
+        return true;
+    }
+
+    if (special == s_quote) {
+        checkArgsIs("quote", 1, argCount);
+        value = result(constant(list->item(1)), isTail);
+        return true;
+    }
+
+    if (special == s_try) {
+        value = compileTry(list, isTail);
+        return true;
+    }
+
+    return false;
+}
+
+String Translator::compileCall(const malList* list, bool isTail)
+{
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    String op = temp("t");
+    line("malValuePtr " + op + " = " + expr(list->item(0)) + ";");
+
+    Function* function = m_stack.empty() ? NULL : m_stack.back();
+    bool isSelf = isTail && function && head &&
+                  (head->identity() == function->self);
+
+    // The arguments of a call with two are written out twice, once for
+    // applyInline and once for the call, so they must be simple variables.
+    bool isBinary = (list->count() == 3);
+
+    std::vector<String> args;
+    for (int i = 1; i < list->count(); i++) {
+        String arg = expr(list->item(i));
+        bool isSimple = (arg[0] == 't') || (arg[0] == 'k') ||
+                        (!isSelf && (arg[0] == 'v'));
+        if ((isSelf || isBinary) && !isSimple) {
+            // A self tail call assigns these to the parameters, so they
+            // mustn't be the parameters.
+            String var = temp("t");
+            line("malValuePtr " + var + " = " + arg + ";");
+            arg = var;
+        }
+        args.push_back(arg);
+    }
+    String vec = temp("t");
+    String init;
+    for (auto it = args.begin(); it != args.end(); ++it) {
+        init += (it == args.begin() ? " { " : ", ") + *it;
+    }
+    init += args.empty() ? "" : " }";
+
+    String inlined;
+    if (isBinary) {
+        inlined = "applyInline(" + op + ", " + args[0] + ", " + args[1] + ")";
+    }
+
+    if (!isTail || !function) {
+        // The arguments go on the value stack, for as long as the call.
+        String value = temp("t");
+        if (isBinary) {
+            line("malValuePtr " + value + " = " + inlined + ";");
+            line("if (!" + value + ") {");
+        }
+        else {
+            line("malValuePtr " + value + ";");
+            line("{");
+        }
+        m_indent++;
+        line("malStackFrame " + vec + ";");
+        for (auto it = args.begin(); it != args.end(); ++it) {
+            line(vec + ".push(" + *it + ");");
+        }
+        line(value + " = malNativeCall(" + op + ", " +
+             vec + ".begin(), " + vec + ".end());");
+        m_indent--;
+        line("}");
+        return result(value, isTail);
+    }
+
+    if (isSelf) {
+        // Which way this loops depends on whether the function turns out
+        // to need its frame, so write both and choose when it's done.
+        SelfCall call;
+        call.canAssign = (function->arity == (int)args.size());
+        for (size_t i = 0; call.canAssign && (i < args.size()); i++) {
+            call.assign += function->params[i] + " = " + args[i] + "; ";
+        }
+        call.rebuild = "malValueVec a" + init + "; "
+                       "env = STATIC_CAST(malLambda, " + op + ")"
+                       "->makeEnv(a.data(), a.data() + a.size()); ";
+        for (size_t i = 0; i < function->params.size(); i++) {
+            call.rebuild += STRF("%s = env->slot(%d); ",
+                                 function->params[i].c_str(), (int)i);
+        }
+        function->selfCalls.push_back(call);
+        line(STRF("if (malNativeIsCode(%s, c[%d])) {",
+                  op.c_str(), function->index));
+        line(STRF("    @%d@continue;",
+                  (int)function->selfCalls.size() - 1));
+        line("}");
+    }
+    if (isBinary) {
+        String value = temp("t");
+        line("if (malValuePtr " + value + " = " + inlined + ") {");
+        line("    return " + value + ";");
+        line("}");
+    }
+    line("malValueVec " + vec + init + ";");
+    line("return malNativeTailCall(" + op + ", " + vec + ", tail);");
+    return String();
+}
+
+String Translator::compileDo(const malList* list, bool isTail)
+{
+    int argCount = checkArgsAtLeast("do", 1, list->count() - 1);
+    for (int i = 1; i < argCount; i++) {
+        discard(expr(list->item(i)));
+    }
+    if (isTail) {
+        ret(list->item(argCount));
+        return String();
+    }
+    return expr(list->item(argCount));
+}
+
+String Translator::compileIf(const malList* list, bool isTail)
+{
+    int argCount = checkArgsBetween("if", 2, 3, list->count() - 1);
+    String test = expr(list->item(1));
+    String value = isTail ? String() : temp("t");
+    if (!isTail) {
+        line("malValuePtr " + value + ";");
+    }
+    line("if (" + test + ".isTrue()) {");
+    m_indent++;
+    if (isTail) {
+        ret(list->item(2));
+    }
+    else {
+        line(value + " = " + expr(list->item(2)) + ";");
+    }
+    m_indent--;
+    line("}");
+    line("else {");
+    m_indent++;
+    if (argCount == 2) {
+        line((isTail ? "return " : value + " = ") + "mal::nilValue();");
+    }
+    else if (isTail) {
+        ret(list->item(3));
+    }
+    else {
+        line(value + " = " + expr(list->item(3)) + ";");
+    }
+    m_indent--;
+    line("}");
+    return value;
+}
+
+String Translator::compileLet(const malList* list, bool isTail)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+    malFrameLayoutPtr frame(new malFrameLayout);
+    std::vector<int> slots;
+    for (int i = 0; i < count; i += 2) {
+        slots.push_back(frame->add(VALUE_CAST(malSymbol, bindings->item(i))));
+    }
+
+    pushFrame(frame, mayClose(list->item(1)) || mayClose(list->item(2)));
+    for (int i = 0; i < count; i += 2) {
+        const malSymbol* name = STATIC_CAST(malSymbol, bindings->item(i));
+        bind(name, slots[i / 2], compileInit(bindings->item(i + 1), name));
+    }
+    String value;
+    if (isTail) {
+        ret(list->item(2));
+    }
+    else {
+        value = expr(list->item(2));
+    }
+    popScope();
+    return value;
+}
+
+String Translator::compileTry(const malList* list, bool isTail)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        if (isTail) {
+            ret(list->item(1));
+            return String();
+        }
+        return expr(list->item(1));
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol,
+        catchBlock->item(0))->identity() == s_catch,
+        "catch block must begin with catch*");
+    const malSymbol* name = VALUE_CAST(malSymbol, catchBlock->item(1));
+
+    String value = temp("t");
+    String exception = temp("t");
+    line("malValuePtr " + value + ", " + exception + ";");
+    line("try {");
+    m_indent++;
+    line(value + " = " + expr(list->item(1)) + ";");
+    m_indent--;
+    line("}");
+    line("catch (String& s) {");
+    line("    " + exception + " = mal::string(s);");
+    line("}");
+    line("catch (malEmptyInputException&) {");
+    line("    " + value + " = mal::nilValue();");
+    line("}");
+    line("catch (malValuePtr& o) {");
+    line("    " + exception + " = o;");
+    line("}");
+    line("if (" + exception + ") {");
+    m_indent++;
+    malFrameLayoutPtr frame(new malFrameLayout);
+    frame->add(name);
+    pushFrame(frame, mayClose(catchBlock->item(2)));
+    bind(name, 0, exception);
+    if (isTail) {
+        ret(catchBlock->item(2));
+    }
+    else {
+        line(value + " = " + expr(catchBlock->item(2)) + ";");
+    }
+    popScope();
+    m_indent--;
+    line("}");
+    return result(value, isTail);
+}
+
+String Translator::compileFn(const malList* list, const malSymbol* self)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    malSymbolVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        params.push_back(VALUE_CAST(malSymbol, bindings->item(i)));
+    }
+    malFrameLayoutPtr frame(new malFrameLayout(params));
+
+    Function function;
+    function.index = m_functions.size();
+    function.self = self;
+    function.arity = frame->isVariadic() ? -1 : frame->count();
+    function.usesEnv = false;
+    m_functions.push_back(String());
+
+    // Whatever captures this function's frame captures the enclosing one.
+    if (!m_stack.empty()) {
+        m_stack.back()->usesEnv = true;
+    }
+
+    // The parameters are read once, before the loop which self tail calls
+    // go round.
+    String* savedOut = m_out;
+    int savedIndent = m_indent;
+    String prologue, body;
+    m_stack.push_back(&function);
+    pushScope(frame, "env");
+    m_out = &prologue;
+    m_indent = 1;
+    for (int i = 0; i < frame->count(); i++) {
+        function.params.push_back(bind(frame->name(i), i,
+                                       STRF("env->slot(%d)", i)));
+    }
+    m_out = &body;
+    m_indent = 2;
+    ret(list->item(2));
+    popScope();
+    m_stack.pop_back();
+    m_out = savedOut;
+    m_indent = savedIndent;
+
+    for (size_t i = 0; i < function.selfCalls.size(); i++) {
+        const SelfCall& call = function.selfCalls[i];
+        bool canAssign = call.canAssign && !function.usesEnv;
+        String marker = STRF("@%d@", (int)i);
+        body.replace(body.find(marker), marker.size(),
+                     canAssign ? call.assign : call.rebuild);
+    }
+
+    m_functions[function.index] =
+        STRF("static malValuePtr f%d(malEnvPtr env, malNativeTail& tail)\n"
+             "{\n", function.index) +
+        prologue + "    while (1) {\n" + body + "    }\n}\n";
+
+    return STRF("mal::lambda(%s, %s, %s, c[%d])",
+                layout(frame, true).c_str(),
+                constant(list->item(2)).c_str(),
+                envVar().c_str(), function.index);
+}
+
+//  Compile the value for a def! or let* binding of name. A fn* there knows
+//  its own name, so it can loop to make tail calls to itself.
+String Translator::compileInit(const malValuePtr& form, const malSymbol* name)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (list && !list->isEmpty() && isSymbol(list->item(0), s_fn)) {
+        try {
+            return compileFn(list, name->identity());
+        }
+        catch (String&) {
+            throw Unsupported();
+        }
+    }
+    return expr(form);
+}
+
+String Translator::compileSymbol(const malSymbol* symbol)
+{
+    const malSymbol* name = symbol->identity();
+    int function = m_stack.size() - 1;
+    int depth = 0;
+    for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); ++scope) {
+        if (scope->function == function) {
+            for (auto it = scope->bindings.rbegin();
+                 it != scope->bindings.rend(); ++it) {
+                if ((it->name == name) && it->ready) {
+                    return it->var;
+                }
+            }
+        }
+        else if (!scope->frame.empty()) {
+            int slot = scope->layout->slotOf(name);
+            if (slot >= 0) {
+                m_stack.back()->usesEnv = true;
+                return STRF("malNativeSlot(%s.ptr(), %d, %d, %s)",
+                            envVar().c_str(), depth, slot,
+                            constant(const_cast<malSymbol*>(symbol))
+                                .c_str());
+            }
+        }
+        if (!scope->frame.empty()) {
+            depth++;
+        }
+    }
+    return global(symbol) + ".get()";
+}
+
+//  A quasiquote is built by a template, which fills its holes from a vector
+//  of their values.
+String Translator::compileQuasiquote(const malValuePtr& form, bool isTail)
+{
+    malTemplatePtr quasi(new malTemplate(form));
+    if (malValuePtr unquoted = quasi->unquoted()) {
+        if (isTail) {
+            ret(unquoted);
+            return String();
+        }
+        return expr(unquoted);
+    }
+    String vec = temp("t");
+    line("malValueVec " + vec + ";");
+    for (int i = 0; i < quasi->holeCount(); i++) {
+        line(vec + ".push_back(" + expr(quasi->hole(i)) + ");");
+    }
+    return result(STRF("%s->build(%s.data())",
+                       this->quasi(form).c_str(), vec.c_str()), isTail);
+}
+
+String Translator::compileSequence(const malSequence* seq, bool isVector)
+{
+    std::vector<String> items;
+    for (int i = 0; i < seq->count(); i++) {
+        items.push_back(expr(seq->item(i)));
+    }
+    String vec = temp("t");
+    String text = "malValueVec* " + vec + " = new malValueVec {";
+    for (auto it = items.begin(); it != items.end(); ++it) {
+        text += (it == items.begin() ? " " : ", ") + *it;
+    }
+    line(text + " };");
+    return STRF("mal::%s(%s)", isVector ? "vector" : "list", vec.c_str());
+}
+
+String Translator::compileHash(const malHash* hash)
+{
+    if (hash->isEvaluated()) {
+        return constant(const_cast<malHash*>(hash));
+    }
+    malValueVec items;
+    hash->entries(items);
+    String vec = temp("t");
+    line("malValueVec " + vec + ";");
+    for (auto it = items.begin(); it != items.end(); it += 2) {
+        line(vec + ".push_back(" + constant(it[0]) + ");");
+        line(vec + ".push_back(" + expr(it[1]) + ");");
+    }
+    return STRF("mal::hash(%s.data(), %s.data() + %s.size(), true)",
+                vec.c_str(), vec.c_str(), vec.c_str());
+}
+
+//  Add a scope to the function being compiled, whose frame, if it has one,
+//  is in the C++ variable frame.
+void Translator::pushScope(const malFrameLayoutPtr& layout,
+                           const String& frame)
+{
+    Scope scope;
+    scope.function = m_stack.size() - 1;
+    scope.frame = frame;
+    scope.layout = layout;
+    m_scopes.push_back(scope);
+}
+
+//  Add a scope for a let* or catch*, making its frame now if it needs one.
+void Translator::pushFrame(const malFrameLayoutPtr& layout, bool hasFrame)
+{
+    String frame;
+    if (hasFrame) {
+        frame = temp("e");
+        line(STRF("malEnvPtr %s(new malEnv(%s, %s));", frame.c_str(),
+                  envVar().c_str(), this->layout(layout, false).c_str()));
+        if (!m_stack.empty()) {
+            m_stack.back()->usesEnv = true;
+        }
+    }
+    pushScope(layout, frame);
+}
+
+//  Bind name in the innermost scope to a new variable with value, and
+//  return the variable.
+String Translator::bind(const malSymbol* name, int slot, const String& value)
+{
+    Scope& scope = m_scopes.back();
+    Binding binding = { name->identity(), temp("v"), slot, true };
+    line("malValuePtr " + binding.var + " = " + value + ";");
+    if (!scope.frame.empty() && (scope.frame != "env")) {
+        line(STRF("%s->setSlot(%d, %s);",
+                  scope.frame.c_str(), slot, binding.var.c_str()));
+    }
+    scope.bindings.push_back(binding);
+    return binding.var;
+}
+
+//  Whether anything in form might capture the frame it runs in. Macros
+//  might expand to a fn*.
+bool Translator::mayClose(const malValuePtr& form) const
+{
+    if (form.isInteger()) {
+        return false;
+    }
+    switch (form.type()) {
+        case TYPE_LIST: {
+            const malList* list = STATIC_CAST(malList, form);
+            if (list->isEmpty() || isSymbol(list->item(0), s_quote)) {
+                return false;
+            }
+            if (isSymbol(list->item(0), s_fn)) {
+                return true;
+            }
+            if (const malSymbol* head = DYNAMIC_CAST(malSymbol,
+                                                     list->item(0))) {
+                if (macroFor(head)) {
+                    return true;
+                }
+            }
+            // fall through
+        }
+        case TYPE_VECTOR: {
+            const malSequence* seq = STATIC_CAST(malSequence, form);
+            for (int i = 0; i < seq->count(); i++) {
+                if (mayClose(seq->item(i))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        case TYPE_HASH: {
+            malValueVec items;
+            STATIC_CAST(malHash, form)->entries(items);
+            for (auto it = items.begin(); it != items.end(); ++it) {
+                if (mayClose(*it)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        default:
+            return false;
+    }
+}
+
+const malLambda* Translator::macroFor(const malSymbol* symbol) const
+{
+    if (isLocal(symbol)) {
+        return NULL;
+    }
+    malValuePtr value = m_env->lookup(symbol);
+    const malLambda* lambda = value ? DYNAMIC_CAST(malLambda, value) : NULL;
+    return (lambda && lambda->isMacro()) ? lambda : NULL;
+}
+
+//  Whether symbol names a local, including one which isn't ready yet, as
+//  that still shadows any macro with the same name.
+bool Translator::isLocal(const malSymbol* symbol) const
+{
+    for (auto scope = m_scopes.begin(); scope != m_scopes.end(); ++scope) {
+        if (scope->layout->slotOf(symbol) >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+String Translator::constant(const malValuePtr& value)
+{
+    if (!isReadable(value)) {
+        throw Unsupported();
+    }
+    String text = value->print(true);
+    auto it = m_constIndex.find(text);
+    if (it != m_constIndex.end()) {
+        return STRF("k[%d]", it->second);
+    }
+    int index = m_consts.size();
+    m_consts.push_back(text);
+    m_constIndex[text] = index;
+    return STRF("k[%d]", index);
+}
+
+String Translator::global(const malSymbol* symbol)
+{
+    const String& name = symbol->value();
+    auto it = m_globalIndex.find(name);
+    if (it != m_globalIndex.end()) {
+        return STRF("g[%d]", it->second);
+    }
+    int index = m_globals.size();
+    m_globals.push_back(name);
+    m_globalIndex[name] = index;
+    return STRF("g[%d]", index);
+}
+
+String Translator::layout(const malFrameLayoutPtr& layout, bool isParams)
+{
+    malValueVec* names = new malValueVec;
+    for (int i = 0; i < layout->count(); i++) {
+        if (layout->isVariadic() && (i == layout->count() - 1)) {
+            names->push_back(mal::symbol("&"));
+        }
+        names->push_back(const_cast<malSymbol*>(layout->name(i)));
+    }
+    m_layouts.push_back(STRF("malNativeLayout(%s, %s)",
+                             constant(mal::list(names)).c_str(),
+                             isParams ? "true" : "false"));
+    return STRF("l[%d]", (int)m_layouts.size() - 1);
+}
+
+String Translator::quasi(const malValuePtr& form)
+{
+    m_templates.push_back(STRF("new malTemplate(%s)",
+                               constant(form).c_str()));
+    return STRF("q[%d]", (int)m_templates.size() - 1);
+}
+
+//  The innermost frame, which is the one a fn* captures.
+String Translator::envVar() const
+{
+    for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); ++scope) {
+        if (!scope->frame.empty()) {
+            return scope->frame;
+        }
+    }
+    return "env";
+}
+
+String Translator::temp(const char* prefix)
+{
+    return STRF("%s%d", prefix, m_tempCount++);
+}
+
+void Translator::line(const String& text)
+{
+    *m_out += String(m_indent * 4, ' ') + text + "\n";
+}
+
+void Translator::write(std::ostream& out)
+{
+    out << "// Compiled by malc from " << m_source << "\n"
+        << "\n"
+        << "#include \"Compiler.h\"\n"
+        << "#include \"Native.h\"\n"
+        << "\n"
+        << "static malValuePtr k[" << m_consts.size() + 1 << "];\n"
+        << "static malNativeGlobal g[" << m_globals.size() + 1 << "];\n"
+        << "static malFrameLayoutPtr l[" << m_layouts.size() + 1 << "];\n"
+        << "static malTemplatePtr q[" << m_templates.size() + 1 << "];\n"
+        << "static malCodePtr c[" << m_functions.size() + 1 << "];\n"
+        << "\n";
+    // A function is left empty if the form it was in couldn't be compiled.
+    for (size_t i = 0; i < m_functions.size(); i++) {
+        if (!m_functions[i].empty()) {
+            out << "static malNativeBody f" << i << ";\n";
+        }
+    }
+    out << "\n"
+        << "static void program(malEnvPtr env)\n"
+        << "{\n";
+    for (size_t i = 0; i < m_consts.size(); i++) {
+        out << "    k[" << i << "] = readStr("
+            << cppString(m_consts[i]) << ");\n";
+    }
+    for (size_t i = 0; i < m_globals.size(); i++) {
+        out << "    g[" << i << "].init(env, mal::symbol("
+            << cppString(m_globals[i]) << "));\n";
+    }
+    for (size_t i = 0; i < m_layouts.size(); i++) {
+        out << "    l[" << i << "] = " << m_layouts[i] << ";\n";
+    }
+    for (size_t i = 0; i < m_templates.size(); i++) {
+        out << "    q[" << i << "] = " << m_templates[i] << ";\n";
+    }
+    for (size_t i = 0; i < m_functions.size(); i++) {
+        if (!m_functions[i].empty()) {
+            out << "    c[" << i << "] = new malNativeCode(f" << i << ");\n";
+        }
+    }
+    out << "\n" << m_program << "}\n";
+    for (size_t i = 0; i < m_functions.size(); i++) {
+        if (!m_functions[i].empty()) {
+            out << "\n" << m_functions[i];
+        }
+    }
+    out << "\n"
+        << "int main(int argc, char* argv[])\n"
+        << "{\n"
+        << "    return malNativeMain(argc, argv, program);\n"
+        << "}\n";
+}
+
+int main(int argc, char* argv[])
+{
+    const char* input = NULL;
+    const char* output = NULL;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-o") == 0) && (i + 1 < argc)) {
+            output = argv[++i];
+        }
+        else if (!input) {
+            input = argv[i];
+        }
+        else {
+            input = NULL;
+            break;
+        }
+    }
+    if (!input) {
+        std::cerr << "Usage: malc input.mal [-o output.cpp]\n";
+        return 1;
+    }
+
+    try {
+        Translator translator(nativeStartup(0, NULL), input);
+        translator.compileFile(input);
+        if (output) {
+            std::ofstream file(output);
+            translator.write(file);
+            MAL_CHECK(file.good(), "Couldn't write %s", output);
+        }
+        else {
+            translator.write(std::cout);
+        }
+    }
+    catch (malValuePtr& mv) {
+        std::cerr << "malc: " << mv->print(true) << "\n";
+        return 1;
+    }
+    catch (String& s) {
+        std::cerr << "malc: " << s << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -85,7 +85,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     // Now we're left with the case of a regular list to be evaluated.
     std::unique_ptr<malValueVec> items(list->evalItems(env));
     malValuePtr op = items->at(0);
-    return APPLY(op, items->begin()+1, items->end());
+    return APPLY(op, items->data()+1, items->data() + items->size());
 }
 
 String PRINT(malValuePtr ast)
@@ -123,10 +123,11 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     malValuePtr op = items->at(0);
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
         return EVAL(lambda->getBody(),
-                    lambda->makeEnv(items->begin()+1, items->end()));
+                    lambda->makeEnv(items->data()+1,
+                                    items->data() + items->size()));
     }
     else {
-        return APPLY(op, items->begin()+1, items->end());
+        return APPLY(op, items->data()+1, items->data() + items->size());
     }
 }
 
@@ -1,11 +1,14 @@
 #include "MAL.h"
 
+#include "Compiler.h"
 #include "Environment.h"
 #include "ReadLine.h"
 #include "Types.h"
 
+#include <algorithm>
+#include <exception>
 #include <iostream>
-#include <memory>
+#include <string.h>
 
 malValuePtr READ(const String& input);
 String PRINT(malValuePtr ast);
@@ -13,24 +16,204 @@ static void installFunctions(malEnvPtr env);
 //  Installs functions, macros and constants implemented in MAL.
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
+#ifndef MAL_NO_MAIN
 static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+static bool selectEngine(const char* name);
+static void printAllocStats();
+#endif
+
 
 static ReadLine s_readLine("~/.mal-history");
 
+static const malSymbol* internSymbol(const char* name)
+{
+    return STATIC_CAST(malSymbol, mal::symbol(name));
+}
+
+// Special forms are recognised by the identity of their interned symbol.
+static const malSymbol* const s_catch = internSymbol("catch*");
+static const malSymbol* const s_def = internSymbol("def!");
+static const malSymbol* const s_defmacro = internSymbol("defmacro!");
+static const malSymbol* const s_do = internSymbol("do");
+static const malSymbol* const s_fn = internSymbol("fn*");
+static const malSymbol* const s_if = internSymbol("if");
+static const malSymbol* const s_let = internSymbol("let*");
+static const malSymbol* const s_macroexpand = internSymbol("macroexpand");
+static const malSymbol* const s_quasiquote = internSymbol("quasiquote");
+static const malSymbol* const s_quasiquoteexpand =
+    internSymbol("quasiquoteexpand");
+static const malSymbol* const s_quote = internSymbol("quote");
+static const malSymbol* const s_spliceUnquote = internSymbol("splice-unquote");
+static const malSymbol* const s_try = internSymbol("try*");
+static const malSymbol* const s_unquote = internSymbol("unquote");
+
+//  What EVAL keeps with a list: the analysis of a special form, the
+//  expansion of a macro call, or a compiled quasiquote. A list is only
+//  ever one of those at a time, but that can change if a macro is given the
+//  name of a special form, so each kind checks the info is its own.
+class EvalInfo : public malFormInfo {
+public:
+    enum Kind { FORM, EXPANSION, TEMPLATE };
+
+    Kind kind() const { return m_kind; }
+
+protected:
+    EvalInfo(Kind kind) : m_kind(kind) { }
+
+private:
+    const Kind m_kind;
+};
+
+//  Scope analysis. Each fn*, let* and catch* form is analysed the first
+//  time it is evaluated, and its body rewritten so that every symbol which
+//  names a local is a malLocalRef, which finds its value without searching
+//  by name, and every other symbol is a malGlobalRef, which caches the
+//  global it finds. Forms nested in the body are analysed at the same time,
+//  so the whole of a function is done once, when it is first created.
+class FormInfo : public EvalInfo {
+public:
+    FormInfo(const malFrameLayoutPtr& layout, const malFrameLayoutPtr& outer)
+        : EvalInfo(FORM), m_layout(layout), m_outer(outer) { }
+
+    //  The layout of the frame the form creates, and of the frame it was
+    //  analysed in. It must be analysed again if it's evaluated elsewhere.
+    const malFrameLayoutPtr& layout() const { return m_layout; }
+    const malFrameLayoutPtr& outer() const { return m_outer; }
+
+    malValuePtr body() const { return m_body; }
+    void setBody(malValuePtr body) { m_body = body; }
+
+    //  The initialisers of a let*, and the slots they set.
+    int initCount() const { return m_inits.size(); }
+    malValuePtr init(int index) const { return m_inits[index]; }
+    int initSlot(int index) const { return m_initSlots[index]; }
+
+    void addInit(int slot, malValuePtr init) {
+        m_initSlots.push_back(slot);
+        m_inits.push_back(init);
+    }
+
+private:
+    const malFrameLayoutPtr m_layout;
+    const malFrameLayoutPtr m_outer;
+    malValuePtr             m_body;
+    malValueVec             m_inits;
+    std::vector<int>        m_initSlots;
+};
+
+//  The expansion of a macro call, which is good for as long as the call
+//  finds the same macro. The macro is kept alive, so that a new one can't
+//  be mistaken for it.
+class ExpansionInfo : public EvalInfo {
+public:
+    ExpansionInfo(const malLambda* macro, malValuePtr expansion)
+        : EvalInfo(EXPANSION)
+        , m_macro(const_cast<malLambda*>(macro))
+        , m_expansion(expansion) { }
+
+    bool isExpansionBy(const malLambda* macro) const {
+        return m_macro.ptr() == macro;
+    }
+    malValuePtr expansion() const { return m_expansion; }
+
+private:
+    const malValuePtr m_macro;
+    const malValuePtr m_expansion;
+};
+
+class TemplateInfo : public EvalInfo {
+public:
+    TemplateInfo(const malValuePtr& form)
+        : EvalInfo(TEMPLATE), m_template(new malTemplate(form)) { }
+
+    const malTemplate* get() const { return m_template.ptr(); }
+
+private:
+    const malTemplatePtr m_template;
+};
+
+static const FormInfo* analyse(const malList* form, const malEnvPtr& env);
+static malValuePtr expandCached(malValuePtr ast, const malEnvPtr& env);
+static const malTemplate* compileQuasiquote(const malList* form);
+
 static malEnvPtr replEnv(new malEnv);
 
+//  The engine which EVAL hands each form to, or NULL to walk the form here.
+typedef malValuePtr (EngineFunc)(malValuePtr ast, malEnvPtr env);
+static EngineFunc* s_engine = NULL;
+
+//  Set up the environment, for main() or for a program which malc has
+//  compiled.
+malEnvPtr nativeStartup(int argc, char* argv[])
+{
+    installCore(replEnv);
+    installFunctions(replEnv);
+    makeArgv(replEnv, argc, argv);
+    return replEnv;
+}
+
+#ifndef MAL_NO_MAIN
 int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
-    installCore(replEnv);
-    installFunctions(replEnv);
-    makeArgv(replEnv, argc - 2, argv + 2);
-    if (argc > 1) {
-        String filename = escape(argv[1]);
+    const char* dumpImage = NULL;
+    const char* image = NULL;
+    int argi = 1;
+    for ( ; argc > argi; argi++) {
+        if (strncmp(argv[argi], "--engine=", 9) == 0) {
+            if (!selectEngine(argv[argi] + 9)) {
+                std::cerr << "Unknown engine: " << argv[argi] + 9 << "\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argi], "--alloc-stats") == 0) {
+            atexit(printAllocStats);
+        }
+        else if ((strcmp(argv[argi], "--dump-image") == 0) &&
+                 (argc > argi + 1)) {
+            dumpImage = argv[++argi];
+        }
+        else if ((strcmp(argv[argi], "--image") == 0) &&
+                 (argc > argi + 1)) {
+            image = argv[++argi];
+        }
+        else {
+            break;
+        }
+    }
+    if (image) {
+        try {
+            loadImage(image, replEnv);
+        }
+        catch (String& s) {
+            std::cerr << "Error: " << s << "\n";
+            return 1;
+        }
+        catch (std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        makeArgv(replEnv, argc - argi - 1, argv + argi + 1);
+    }
+    else {
+        nativeStartup(argc - argi - 1, argv + argi + 1);
+    }
+    if (argc > argi) {
+        String filename = escape(argv[argi]);
         safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+    }
+    if (dumpImage) {
+        try {
+            saveImage(dumpImage, replEnv);
+        }
+        catch (String& s) {
+            std::cerr << "Error: " << s << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > argi) {
         return 0;
     }
     rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
@@ -58,6 +241,47 @@ static String safeRep(const String& input, malEnvPtr env)
     };
 }
 
+static bool selectEngine(const char* name)
+{
+    struct Engine {
+        const char* name;
+        EngineFunc* eval;
+    };
+    static const Engine engineTable[] = {
+        { "tree",     NULL },
+        { "closure",  compileAndRun },
+        { "bytecode", runBytecode },
+    };
+
+    for (auto &engine : engineTable) {
+        if (strcmp(name, engine.name) == 0) {
+            s_engine = engine.eval;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void printAllocStats()
+{
+    const malAllocator::Stats& stats = malAllocator::stats();
+    std::cerr << "allocations: " << stats.allocations
+              << ", frees: " << stats.frees
+              << ", system allocations: " << stats.systemAllocations
+              << "\n";
+
+    const malCollector::Stats& collected = malCollector::stats();
+    std::cerr << "collections: " << collected.collections
+              << ", objects freed: " << collected.objects
+              << ", bytes freed: " << collected.bytes
+              << ", bytes in use: " << stats.bytesInUse
+              << "\n"
+              << "pause: " << collected.pauseMicros
+              << "us, longest: " << collected.maxPauseMicros
+              << "us\n";
+}
+#endif // MAL_NO_MAIN
+
 static void makeArgv(malEnvPtr env, int argc, char* argv[])
 {
     malValueVec* args = new malValueVec();
@@ -82,40 +306,46 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     if (!env) {
         env = replEnv;
     }
+    if (s_engine) {
+        return s_engine(ast, env);
+    }
     while (1) {
+        if (ast.isInteger()) {
+            return ast;
+        }
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
         }
 
-        ast = macroExpand(ast, env);
+        ast = expandCached(ast, env);
         list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+            return ast.isInteger() ? ast : ast->eval(env);
         }
 
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
+            const malSymbol* special = symbol->identity();
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
+            if (special == s_def) {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                return env->set(id, EVAL(list->item(2), env));
             }
 
-            if (special == "defmacro!") {
+            if (special == s_defmacro) {
                 checkArgsIs("defmacro!", 2, argCount);
 
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 malValuePtr body = EVAL(list->item(2), env);
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+                return env->set(id, mal::macro(*lambda));
             }
 
-            if (special == "do") {
+            if (special == s_do) {
                 checkArgsAtLeast("do", 1, argCount);
 
                 for (int i = 1; i < argCount; i++) {
@@ -125,25 +355,17 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "fn*") {
+            if (special == s_fn) {
                 checkArgsIs("fn*", 2, argCount);
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
-
-                return mal::lambda(params, list->item(2), env);
+                const FormInfo* info = analyse(list, env);
+                return mal::lambda(info->layout(), info->body(), env);
             }
 
-            if (special == "if") {
+            if (special == s_if) {
                 checkArgsBetween("if", 2, 3, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                bool isTrue = EVAL(list->item(1), env).isTrue();
                 if (!isTrue && (argCount == 2)) {
                     return mal::nilValue();
                 }
@@ -151,100 +373,119 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "let*") {
+            if (special == s_let) {
                 checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+
+                const FormInfo* info = analyse(list, env);
+                malEnvPtr inner(new malEnv(env, info->layout()));
+                for (int i = 0, count = info->initCount(); i < count; i++) {
+                    inner->setSlot(info->initSlot(i),
+                                   EVAL(info->init(i), inner));
                 }
-                ast = list->item(2);
+                ast = info->body();
                 env = inner;
                 continue; // TCO
             }
 
-            if (special == "macroexpand") {
+            if (special == s_macroexpand) {
                 checkArgsIs("macroexpand", 1, argCount);
                 return macroExpand(list->item(1), env);
             }
 
-            if (special == "quasiquoteexpand") {
+            if (special == s_quasiquoteexpand) {
                 checkArgsIs("quasiquote", 1, argCount);
                 return quasiquote(list->item(1));
             }
 
-            if (special == "quasiquote") {
+            if (special == s_quasiquote) {
                 checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
+
+                const malTemplate* quasi = compileQuasiquote(list);
+                if (malValuePtr unquoted = quasi->unquoted()) {
+                    ast = unquoted;
+                    continue; // TCO
+                }
+                malValueVec values;
+                values.reserve(quasi->holeCount());
+                for (int i = 0, count = quasi->holeCount(); i < count; i++) {
+                    values.push_back(EVAL(quasi->hole(i), env));
+                }
+                return quasi->build(values.data());
             }
 
-            if (special == "quote") {
+            if (special == s_quote) {
                 checkArgsIs("quote", 1, argCount);
                 return list->item(1);
             }
 
-            if (special == "try*") {
+            if (special == s_try) {
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
-                    ast = EVAL(tryBody, env);
-                    continue; // TCO
+                    return EVAL(tryBody, env);
                 }
                 checkArgsIs("try*", 2, argCount);
                 const malList* catchBlock = VALUE_CAST(malList, list->item(2));
 
                 checkArgsIs("catch*", 2, catchBlock->count() - 1);
                 MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
+                    catchBlock->item(0))->identity() == s_catch,
                     "catch block must begin with catch*");
 
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
+                // We don't need the symbol at this scope, but we want to
+                // check that the catch block is valid always, not just in
+                // case of an exception.
+                VALUE_CAST(malSymbol, catchBlock->item(1));
 
                 malValuePtr excVal;
 
                 try {
-                    ast = EVAL(tryBody, env);
+                    return EVAL(tryBody, env);
                 }
                 catch(String& s) {
                     excVal = mal::string(s);
                 }
                 catch (malEmptyInputException&) {
                     // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
+                    return mal::nilValue();
                 }
                 catch(malValuePtr& o) {
                     excVal = o;
                 };
 
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
-                }
+                // we got some exception
+                const FormInfo* info = analyse(catchBlock, env);
+                env = malEnvPtr(new malEnv(env, info->layout()));
+                env->setSlot(0, excVal);
+                ast = info->body();
                 continue; // TCO
             }
         }
 
         // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+        // Its items are evaluated onto the value stack, and are dropped
+        // from it once the call has been made.
+        malStackFrame items;
+        for (auto it = list->begin(), end = list->end(); it != end; ++it) {
+            items.push(EVAL(*it, env));
+        }
+        // Integer arithmetic and comparison don't call the builtin.
+        if (list->count() == 3) {
+            malValueIter it = items.begin();
+            if (malValuePtr value = applyInline(it[0], it[1], it[2])) {
+                return value;
+            }
+        }
+        malValuePtr op = *items.begin();
+        // A lambda with code runs it, rather than its body, through APPLY.
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (lambda && !lambda->code()) {
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            env = lambda->makeEnv(items.begin()+1, items.end());
             continue; // TCO
         }
         else {
-            return APPLY(op, items->begin()+1, items->end());
+            return APPLY(op, items.begin()+1, items.end());
         }
     }
 }
@@ -263,23 +504,23 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(malValuePtr obj, const malSymbol* symbol)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
+    return sym && (sym->identity() == symbol);
 }
 
 //  Return arg when ast matches ('sym, arg), else NULL.
-static malValuePtr starts_with(const malValuePtr ast, const char* sym)
+static malValuePtr starts_with(const malValuePtr ast, const malSymbol* sym)
 {
     const malList* list = DYNAMIC_CAST(malList, ast);
     if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
         return NULL;
-    checkArgsIs(sym, 1, list->count() - 1);
+    checkArgsIs(sym->value().c_str(), 1, list->count() - 1);
     return list->item(1);
 }
 
-static malValuePtr quasiquote(malValuePtr obj)
+malValuePtr quasiquote(malValuePtr obj)
 {
     if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
         return mal::list(mal::symbol("quote"), obj);
@@ -288,14 +529,14 @@ static malValuePtr quasiquote(malValuePtr obj)
     if (!seq)
         return obj;
 
-    const malValuePtr unquoted = starts_with(obj, "unquote");
+    const malValuePtr unquoted = starts_with(obj, s_unquote);
     if (unquoted)
         return unquoted;
 
     malValuePtr res = mal::list(new malValueVec(0));
     for (int i=seq->count()-1; 0<=i; i--) {
         const malValuePtr elt     = seq->item(i);
-        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
+        const malValuePtr spl_unq = starts_with(elt, s_spliceUnquote);
         if (spl_unq)
             res = mal::list(mal::symbol("concat"), spl_unq, res);
          else
@@ -311,18 +552,16 @@ static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
     const malList* seq = DYNAMIC_CAST(malList, obj);
     if (seq && !seq->isEmpty()) {
         if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
+            malValuePtr value = sym->lookup(env);
+            if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+                return lambda->isMacro() ? lambda : NULL;
             }
         }
     }
     return NULL;
 }
 
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
         const malSequence* seq = STATIC_CAST(malSequence, obj);
@@ -331,11 +570,301 @@ static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
     return obj;
 }
 
+class Analyser {
+public:
+    Analyser(const malEnvPtr& env);
+
+    FormInfo* analyse(const malList* form);
+
+    //  Resolve the symbols in form, which is evaluated in the frames the
+    //  analyser was made for.
+    malValuePtr rewrite(const malValuePtr& form);
+
+private:
+    FormInfo* analyseFn(const malList* form);
+    FormInfo* analyseLet(const malList* form);
+    FormInfo* analyseCatch(const malList* form);
+
+    malValuePtr rewriteList(const malValuePtr& form);
+    malValuePtr rewriteQuasi(const malValuePtr& form);
+    malValuePtr resolve(const malValuePtr& form);
+
+    malFrameLayoutPtr innermost() const {
+        return m_scopes.empty() ? malFrameLayoutPtr() : m_scopes.back();
+    }
+
+    //  The layouts of the enclosing frames, innermost last.
+    std::vector<malFrameLayoutPtr> m_scopes;
+};
+
+static const FormInfo* analyse(const malList* form, const malEnvPtr& env)
+{
+    const EvalInfo* kept = static_cast<const EvalInfo*>(form->info());
+    const FormInfo* info = (kept && (kept->kind() == EvalInfo::FORM))
+                         ? static_cast<const FormInfo*>(kept) : NULL;
+    if (!info || (info->outer() != env->layout())) {
+        Analyser analyser(env);
+        FormInfo* fresh = analyser.analyse(form);
+        form->setInfo(fresh);
+        info = fresh;
+    }
+    return info;
+}
+
+//  Return the template for the quasiquote form, compiled when it's first
+//  evaluated.
+static const malTemplate* compileQuasiquote(const malList* form)
+{
+    const EvalInfo* kept = static_cast<const EvalInfo*>(form->info());
+    if (kept && (kept->kind() == EvalInfo::TEMPLATE)) {
+        return static_cast<const TemplateInfo*>(kept)->get();
+    }
+    const TemplateInfo* info = new TemplateInfo(form->item(1));
+    form->setInfo(const_cast<TemplateInfo*>(info));
+    return info->get();
+}
+
+//  As macroExpand, but each expansion is kept with the call it came from,
+//  and only made again if the call finds a different macro. The expansion
+//  is analysed in env, so that its symbols are resolved once as well.
+static malValuePtr expandCached(malValuePtr ast, const malEnvPtr& env)
+{
+    while (const malLambda* macro = isMacroApplication(ast, env)) {
+        const malList* list = STATIC_CAST(malList, ast);
+        const EvalInfo* kept = static_cast<const EvalInfo*>(list->info());
+        if (kept && (kept->kind() == EvalInfo::EXPANSION) &&
+            static_cast<const ExpansionInfo*>(kept)->isExpansionBy(macro)) {
+            ast = static_cast<const ExpansionInfo*>(kept)->expansion();
+            continue;
+        }
+        malValuePtr expansion = macro->apply(list->begin() + 1, list->end());
+        expansion = Analyser(env).rewrite(expansion);
+        list->setInfo(new ExpansionInfo(macro, expansion));
+        ast = expansion;
+    }
+    return ast;
+}
+
+Analyser::Analyser(const malEnvPtr& env)
+{
+    for (malEnv* frame = env.ptr(); frame && frame->layout();
+         frame = frame->outer()) {
+        m_scopes.push_back(frame->layout());
+    }
+    std::reverse(m_scopes.begin(), m_scopes.end());
+}
+
+FormInfo* Analyser::analyse(const malList* form)
+{
+    const malSymbol* special = STATIC_CAST(malSymbol, form->item(0));
+    if (special->identity() == s_fn) {
+        return analyseFn(form);
+    }
+    if (special->identity() == s_let) {
+        return analyseLet(form);
+    }
+    return analyseCatch(form);
+}
+
+FormInfo* Analyser::analyseFn(const malList* form)
+{
+    const malSequence* bindings = VALUE_CAST(malSequence, form->item(1));
+    malSymbolVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        params.push_back(VALUE_CAST(malSymbol, bindings->item(i)));
+    }
+
+    FormInfo* info = new FormInfo(new malFrameLayout(params), innermost());
+    m_scopes.push_back(info->layout());
+    info->setBody(rewrite(form->item(2)));
+    m_scopes.pop_back();
+    return info;
+}
+
+FormInfo* Analyser::analyseLet(const malList* form)
+{
+    const malSequence* bindings = VALUE_CAST(malSequence, form->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+    malFrameLayoutPtr layout(new malFrameLayout);
+    std::vector<int> slots;
+    for (int i = 0; i < count; i += 2) {
+        slots.push_back(layout->add(VALUE_CAST(malSymbol, bindings->item(i))));
+    }
+
+    // Every binding is in scope throughout, as a closure in an initialiser
+    // may see names bound after it. Until then the slot is empty, and the
+    // lookup falls back to searching by name.
+    FormInfo* info = new FormInfo(layout, innermost());
+    m_scopes.push_back(layout);
+    for (int i = 0; i < count; i += 2) {
+        info->addInit(slots[i / 2], rewrite(bindings->item(i + 1)));
+    }
+    info->setBody(rewrite(form->item(2)));
+    m_scopes.pop_back();
+    return info;
+}
+
+FormInfo* Analyser::analyseCatch(const malList* form)
+{
+    malFrameLayoutPtr layout(new malFrameLayout);
+    layout->add(VALUE_CAST(malSymbol, form->item(1)));
+
+    FormInfo* info = new FormInfo(layout, innermost());
+    m_scopes.push_back(layout);
+    info->setBody(rewrite(form->item(2)));
+    m_scopes.pop_back();
+    return info;
+}
+
+malValuePtr Analyser::rewrite(const malValuePtr& form)
+{
+    if (form.isInteger()) {
+        return form;
+    }
+    switch (form.type()) {
+        case TYPE_SYMBOL:
+            return resolve(form);
+
+        case TYPE_LIST:
+            return rewriteList(form);
+
+        case TYPE_VECTOR: {
+            const malVector* vec = STATIC_CAST(malVector, form);
+            malValueVec* items = new malValueVec;
+            bool changed = false;
+            for (int i = 0; i < vec->count(); i++) {
+                items->push_back(rewrite(vec->item(i)));
+                changed |= (items->back() != vec->item(i));
+            }
+            if (!changed) {
+                delete items;
+                return form;
+            }
+            return mal::vector(items);
+        }
+
+        case TYPE_HASH: {
+            // Only the values of a hash-map literal are evaluated.
+            const malHash* hash = STATIC_CAST(malHash, form);
+            if (hash->isEvaluated()) {
+                return form;
+            }
+            malValueVec items;
+            hash->entries(items);
+            bool changed = false;
+            for (auto it = items.begin(); it != items.end(); it += 2) {
+                malValuePtr value = rewrite(it[1]);
+                changed |= (value != it[1]);
+                it[1] = value;
+            }
+            return changed ? mal::hash(items.data(),
+                                       items.data() + items.size(), false)
+                           : form;
+        }
+
+        default:
+            return form;
+    }
+}
+
+malValuePtr Analyser::rewriteList(const malValuePtr& form)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    if (list->isEmpty()) {
+        return form;
+    }
+
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        const malSymbol* special = symbol->identity();
+        if ((special == s_quote) || (special == s_quasiquoteexpand) ||
+            (special == s_macroexpand)) {
+            return form;
+        }
+        if (special == s_quasiquote) {
+            return rewriteQuasi(form);
+        }
+        if (((special == s_fn) || (special == s_let) || (special == s_catch))
+            && (list->count() == 3)) {
+            FormInfo* info;
+            try {
+                info = analyse(list);
+            }
+            catch (String&) {
+                return form; // let EVAL report the error, if it gets there
+            }
+            malValuePtr head = list->item(0);
+            malValuePtr second = list->item(1);
+            if (special == s_let) {
+                const malSequence* bindings = STATIC_CAST(malSequence, second);
+                malValueVec* items = new malValueVec;
+                for (int i = 0; i < info->initCount(); i++) {
+                    items->push_back(bindings->item(2 * i));
+                    items->push_back(info->init(i));
+                }
+                second = mal::vector(items);
+            }
+            malValuePtr rewritten = mal::list(head, second, info->body());
+            STATIC_CAST(malList, rewritten)->setInfo(info);
+            return rewritten;
+        }
+    }
+
+    malValueVec* items = new malValueVec;
+    bool changed = false;
+    for (int i = 0; i < list->count(); i++) {
+        items->push_back(rewrite(list->item(i)));
+        changed |= (items->back() != list->item(i));
+    }
+    if (!changed) {
+        delete items;
+        return form;
+    }
+    return mal::list(items);
+}
+
+//  Only the unquoted parts of a quasiquoted form are evaluated.
+malValuePtr Analyser::rewriteQuasi(const malValuePtr& form)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq || seq->isEmpty()) {
+        return form;
+    }
+    if ((seq->type() == TYPE_LIST) && (seq->count() == 2) &&
+        (isSymbol(seq->item(0), s_unquote) ||
+         isSymbol(seq->item(0), s_spliceUnquote))) {
+        malValuePtr arg = rewrite(seq->item(1));
+        return (arg == seq->item(1)) ? form : mal::list(seq->item(0), arg);
+    }
+
+    malValueVec* items = new malValueVec;
+    bool changed = false;
+    for (int i = 0; i < seq->count(); i++) {
+        items->push_back(rewriteQuasi(seq->item(i)));
+        changed |= (items->back() != seq->item(i));
+    }
+    if (!changed) {
+        delete items;
+        return form;
+    }
+    return (seq->type() == TYPE_LIST) ? mal::list(items) : mal::vector(items);
+}
+
+malValuePtr Analyser::resolve(const malValuePtr& form)
+{
+    const malSymbol* symbol = STATIC_CAST(malSymbol, form);
+    for (int i = m_scopes.size() - 1; i >= 0; i--) {
+        int slot = m_scopes[i]->slotOf(symbol);
+        if (slot >= 0) {
+            int depth = m_scopes.size() - 1 - i;
+            return new malLocalRef(*symbol, depth, slot, m_scopes[i]);
+        }
+    }
+    return new malGlobalRef(*symbol, innermost());
+}
+
 static const char* malFunctionTable[] = {
     "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
     "(def! not (fn* (cond) (if cond false true)))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
     "(def! *host-language* \"C++\")",
 };
 
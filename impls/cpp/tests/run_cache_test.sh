@@ -0,0 +1,108 @@
+#!/bin/bash
+
+#
+# Usage: run_cache_test.sh <command line arguments to run mal>
+#
+# Example: run_cache_test.sh ./stepA_mal
+#
+# Loads a file with MAL_CACHE_DIR set, and checks that its cached forms
+# are used while it's unchanged, and that it's read again when it changes
+# or its cache is damaged.
+#
+
+# Run the file, which prints its value, and check that it printed $1.
+assert_loads() {
+  out="$( MAL_CACHE_DIR=$cachedir $mal $source </dev/null 2>&1 )"
+  status=$?
+  if [ "$status" = 0 ] && [ "$out" = "$1" ] ; then
+    echo "OK: '$out'"
+  else
+    echo "FAIL: Expected '$1' but got '$out' (exit status $status)"
+    echo
+    exit 1
+  fi
+}
+
+# Check that the cache was left alone ($1 = same) or written again
+# ($1 = new) since $last. A cache is written to a file of its own and
+# renamed, so a new one has a new inode.
+assert_cache() {
+  cache="$( ls $cachedir/*.forms 2>/dev/null )"
+  if [ "$( echo "$cache" | wc -w )" != 1 ] ; then
+    echo "FAIL: Expected one cache file but got '$cache'"
+    echo
+    exit 1
+  fi
+  now="$( stat -c %i $cache )"
+  if [ "$1" = same ] && [ "$now" != "$last" ] ; then
+    echo "FAIL: Expected the cache to be used, but it was written again"
+    echo
+    exit 1
+  fi
+  if [ "$1" = new ] && [ "$now" = "$last" ] ; then
+    echo "FAIL: Expected the cache to be written again, but it wasn't"
+    echo
+    exit 1
+  fi
+  echo "OK: cache is $1"
+  last="$now"
+}
+
+# Write a file which prints $1, padded with a comment so that it's big
+# enough to be cached.
+source_of() {
+  {
+    for i in $(seq 40) ; do
+      echo ";; Padding to make this file worth caching, line $i"
+    done
+    echo "(def! cached-value $1)"
+    echo "(println cached-value)"
+  } > $source
+}
+
+if [ -z "$1" ] ; then
+  echo "Usage: $0 <command line arguments to run mal>"
+  exit 1
+fi
+
+mal="$@"
+cachedir="$(mktemp -d)"
+source="$(mktemp)"
+trap 'rm -rf $cachedir $source' EXIT
+
+# The first load writes the cache, and the second reads it
+source_of 1
+assert_loads 1
+assert_cache new
+assert_loads 1
+assert_cache same
+
+# A changed file misses the cache
+source_of 2
+assert_loads 2
+assert_cache new
+assert_loads 2
+assert_cache same
+
+# A truncated cache is ignored, and replaced
+head -c -1 $cache > $cache.part && mv $cache.part $cache
+last="$( stat -c %i $cache )"
+assert_loads 2
+assert_cache new
+
+# So is one whose forms are garbage
+{ head -c -10 $cache ; printf '\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff' ; } \
+  > $cache.part && mv $cache.part $cache
+last="$( stat -c %i $cache )"
+assert_loads 2
+assert_cache new
+
+# And one which isn't a cache at all
+printf 'not a cache' > $cache
+assert_loads 2
+assert_cache new
+assert_loads 2
+assert_cache same
+
+echo 'Passed all cache tests'
+echo
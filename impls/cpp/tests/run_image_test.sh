@@ -0,0 +1,83 @@
+#!/bin/bash
+
+#
+# Usage: run_image_test.sh <command line arguments to run mal>
+#
+# Example: run_image_test.sh ./stepA_mal
+#
+# Loads malformed images, each of which must be rejected with an error
+# rather than crash the interpreter.
+#
+
+assert_error() {
+  out="$( $mal --image $image </dev/null 2>&1 )"
+  status=$?
+  if [ "$status" = 1 ] && [ "$out" = "Error: $1" ] ; then
+    echo "OK: '$out'"
+  else
+    echo "FAIL: Expected 'Error: $1' but got '$out' (exit status $status)"
+    echo
+    exit 1
+  fi
+}
+
+# Write an image made of the records in $1, which is printf format.
+image_of() {
+  printf "mal-image 1\n$1" > $image
+}
+
+if [ -z "$1" ] ; then
+  echo "Usage: $0 <command line arguments to run mal>"
+  exit 1
+fi
+
+mal="$@"
+image="$(mktemp)"
+trap 'rm -f $image' EXIT
+
+printf 'not an image' > $image
+assert_error 'Not a mal image'
+
+# A real image, cut short
+$mal --dump-image $image </dev/null
+head -c 1000 $image > $image.part && mv $image.part $image
+assert_error 'Image is truncated'
+
+# A symbol record, without its text
+image_of '\x05'
+assert_error 'Image is truncated'
+
+# A number with more than 64 bits
+image_of '\x80\x80\x80\x80\x80\x80\x80\x80\x80\x80\x01'
+assert_error 'Bad number in image'
+
+# A layout with more names than there are bytes left
+image_of '\x0f\xff\xff\xff\xff\xff\xff\xff\x7f'
+assert_error 'Bad number in image'
+
+# A list with more items than there are bytes left
+image_of '\x08\xff\xff\xff\xff\x0f'
+assert_error 'Image is truncated'
+
+# A layout with an arity of more than its names
+image_of '\x0f\x01\x01a\x00\x05'
+assert_error 'Bad number in image'
+
+# An empty layout, and a local in slot 5 of it
+image_of '\x0f\x00\x00\x00\x06\x01a\x00\x05\x02'
+assert_error 'Bad local in image'
+
+# nil, and a function of it with no params layout
+image_of '\x01\x03nil\x0c\x00\x02\x00\x00'
+assert_error 'Bad function in image'
+
+# A list of a record which doesn't exist
+image_of '\x08\x01\x08'
+assert_error 'Bad reference in image'
+
+# A builtin which doesn't exist
+image_of '\x0b\x03foo'
+assert_error 'Image refers to unknown builtin foo'
+
+echo 'Passed all image tests'
+echo